@@ -274,6 +274,20 @@ xm_allocator_read(xm_allocator_t *allocator, uint64_t data_ptr,
 	}
 }
 
+void
+xm_allocator_prefetch(xm_allocator_t *allocator, uint64_t data_ptr,
+    size_t size_bytes)
+{
+	if (data_ptr == XM_NULL_PTR || allocator->path == NULL)
+		return;
+#ifdef POSIX_FADV_WILLNEED
+	(void)posix_fadvise(allocator->fd, (off_t)get_block_offset(data_ptr),
+	    (off_t)size_bytes, POSIX_FADV_WILLNEED);
+#else
+	(void)size_bytes;
+#endif
+}
+
 void
 xm_allocator_write(xm_allocator_t *allocator, uint64_t data_ptr,
     const void *mem, size_t size_bytes)
@@ -62,6 +62,16 @@ uint64_t xm_allocator_allocate(xm_allocator_t *allocator,
 void xm_allocator_read(xm_allocator_t *allocator, uint64_t data_ptr,
     void *mem, size_t size_bytes);
 
+/** Hint that data at the \p data_ptr will be read soon. For file-backed
+ *  allocators this starts reading the data in the background so that a later
+ *  ::xm_allocator_read does not wait on the disk. This function never blocks
+ *  and does nothing for RAM-backed allocators.
+ *  \param allocator An allocator.
+ *  \param data_ptr Data pointer.
+ *  \param size_bytes Size of data in bytes. */
+void xm_allocator_prefetch(xm_allocator_t *allocator, uint64_t data_ptr,
+    size_t size_bytes);
+
 /** Write data from memory into the \p data_ptr. The size argument must match
  *  the size of the corresponding allocation.
  *  \param allocator An allocator.
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2014-2018 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "blas.h"
+
+#if defined(XM_BLAS_MKL)
+int mkl_set_num_threads_local(int);
+#elif defined(XM_BLAS_OPENBLAS)
+int openblas_set_num_threads_local(int);
+#endif
+
+int
+xm_blas_has_threads(void)
+{
+#if defined(XM_BLAS_MKL) || defined(XM_BLAS_OPENBLAS)
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+int
+xm_blas_set_threads(int nthreads)
+{
+#if defined(XM_BLAS_MKL)
+	return mkl_set_num_threads_local(nthreads);
+#elif defined(XM_BLAS_OPENBLAS)
+	return openblas_set_num_threads_local(nthreads);
+#else
+	(void)nthreads;
+	return 1;
+#endif
+}
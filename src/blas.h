@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2014-2018 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef XM_BLAS_H_INCLUDED
+#define XM_BLAS_H_INCLUDED
+
+/* Private header */
+
+#include <limits.h>
+#include <stdint.h>
+
+/* Integer type of the BLAS interface.  Define XM_BLAS_ILP64 when linking
+ * with a BLAS library built with 64-bit integers.  Otherwise matrices with
+ * dimensions beyond the 32-bit range are multiplied in tiles. */
+#ifdef XM_BLAS_ILP64
+typedef int64_t xm_blas_int_t;
+#define XM_BLAS_INT_MAX INT64_MAX
+#else
+typedef int xm_blas_int_t;
+#define XM_BLAS_INT_MAX INT_MAX
+#endif
+
+/* Thread control of the BLAS library.  Define XM_BLAS_MKL or
+ * XM_BLAS_OPENBLAS when linking with a threaded build of the library.
+ * Otherwise BLAS is assumed to be sequential and these do nothing. */
+
+/* Return non-zero if the number of BLAS threads can be controlled. */
+int xm_blas_has_threads(void);
+
+/* Set the number of threads used by BLAS calls made from the calling
+ * thread.  Returns the previous value which can be passed back to restore
+ * it. */
+int xm_blas_set_threads(int nthreads);
+
+#endif /* XM_BLAS_H_INCLUDED */
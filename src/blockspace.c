@@ -96,6 +96,36 @@ xm_block_space_permute_clone(const xm_block_space_t *bs, xm_dim_t permutation)
 	return ret;
 }
 
+xm_block_space_t *
+xm_block_space_slice(const xm_block_space_t *bs, xm_dim_t blk_lo,
+    xm_dim_t blk_hi)
+{
+	xm_block_space_t *ret;
+	size_t i, j;
+
+	assert(blk_lo.n == bs->dims.n && blk_hi.n == bs->dims.n);
+	assert(xm_dim_less(&blk_lo, &blk_hi));
+
+	if ((ret = calloc(1, sizeof *ret)) == NULL)
+		return NULL;
+	ret->dims.n = bs->dims.n;
+	ret->nblocks.n = bs->nblocks.n;
+	for (i = 0; i < ret->dims.n; i++) {
+		assert(blk_hi.i[i] <= bs->nblocks.i[i]);
+		ret->nblocks.i[i] = blk_hi.i[i] - blk_lo.i[i];
+		ret->splits[i] = malloc((ret->nblocks.i[i]+1)*sizeof(size_t));
+		if (ret->splits[i] == NULL) {
+			xm_block_space_free(ret);
+			return NULL;
+		}
+		for (j = 0; j < ret->nblocks.i[i]+1; j++)
+			ret->splits[i][j] = bs->splits[i][blk_lo.i[i]+j] -
+			    bs->splits[i][blk_lo.i[i]];
+		ret->dims.i[i] = ret->splits[i][ret->nblocks.i[i]];
+	}
+	return ret;
+}
+
 size_t
 xm_block_space_get_ndims(const xm_block_space_t *bs)
 {
@@ -46,6 +46,16 @@ xm_block_space_t *xm_block_space_clone(const xm_block_space_t *bs);
 xm_block_space_t *xm_block_space_permute_clone(const xm_block_space_t *bs,
     xm_dim_t permutation);
 
+/** Create a block-space from a range of blocks of another block-space. The
+ *  new block-space contains blocks with indices from \p blk_lo (inclusive) to
+ *  \p blk_hi (exclusive) along each dimension.
+ *  \param bs Block-space.
+ *  \param blk_lo Index of the first block of the range.
+ *  \param blk_hi Index past the last block of the range.
+ *  \return New block-space instance. */
+xm_block_space_t *xm_block_space_slice(const xm_block_space_t *bs,
+    xm_dim_t blk_lo, xm_dim_t blk_hi);
+
 /** Return number of dimensions a block-space has.
  *  \param bs Block-space.
  *  \return Number of dimensions. */
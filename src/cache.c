@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2014-2018 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "cache.h"
+#include "util.h"
+
+#define CACHE_BUCKETS 1024
+
+/* Entry data is preceded by this many bytes holding the entry pointer. */
+#define CACHE_HEADER 64
+
+struct xm_cache_entry {
+	void *key, *data;
+	size_t keysize, bytes, hash, refs;
+	int ready;
+#ifdef _OPENMP
+	omp_lock_t lock; /* held by the filling thread until ready */
+#endif
+	struct xm_cache_entry *next; /* next entry in the bucket */
+	struct xm_cache_entry *lru_prev, *lru_next;
+};
+
+struct xm_cache {
+	struct xm_cache_entry *buckets[CACHE_BUCKETS];
+	struct xm_cache_entry *lru_head, *lru_tail;
+	size_t bytes, maxbytes, peak;
+	int dry; /* entries hold no data */
+#ifdef _OPENMP
+	omp_lock_t mutex;
+#endif
+};
+
+static void
+cache_lock(xm_cache_t *cache)
+{
+#ifdef _OPENMP
+	omp_set_lock(&cache->mutex);
+#else
+	(void)cache;
+#endif
+}
+
+static void
+cache_unlock(xm_cache_t *cache)
+{
+#ifdef _OPENMP
+	omp_unset_lock(&cache->mutex);
+#else
+	(void)cache;
+#endif
+}
+
+static size_t
+cache_hash(const void *key, size_t keysize)
+{
+	const unsigned char *p = key;
+	size_t i, h = 2166136261u;
+
+	for (i = 0; i < keysize; i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+static struct xm_cache_entry *
+cache_entry(void *data)
+{
+	struct xm_cache_entry *entry;
+
+	memcpy(&entry, (char *)data - CACHE_HEADER, sizeof entry);
+	return entry;
+}
+
+static void
+lru_unlink(xm_cache_t *cache, struct xm_cache_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+lru_push(xm_cache_t *cache, struct xm_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+}
+
+static void
+entry_free(struct xm_cache_entry *entry)
+{
+#ifdef _OPENMP
+	omp_destroy_lock(&entry->lock);
+#endif
+	free((char *)entry->data - CACHE_HEADER);
+	free(entry->key);
+	free(entry);
+}
+
+/* Evict the least recently used unreferenced entry. */
+static int
+cache_evict(xm_cache_t *cache)
+{
+	struct xm_cache_entry *entry, **p;
+
+	for (entry = cache->lru_tail; entry; entry = entry->lru_prev)
+		if (entry->refs == 0)
+			break;
+	if (entry == NULL)
+		return 0;
+	p = &cache->buckets[entry->hash % CACHE_BUCKETS];
+	while (*p != entry)
+		p = &(*p)->next;
+	*p = entry->next;
+	lru_unlink(cache, entry);
+	cache->bytes -= entry->bytes;
+	entry_free(entry);
+	return 1;
+}
+
+xm_cache_t *
+xm_cache_create(size_t maxbytes)
+{
+	xm_cache_t *cache;
+
+	if ((cache = calloc(1, sizeof *cache)) == NULL)
+		fatal("out of memory");
+	cache->maxbytes = maxbytes;
+#ifdef _OPENMP
+	omp_init_lock(&cache->mutex);
+#endif
+	return cache;
+}
+
+xm_cache_t *
+xm_cache_create_dry(size_t maxbytes)
+{
+	xm_cache_t *cache;
+
+	cache = xm_cache_create(maxbytes);
+	cache->dry = 1;
+	return cache;
+}
+
+void *
+xm_cache_get(xm_cache_t *cache, const void *key, size_t keysize,
+    size_t bytes, int *fill)
+{
+	struct xm_cache_entry *entry;
+	size_t hash;
+	char *p;
+
+	hash = cache_hash(key, keysize);
+	*fill = 0;
+	cache_lock(cache);
+	for (entry = cache->buckets[hash % CACHE_BUCKETS]; entry;
+	    entry = entry->next) {
+		if (entry->hash == hash && entry->keysize == keysize &&
+		    entry->bytes == bytes &&
+		    memcmp(entry->key, key, keysize) == 0)
+			break;
+	}
+	if (entry) {
+		entry->refs++;
+		lru_unlink(cache, entry);
+		lru_push(cache, entry);
+		if (entry->ready) {
+			cache_unlock(cache);
+			return entry->data;
+		}
+		cache_unlock(cache);
+#ifdef _OPENMP
+		omp_set_lock(&entry->lock);
+		omp_unset_lock(&entry->lock);
+#endif
+		return entry->data;
+	}
+	while (cache->bytes + bytes > cache->maxbytes && cache_evict(cache))
+		continue;
+	if (cache->bytes + bytes > cache->maxbytes) {
+		cache_unlock(cache);
+		return NULL;
+	}
+	if ((entry = calloc(1, sizeof *entry)) == NULL)
+		fatal("out of memory");
+	if ((entry->key = malloc(keysize)) == NULL)
+		fatal("out of memory");
+	if ((p = malloc(CACHE_HEADER + (cache->dry ? 0 : bytes))) == NULL)
+		fatal("out of memory");
+	memcpy(entry->key, key, keysize);
+	memcpy(p, &entry, sizeof entry);
+	entry->data = p + CACHE_HEADER;
+	entry->keysize = keysize;
+	entry->bytes = bytes;
+	entry->hash = hash;
+	entry->refs = 1;
+#ifdef _OPENMP
+	omp_init_lock(&entry->lock);
+	omp_set_lock(&entry->lock);
+#endif
+	entry->next = cache->buckets[hash % CACHE_BUCKETS];
+	cache->buckets[hash % CACHE_BUCKETS] = entry;
+	lru_push(cache, entry);
+	cache->bytes += bytes;
+	if (cache->bytes > cache->peak)
+		cache->peak = cache->bytes;
+	cache_unlock(cache);
+	*fill = 1;
+	return entry->data;
+}
+
+void
+xm_cache_done(xm_cache_t *cache, void *data)
+{
+	struct xm_cache_entry *entry = cache_entry(data);
+
+	cache_lock(cache);
+	entry->ready = 1;
+	cache_unlock(cache);
+#ifdef _OPENMP
+	omp_unset_lock(&entry->lock);
+#endif
+}
+
+void
+xm_cache_release(xm_cache_t *cache, void *data)
+{
+	struct xm_cache_entry *entry = cache_entry(data);
+
+	cache_lock(cache);
+	if (entry->refs == 0)
+		fatal("unbalanced release");
+	entry->refs--;
+	cache_unlock(cache);
+}
+
+size_t
+xm_cache_get_peak_bytes(const xm_cache_t *cache)
+{
+	return cache->peak;
+}
+
+void
+xm_cache_destroy(xm_cache_t *cache)
+{
+	struct xm_cache_entry *entry, *next;
+
+	if (cache == NULL)
+		return;
+	for (entry = cache->lru_head; entry; entry = next) {
+		next = entry->lru_next;
+		entry_free(entry);
+	}
+#ifdef _OPENMP
+	omp_destroy_lock(&cache->mutex);
+#endif
+	free(cache);
+}
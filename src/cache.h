@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2014-2018 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef XM_CACHE_H_INCLUDED
+#define XM_CACHE_H_INCLUDED
+
+/* Private header */
+
+#include <stddef.h>
+
+/* Thread-safe cache of data buffers with reference counting.  Entries are
+ * identified by a key of arbitrary bytes.  Entries that are not referenced
+ * are evicted in least recently used order when the cache is full. */
+typedef struct xm_cache xm_cache_t;
+
+xm_cache_t *xm_cache_create(size_t maxbytes);
+
+/* Create a cache whose entries account for their size but hold no data.
+ * It is used to simulate the cache without touching any data. */
+xm_cache_t *xm_cache_create_dry(size_t maxbytes);
+
+/* Return a referenced entry for the key.  If the entry was created by this
+ * call *fill is set to non-zero and the caller must fill the data and then
+ * call xm_cache_done.  Other threads requesting the same entry wait until it
+ * is filled.  Returns NULL if the entry does not fit into the cache. */
+void *xm_cache_get(xm_cache_t *cache, const void *key, size_t keysize,
+    size_t bytes, int *fill);
+
+/* Mark entry data returned by xm_cache_get as filled. */
+void xm_cache_done(xm_cache_t *cache, void *data);
+
+/* Drop the reference to entry data returned by xm_cache_get. */
+void xm_cache_release(xm_cache_t *cache, void *data);
+
+/* Return the largest number of bytes held by the cache so far. */
+size_t xm_cache_get_peak_bytes(const xm_cache_t *cache);
+
+void xm_cache_destroy(xm_cache_t *cache);
+
+#endif /* XM_CACHE_H_INCLUDED */
@@ -14,42 +14,171 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #ifdef XM_USE_MPI
 #include <mpi.h>
 #endif
 
 #include "xm.h"
+#include "blas.h"
+#include "cache.h"
+#include "gemm.h"
 #include "util.h"
+#include "work.h"
 
 struct blockpair {
 	xm_dim_t blkidxa, blkidxb;
 	xm_scalar_t alpha;
+	double bound; /* upper bound for the norm of the contribution */
+};
+
+/* Data contracted by a pair of blocks.  Pairs with equal keys are merged. */
+struct pairkey {
+	uint64_t data_ptra, data_ptrb;
+	size_t perm[2 * XM_MAX_DIM];
+};
+
+/* Per-thread state for merging block pairs of an output block. */
+struct pairmerge {
+	struct blockpair *pairs;
+	struct pairkey *keys, *prevkeys;
+	size_t *rep; /* pair into which each pair is merged */
+	size_t *table; /* hash table of pair indices plus one */
+	size_t tablesize;
+	int valid; /* rep holds the merge result for prevkeys */
+};
+
+/* Block pairs with contribution bound below this value are skipped. */
+static double screen_threshold = 0.0;
+
+/* Memory for unfolded operand blocks kept in the operand cache.  The limit
+ * is shared by all threads of a process. */
+static size_t panel_limit = (size_t)256 * 1024 * 1024;
+
+/* Stack unfolded blocks along the contraction dimension for a single GEMM. */
+static int concat_k = 1;
+
+/* Precision of GEMM calls on double precision tensors. */
+static xm_precision_t gemm_precision = XM_PRECISION_FULL;
+
+/* In adaptive mixed precision, pairs of blocks with norm bound below the
+ * largest bound for the output block divided by this are done in single
+ * precision. */
+#define MIXED_BOUND_RATIO 4096.0
+
+/* Divide threads between output blocks and threaded BLAS calls. */
+static int adaptive_threads = 1;
+
+/* Output blocks with fewer elements always use a single BLAS thread. */
+#define BLAS_THREAD_BLOCK_SIZE (256 * 256)
+
+/* Size of each of the stacked A and B buffers unless the memory limit is
+ * lower.  Larger stacks are split. */
+#define CONCAT_BYTES (8 * 1024 * 1024)
+
+/* Relative cost of moving a byte compared to a floating-point operation
+ * when tiles are ordered and distributed between processes. */
+#define TILE_BYTE_COST 8.0
+
+/* Tile size of GEMMs whose leading dimensions exceed the BLAS integer
+ * range.  Such tiles are copied into compact buffers. */
+#define GEMM_PACK_TILE 2048
+
+typedef enum {
+	STATIONARY_C = 0, /* each output block reads its own operand blocks */
+	STATIONARY_A, /* A blocks are kept in memory for a tile */
+	STATIONARY_B, /* B blocks are kept in memory for a tile */
+} stationary_t;
+
+/* Output block with the operand rows it depends on. */
+struct cblock {
+	xm_dim_t blkidx;
+	size_t pos, keya, keyb;
+	size_t bytesa, bytesb; /* bytes of operand blocks read */
+};
+
+/* Range of output blocks that share the stationary operand blocks. */
+struct tile {
+	size_t first, count;
+	double cost; /* estimated flops and bytes */
+};
+
+struct schedule {
+	stationary_t stationary;
+	struct cblock *cblocks;
+	struct tile *tiles;
+	int *owner; /* process of each tile if assigned statically */
+	size_t ntiles;
+};
+
+/* Unfolded operand blocks along the contraction dimension that are held in
+ * the operand cache for the duration of a tile. */
+struct panel {
+	void **data;
+	size_t n;
+};
+
+/* Validated operands and index masks of a single contraction.  Batch
+ * indices, which appear in all three tensors, come last in the masks of
+ * the free indices so that blocks of a and b follow the output block. */
+struct term {
+	xm_scalar_t alpha;
+	const xm_tensor_t *a, *b;
+	xm_dim_t cidxa, aidxa, cidxb, aidxb, cidxc, aidxc;
+	size_t nblkk, nbatch;
+};
+
+/* Per-thread buffers for computing output blocks. */
+struct workspace {
+	void *bufa1, *bufa2, *bufb1, *bufb2, *bufc1, *bufc2;
+	void *concata, *concatb;
+	void *mixa, *mixb, *mixc; /* single precision copies */
+	size_t maxa, maxb, maxc, concatbytesa, concatbytesb;
+	size_t mixbytesa, mixbytesb, mixbytesc;
+	xm_precision_t precision;
+	const xm_tensor_t *d; /* output blocks are dotted with d if set */
+	void *bufd; /* blocks of d, or scratch space of the epilogue */
+	xm_scalar_t dot;
+	xm_epilogue_t epilogue; /* applied to output blocks if set */
+	void *epilogue_data;
 };
 
-void sgemm_(char *, char *, long int *, long int *, long int *,
-    float *, float *, long int *,
-    float *, long int *, float *,
-    float *, long int *);
-void cgemm_(char *, char *, long int *, long int *, long int *,
-    float complex *, float complex *, long int *,
-    float complex *, long int *, float complex *,
-    float complex *, long int *);
-void dgemm_(char *, char *, long int *, long int *, long int *,
-    double *, double *, long int *,
-    double *, long int *, double *,
-    double *, long int *);
-void zgemm_(char *, char *, long int *, long int *, long int *,
-    double complex *, double complex *, long int *,
-    double complex *, long int *, double complex *,
-    double complex *, long int *);
-
-static void
-xgemm(char transa, char transb, long int m, long int n, long int k,
-    xm_scalar_t alpha, void *a, long int lda, void *b, long int ldb,
-    xm_scalar_t beta, void *c, long int ldc, int type)
+/* Key of an unfolded operand block in the operand cache. */
+struct operand_key {
+	const xm_tensor_t *tensor;
+	uint64_t data_ptr;
+	xm_dim_t permutation, mask_i, mask_j;
+	size_t stride;
+};
+
+void sgemm_(char *, char *, xm_blas_int_t *, xm_blas_int_t *,
+    xm_blas_int_t *, float *, float *, xm_blas_int_t *,
+    float *, xm_blas_int_t *, float *,
+    float *, xm_blas_int_t *);
+void cgemm_(char *, char *, xm_blas_int_t *, xm_blas_int_t *,
+    xm_blas_int_t *, float complex *, float complex *, xm_blas_int_t *,
+    float complex *, xm_blas_int_t *, float complex *,
+    float complex *, xm_blas_int_t *);
+void dgemm_(char *, char *, xm_blas_int_t *, xm_blas_int_t *,
+    xm_blas_int_t *, double *, double *, xm_blas_int_t *,
+    double *, xm_blas_int_t *, double *,
+    double *, xm_blas_int_t *);
+void zgemm_(char *, char *, xm_blas_int_t *, xm_blas_int_t *,
+    xm_blas_int_t *, double complex *, double complex *, xm_blas_int_t *,
+    double complex *, xm_blas_int_t *, double complex *,
+    double complex *, xm_blas_int_t *);
+
+static void
+blas_gemm(char transa, char transb, xm_blas_int_t m, xm_blas_int_t n,
+    xm_blas_int_t k, xm_scalar_t alpha, void *a, xm_blas_int_t lda, void *b,
+    xm_blas_int_t ldb, xm_scalar_t beta, void *c, xm_blas_int_t ldc,
+    int type)
 {
 	switch (type) {
 	case XM_SCALAR_FLOAT: {
@@ -83,232 +212,2077 @@ xgemm(char transa, char transb, long int m, long int n, long int k,
 	}
 }
 
-static int
-same_contraction(const struct blockpair *pairs, size_t i, size_t j,
-    xm_dim_t aidxa, xm_dim_t aidxb, const xm_tensor_t *a, const xm_tensor_t *b)
-{
-	xm_dim_t dia, dja, dib, djb, pia, pja, pib, pjb;
-	size_t ii;
-
-	dia = pairs[i].blkidxa;
-	dja = pairs[j].blkidxa;
-	dib = pairs[i].blkidxb;
-	djb = pairs[j].blkidxb;
-	if (xm_tensor_get_block_data_ptr(a, dia) !=
-	    xm_tensor_get_block_data_ptr(a, dja) ||
-	    xm_tensor_get_block_data_ptr(b, dib) !=
-	    xm_tensor_get_block_data_ptr(b, djb))
-		return 0;
-	pia = xm_tensor_get_block_permutation(a, dia);
-	pja = xm_tensor_get_block_permutation(a, dja);
-	pib = xm_tensor_get_block_permutation(b, dib);
-	pjb = xm_tensor_get_block_permutation(b, djb);
-	for (ii = 0; ii < aidxa.n; ii++) {
-		if (pia.i[aidxa.i[ii]] != pja.i[aidxa.i[ii]])
-			return 0;
+/* Copy a rows x cols column-major matrix. */
+static void
+copy_matrix(void *dst, size_t ldd, const void *src, size_t lds, size_t rows,
+    size_t cols, size_t size)
+{
+	size_t j;
+
+	for (j = 0; j < cols; j++)
+		memcpy((char *)dst + j * ldd * size,
+		    (const char *)src + j * lds * size, rows * size);
+}
+
+/* Return the address of the (i, j) tile of op(X) and make *ldt its leading
+ * dimension.  If the leading dimension of X does not fit into the BLAS
+ * integer type the tile is copied into buf. */
+static void *
+gemm_tile(char trans, void *x, size_t ldx, size_t i, size_t j, size_t rows,
+    size_t cols, void *buf, size_t *ldt, size_t size)
+{
+	void *t;
+
+	if (trans != 'N') {
+		size_t tmp;
+
+		tmp = i;
+		i = j;
+		j = tmp;
+		tmp = rows;
+		rows = cols;
+		cols = tmp;
 	}
-	for (ii = 0; ii < aidxb.n; ii++) {
-		if (pib.i[aidxb.i[ii]] != pjb.i[aidxb.i[ii]])
-			return 0;
+	t = (char *)x + (i + j * ldx) * size;
+	if (ldx <= (size_t)XM_BLAS_INT_MAX) {
+		*ldt = ldx;
+		return t;
 	}
-	return 1;
+	copy_matrix(buf, rows, t, ldx, rows, cols, size);
+	*ldt = rows;
+	return buf;
 }
 
+/* GEMM on column-major matrices of any size.  Tiny products use the
+ * built-in kernels.  Products with dimensions that do not fit into the
+ * BLAS integer type are split into tiles that do. */
 static void
-compute_block(xm_scalar_t alpha, const xm_tensor_t *a, const xm_tensor_t *b,
-    xm_scalar_t beta, xm_tensor_t *c, xm_dim_t cidxa, xm_dim_t aidxa,
-    xm_dim_t cidxb, xm_dim_t aidxb, xm_dim_t cidxc, xm_dim_t aidxc,
-    xm_dim_t blkidxc, struct blockpair *pairs, void *buf)
+xgemm(char transa, char transb, size_t m, size_t n, size_t k,
+    xm_scalar_t alpha, void *a, size_t lda, void *b, size_t ldb,
+    xm_scalar_t beta, void *c, size_t ldc, int type)
 {
-	size_t maxblockbytesa = xm_tensor_get_largest_block_bytes(a);
-	size_t maxblockbytesb = xm_tensor_get_largest_block_bytes(b);
-	size_t maxblockbytesc = xm_tensor_get_largest_block_bytes(c);
-	xm_dim_t dims, blkidxa, blkidxb, nblocksa, nblocksb;
-	xm_scalar_t al;
-	void *bufa1, *bufa2, *bufb1, *bufb2, *bufc1, *bufc2;
-	size_t i, j, m, n, k, nblkk, blksize;
-	xm_scalar_type_t type;
+	const size_t max = (size_t)XM_BLAS_INT_MAX;
+	size_t i, j, p, mm, nn, kk, ldta, ldtb, ldtc, size, step;
+	void *bufa = NULL, *bufb = NULL, *bufc = NULL, *ta, *tb, *tc;
 
-	bufa1 = buf;
-	bufa2 = (char *)bufa1 + maxblockbytesa;
-	bufb1 = (char *)bufa2 + maxblockbytesa;
-	bufb2 = (char *)bufb1 + maxblockbytesb;
-	bufc1 = (char *)bufb2 + maxblockbytesb;
-	bufc2 = (char *)bufc1 + maxblockbytesc;
+	if (xm_small_gemm_fits(m, n, k, type)) {
+		xm_small_gemm(transa, transb, m, n, k, alpha, a, lda, b, ldb,
+		    beta, c, ldc, type);
+		return;
+	}
+	if (m <= max && n <= max && k <= max && lda <= max && ldb <= max &&
+	    ldc <= max) {
+		blas_gemm(transa, transb, (xm_blas_int_t)m, (xm_blas_int_t)n,
+		    (xm_blas_int_t)k, alpha, a, (xm_blas_int_t)lda, b,
+		    (xm_blas_int_t)ldb, beta, c, (xm_blas_int_t)ldc, type);
+		return;
+	}
+	size = xm_scalar_sizeof(type);
+	step = max;
+	if (lda > max || ldb > max || ldc > max) {
+		step = GEMM_PACK_TILE;
+		if ((bufa = malloc(step * step * size)) == NULL)
+			fatal("out of memory");
+		if ((bufb = malloc(step * step * size)) == NULL)
+			fatal("out of memory");
+		if ((bufc = malloc(step * step * size)) == NULL)
+			fatal("out of memory");
+	}
+	for (j = 0; j < n; j += nn) {
+		nn = n - j < step ? n - j : step;
+		for (i = 0; i < m; i += mm) {
+			mm = m - i < step ? m - i : step;
+			tc = gemm_tile('N', c, ldc, i, j, mm, nn, bufc, &ldtc,
+			    size);
+			/* with k equal to zero C is only scaled */
+			p = 0;
+			do {
+				kk = k - p < step ? k - p : step;
+				ta = gemm_tile(transa, a, lda, i, p, mm, kk,
+				    bufa, &ldta, size);
+				tb = gemm_tile(transb, b, ldb, p, j, kk, nn,
+				    bufb, &ldtb, size);
+				xgemm(transa, transb, mm, nn, kk, alpha, ta,
+				    ldta, tb, ldtb, p == 0 ? beta : 1, tc,
+				    ldtc, type);
+				p += kk;
+			} while (p < k);
+			if (tc == bufc)
+				copy_matrix((char *)c + (i + j * ldc) * size,
+				    ldc, bufc, ldtc, mm, nn, size);
+		}
+	}
+	free(bufa);
+	free(bufb);
+	free(bufc);
+}
 
-	type = xm_tensor_get_scalar_type(c);
-	nblocksa = xm_tensor_get_nblocks(a);
-	nblocksb = xm_tensor_get_nblocks(b);
-	nblkk = xm_dim_dot_mask(&nblocksa, &cidxa);
+/* Add single precision values multiplied by alpha to x in double
+ * precision. */
+static void
+add_single(void *x, xm_scalar_t alpha, const void *y, size_t len,
+    xm_scalar_type_t type)
+{
+	size_t i;
 
-	dims = xm_tensor_get_block_dims(c, blkidxc);
-	m = xm_dim_dot_mask(&dims, &cidxc);
-	n = xm_dim_dot_mask(&dims, &aidxc);
-	xm_tensor_read_block(c, blkidxc, bufc2);
-	if (aidxc.n > 0 && aidxc.i[0] == 0)
-		xm_tensor_unfold_block(c, blkidxc, aidxc, cidxc,
-		    bufc2, bufc1, n);
-	else
-		xm_tensor_unfold_block(c, blkidxc, cidxc, aidxc,
-		    bufc2, bufc1, m);
-	blksize = xm_tensor_get_block_size(c, blkidxc);
-	if (beta == 0)
-		xm_scalar_set(bufc1, 0, blksize, type);
-	else
-		xm_scalar_scale(bufc1, beta, blksize, type);
-	if (alpha == 0)
-		goto done;
-	blkidxa = xm_dim_zero(nblocksa.n);
-	blkidxb = xm_dim_zero(nblocksb.n);
-	xm_dim_set_mask(&blkidxa, &aidxa, &blkidxc, &cidxc);
-	xm_dim_set_mask(&blkidxb, &aidxb, &blkidxc, &aidxc);
-	for (i = 0; i < nblkk; i++) {
-		int blktypea = xm_tensor_get_block_type(a, blkidxa);
-		int blktypeb = xm_tensor_get_block_type(b, blkidxb);
-		pairs[i].alpha = 0;
-		pairs[i].blkidxa = blkidxa;
-		pairs[i].blkidxb = blkidxb;
-		if (blktypea != XM_BLOCK_TYPE_ZERO &&
-		    blktypeb != XM_BLOCK_TYPE_ZERO) {
-			xm_scalar_t sa = xm_tensor_get_block_scalar(a, blkidxa);
-			xm_scalar_t sb = xm_tensor_get_block_scalar(b, blkidxb);
-			pairs[i].alpha = xm_scalar_mul(sa, sb, type);
-		}
-		xm_dim_inc_mask(&blkidxa, &nblocksa, &cidxa);
-		xm_dim_inc_mask(&blkidxb, &nblocksb, &cidxb);
+	if (type == XM_SCALAR_DOUBLE) {
+		double *xx = x, al = creal(alpha);
+		const float *yy = y;
+		for (i = 0; i < len; i++)
+			xx[i] += al * (double)yy[i];
+	} else {
+		double complex *xx = x, al = alpha;
+		const float complex *yy = y;
+		for (i = 0; i < len; i++)
+			xx[i] += al * (double complex)yy[i];
 	}
-	for (i = 0; i < nblkk; i++) {
-		if (pairs[i].alpha == 0)
-			continue;
-		for (j = i+1; j < nblkk; j++) {
-			if (pairs[j].alpha == 0)
+}
+
+/* GEMM that adds the product to C.  If single is non-zero, double precision
+ * operands are rounded to single precision and multiplied with unit scaling
+ * so that alpha is applied in double precision. */
+static void
+gemm_acc(char transa, char transb, size_t m, size_t n, size_t k,
+    xm_scalar_t alpha, void *a, size_t lda, void *b, size_t ldb,
+    void *c, size_t ldc, int type, struct workspace *ws, int single)
+{
+	xm_scalar_type_t stype;
+	size_t na, nb, nc;
+
+	if (!single) {
+		xgemm(transa, transb, m, n, k, alpha, a, lda, b, ldb, 1, c,
+		    ldc, type);
+		return;
+	}
+	stype = type == XM_SCALAR_DOUBLE ? XM_SCALAR_FLOAT :
+	    XM_SCALAR_FLOAT_COMPLEX;
+	na = lda * (transa == 'N' ? k : m);
+	nb = ldb * (transb == 'N' ? n : k);
+	nc = ldc * n;
+	xm_scalar_convert(ws->mixa, a, na, stype, type);
+	xm_scalar_convert(ws->mixb, b, nb, stype, type);
+	xgemm(transa, transb, m, n, k, 1, ws->mixa, lda, ws->mixb, ldb, 0,
+	    ws->mixc, ldc, stype);
+	add_single(c, alpha, ws->mixc, nc, type);
+}
+
+/* GEMMs of nbatch matrix triples that follow each other in memory. */
+static void
+gemm_batch(char transa, char transb, size_t m, size_t n, size_t k,
+    xm_scalar_t alpha, void *a, size_t lda, size_t stridea, void *b,
+    size_t ldb, size_t strideb, void *c, size_t ldc, size_t stridec,
+    size_t nbatch, int type, struct workspace *ws, int single)
+{
+	size_t i, el = xm_scalar_sizeof(type);
+
+	for (i = 0; i < nbatch; i++)
+		gemm_acc(transa, transb, m, n, k, alpha,
+		    (char *)a + i * stridea * el, lda,
+		    (char *)b + i * strideb * el, ldb,
+		    (char *)c + i * stridec * el, ldc, type, ws, single);
+}
+
+/* Return the mask without the trailing batch indices. */
+static xm_dim_t
+mask_free(xm_dim_t mask, size_t nbatch)
+{
+	mask.n -= nbatch;
+	return mask;
+}
+
+/* Return the trailing batch indices of the mask. */
+static xm_dim_t
+mask_batch(xm_dim_t mask, size_t nbatch)
+{
+	xm_dim_t ret;
+	size_t i;
+
+	ret.n = nbatch;
+	for (i = 0; i < nbatch; i++)
+		ret.i[i] = mask.i[mask.n - nbatch + i];
+	return ret;
+}
+
+/* Return non-zero if the output block is unfolded with the free indices of
+ * b leading, in which case the transposed product is computed. */
+static int
+transposed_c(const struct term *t)
+{
+	return t->aidxc.n > t->nbatch && t->aidxc.i[0] == 0;
+}
+
+static size_t
+pairkey_hash(const struct pairkey *key)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	size_t i, h = 2166136261u;
+
+	for (i = 0; i < sizeof *key; i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+static void
+pairmerge_init(struct pairmerge *pm, size_t nblkk)
+{
+	memset(pm, 0, sizeof *pm);
+	for (pm->tablesize = 1; pm->tablesize < 2 * nblkk; pm->tablesize *= 2)
+		continue;
+	if ((pm->pairs = malloc(nblkk * sizeof *pm->pairs)) == NULL)
+		fatal("out of memory");
+	if ((pm->keys = calloc(nblkk, sizeof *pm->keys)) == NULL)
+		fatal("out of memory");
+	if ((pm->prevkeys = calloc(nblkk, sizeof *pm->prevkeys)) == NULL)
+		fatal("out of memory");
+	if ((pm->rep = malloc(nblkk * sizeof *pm->rep)) == NULL)
+		fatal("out of memory");
+	if ((pm->table = malloc(pm->tablesize * sizeof *pm->table)) == NULL)
+		fatal("out of memory");
+}
+
+static void
+pairmerge_free(struct pairmerge *pm)
+{
+	free(pm->pairs);
+	free(pm->keys);
+	free(pm->prevkeys);
+	free(pm->rep);
+	free(pm->table);
+}
+
+/* Merge pairs that contract the same data.  Neighbouring output blocks
+ * often produce the same keys, in which case the previous result is reused
+ * without rebuilding the hash table. */
+static void
+pairmerge_run(struct pairmerge *pm, size_t nblkk, xm_scalar_type_t type)
+{
+	struct blockpair *pairs = pm->pairs;
+	struct pairkey *keys = pm->keys;
+	size_t i, h, mask = pm->tablesize - 1;
+
+	if (!pm->valid || memcmp(keys, pm->prevkeys,
+	    nblkk * sizeof *keys) != 0) {
+		memset(pm->table, 0, pm->tablesize * sizeof *pm->table);
+		for (i = 0; i < nblkk; i++) {
+			pm->rep[i] = i;
+			if (keys[i].data_ptra == XM_NULL_PTR)
 				continue;
-			if (same_contraction(pairs, i, j, aidxa, aidxb, a, b)) {
-				pairs[i].alpha = xm_scalar_add(pairs[i].alpha,
-				    pairs[j].alpha, type);
-				pairs[j].alpha = 0;
-			}
+			h = pairkey_hash(&keys[i]) & mask;
+			while (pm->table[h] != 0 && memcmp(&keys[i],
+			    &keys[pm->table[h]-1], sizeof *keys) != 0)
+				h = (h + 1) & mask;
+			if (pm->table[h] == 0)
+				pm->table[h] = i + 1;
+			else
+				pm->rep[i] = pm->table[h] - 1;
 		}
+		pm->keys = pm->prevkeys;
+		pm->prevkeys = keys;
+		pm->valid = 1;
 	}
 	for (i = 0; i < nblkk; i++) {
-		if (pairs[i].alpha != 0) {
-			blkidxa = pairs[i].blkidxa;
-			blkidxb = pairs[i].blkidxb;
-			dims = xm_tensor_get_block_dims(a, blkidxa);
-			k = xm_dim_dot_mask(&dims, &cidxa);
+		if (pm->rep[i] != i && pairs[i].alpha != 0) {
+			pairs[pm->rep[i]].alpha = xm_scalar_add(
+			    pairs[pm->rep[i]].alpha, pairs[i].alpha, type);
+			pairs[pm->rep[i]].bound += pairs[i].bound;
+			pairs[i].alpha = 0;
+		}
+	}
+	if (screen_threshold > 0)
+		for (i = 0; i < nblkk; i++)
+			if (pairs[i].bound < screen_threshold)
+				pairs[i].alpha = 0;
+}
 
-			xm_tensor_read_block(a, blkidxa, bufa1);
-			xm_tensor_unfold_block(a, blkidxa, cidxa,
-			    aidxa, bufa1, bufa2, k);
-			xm_tensor_read_block(b, blkidxb, bufb1);
-			xm_tensor_unfold_block(b, blkidxb, cidxb,
-			    aidxb, bufb1, bufb2, k);
+static size_t
+row_bytes(const xm_tensor_t *t, xm_dim_t blkidx, xm_dim_t mask)
+{
+	xm_dim_t nblocks;
+	size_t i, n, bytes = 0;
 
-			al = xm_scalar_mul(alpha, pairs[i].alpha, type);
-			if (aidxc.n > 0 && aidxc.i[0] == 0) {
-				xgemm('T', 'N', (int)n, (int)m, (int)k, al,
-				    bufb2, (int)k, bufa2, (int)k, 1, bufc1,
-				    (int)n, type);
-			} else {
-				xgemm('T', 'N', (int)m, (int)n, (int)k, al,
-				    bufa2, (int)k, bufb2, (int)k, 1, bufc1,
-				    (int)m, type);
-			}
-		}
+	nblocks = xm_tensor_get_nblocks(t);
+	n = xm_dim_dot_mask(&nblocks, &mask);
+	for (i = 0; i < n; i++) {
+		if (xm_tensor_get_block_type(t, blkidx) != XM_BLOCK_TYPE_ZERO)
+			bytes += xm_tensor_get_block_bytes(t, blkidx);
+		xm_dim_inc_mask(&blkidx, &nblocks, &mask);
 	}
-done:
-	if (aidxc.n > 0 && aidxc.i[0] == 0)
-		xm_tensor_fold_block(c, blkidxc, aidxc, cidxc, bufc1, bufc2, n);
-	else
-		xm_tensor_fold_block(c, blkidxc, cidxc, aidxc, bufc1, bufc2, m);
-	xm_tensor_write_block(c, blkidxc, bufc2);
+	return bytes;
 }
 
-void
-xm_contract(xm_scalar_t alpha, const xm_tensor_t *a, const xm_tensor_t *b,
-    xm_scalar_t beta, xm_tensor_t *c, const char *idxa, const char *idxb,
-    const char *idxc)
+static int
+cmp_pos(const void *x, const void *y)
 {
-	const xm_block_space_t *bsa, *bsb, *bsc;
-	xm_dim_t nblocksa, cidxa, aidxa, cidxb, aidxb, cidxc, aidxc, *blklist;
-	size_t i, bufbytes, nblkk, nblklist;
-	int mpirank = 0, mpisize = 1;
+	const struct cblock *p = x, *q = y;
 
-	if (xm_tensor_get_allocator(a) != xm_tensor_get_allocator(c) ||
-	    xm_tensor_get_allocator(b) != xm_tensor_get_allocator(c))
-		fatal("tensors must use same allocator");
-	if (xm_tensor_get_scalar_type(a) != xm_tensor_get_scalar_type(c) ||
-	    xm_tensor_get_scalar_type(b) != xm_tensor_get_scalar_type(c))
-		fatal("tensors must have same scalar type");
-#ifdef XM_USE_MPI
-	MPI_Comm_rank(MPI_COMM_WORLD, &mpirank);
-	MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
-#endif
-	bsa = xm_tensor_get_block_space(a);
-	bsb = xm_tensor_get_block_space(b);
-	bsc = xm_tensor_get_block_space(c);
+	return (p->pos > q->pos) - (p->pos < q->pos);
+}
 
-	if (strlen(idxa) != xm_block_space_get_ndims(bsa))
-		fatal("bad contraction indices");
-	if (strlen(idxb) != xm_block_space_get_ndims(bsb))
-		fatal("bad contraction indices");
-	if (strlen(idxc) != xm_block_space_get_ndims(bsc))
-		fatal("bad contraction indices");
+static int
+cmp_keya(const void *x, const void *y)
+{
+	const struct cblock *p = x, *q = y;
 
-	xm_make_masks(idxa, idxb, &cidxa, &cidxb);
-	xm_make_masks(idxc, idxa, &cidxc, &aidxa);
-	xm_make_masks(idxc, idxb, &aidxc, &aidxb);
+	if (p->keya != q->keya)
+		return (p->keya > q->keya) - (p->keya < q->keya);
+	return cmp_pos(x, y);
+}
 
-	if (aidxa.n + cidxa.n != xm_block_space_get_ndims(bsa))
-		fatal("bad contraction indices");
-	if (aidxb.n + cidxb.n != xm_block_space_get_ndims(bsb))
-		fatal("bad contraction indices");
-	if (aidxc.n + cidxc.n != xm_block_space_get_ndims(bsc))
-		fatal("bad contraction indices");
-	if (!(aidxc.n > 0 && aidxc.i[0] == 0) &&
-	    !(cidxc.n > 0 && cidxc.i[0] == 0))
-		fatal("bad contraction indices");
+static int
+cmp_keyb(const void *x, const void *y)
+{
+	const struct cblock *p = x, *q = y;
 
-	for (i = 0; i < cidxa.n; i++)
-		if (!xm_block_space_eq1(bsa, cidxa.i[i], bsb, cidxb.i[i]))
-			fatal("inconsistent a and b tensor block-spaces");
-	for (i = 0; i < cidxc.n; i++)
-		if (!xm_block_space_eq1(bsc, cidxc.i[i], bsa, aidxa.i[i]))
-			fatal("inconsistent a and c tensor block-spaces");
-	for (i = 0; i < aidxc.n; i++)
-		if (!xm_block_space_eq1(bsc, aidxc.i[i], bsb, aidxb.i[i]))
-			fatal("inconsistent b and c tensor block-spaces");
+	if (p->keyb != q->keyb)
+		return (p->keyb > q->keyb) - (p->keyb < q->keyb);
+	return cmp_pos(x, y);
+}
 
-	nblocksa = xm_tensor_get_nblocks(a);
-	nblkk = xm_dim_dot_mask(&nblocksa, &cidxa);
-	bufbytes = 2 * (xm_tensor_get_largest_block_bytes(a) +
-			xm_tensor_get_largest_block_bytes(b) +
-			xm_tensor_get_largest_block_bytes(c));
-	xm_tensor_get_canonical_block_list(c, &blklist, &nblklist);
-#ifdef _OPENMP
-#pragma omp parallel private(i)
-#endif
+static size_t
+cblock_key(const struct cblock *cb, stationary_t stationary)
 {
-	struct blockpair *pairs;
-	void *buf;
+	if (stationary == STATIONARY_A)
+		return cb->keya;
+	if (stationary == STATIONARY_B)
+		return cb->keyb;
+	return cb->pos;
+}
 
-	if ((pairs = malloc(nblkk * sizeof *pairs)) == NULL)
-		fatal("out of memory");
-	if ((buf = malloc(bufbytes)) == NULL)
+/* Split sorted output blocks into tiles and return the number of tiles.
+ * The bytes read for the whole contraction are returned in cost. */
+static size_t
+make_tiles(const struct cblock *cblocks, size_t ncblocks,
+    stationary_t stationary, size_t chunk, struct tile *tiles, size_t *cost)
+{
+	const struct cblock *cb;
+	size_t i, ntiles = 0;
+
+	*cost = 0;
+	for (i = 0; i < ncblocks; i++) {
+		cb = &cblocks[i];
+		if (ntiles == 0 || i - tiles[ntiles-1].first >= chunk ||
+		    cblock_key(cb, stationary) !=
+		    cblock_key(&cblocks[tiles[ntiles-1].first], stationary)) {
+			tiles[ntiles].first = i;
+			tiles[ntiles].count = 0;
+			ntiles++;
+			if (stationary != STATIONARY_B)
+				*cost += cb->bytesa;
+			if (stationary != STATIONARY_A)
+				*cost += cb->bytesb;
+		}
+		tiles[ntiles-1].count++;
+		if (stationary == STATIONARY_A)
+			*cost += cb->bytesb;
+		else if (stationary == STATIONARY_B)
+			*cost += cb->bytesa;
+	}
+	return ntiles;
+}
+
+/* Estimated cost of computing a single output block. */
+static double
+cblock_cost(const struct term *terms, size_t nterms, const xm_tensor_t *c,
+    xm_dim_t blkidxc)
+{
+	const struct term *t;
+	xm_dim_t blkidxa, blkidxb, nblocksa, nblocksb;
+	xm_scalar_type_t type;
+	xm_dim_t dims, bidxc;
+	double sizea, sizeb, sizec, batch, flops = 0;
+	size_t i, k, bytes;
+
+	type = xm_tensor_get_scalar_type(c);
+	dims = xm_tensor_get_block_dims(c, blkidxc);
+	sizec = (double)xm_tensor_get_block_size(c, blkidxc);
+	bytes = 2 * xm_tensor_get_block_bytes(c, blkidxc);
+	for (k = 0; k < nterms; k++) {
+		t = &terms[k];
+		if (t->alpha == 0)
+			continue;
+		bidxc = mask_batch(t->cidxc, t->nbatch);
+		batch = (double)xm_dim_dot_mask(&dims, &bidxc);
+		nblocksa = xm_tensor_get_nblocks(t->a);
+		nblocksb = xm_tensor_get_nblocks(t->b);
+		blkidxa = xm_dim_zero(nblocksa.n);
+		blkidxb = xm_dim_zero(nblocksb.n);
+		xm_dim_set_mask(&blkidxa, &t->aidxa, &blkidxc, &t->cidxc);
+		xm_dim_set_mask(&blkidxb, &t->aidxb, &blkidxc, &t->aidxc);
+		for (i = 0; i < t->nblkk; i++) {
+			if (xm_tensor_get_block_type(t->a, blkidxa) !=
+			    XM_BLOCK_TYPE_ZERO &&
+			    xm_tensor_get_block_type(t->b, blkidxb) !=
+			    XM_BLOCK_TYPE_ZERO) {
+				sizea = (double)xm_tensor_get_block_size(t->a,
+				    blkidxa);
+				sizeb = (double)xm_tensor_get_block_size(t->b,
+				    blkidxb);
+				/* m*n*k*batch from the sizes m*k*batch,
+				 * k*n*batch and m*n*batch */
+				flops += xm_flops(sqrt(sizea * sizeb * sizec /
+				    batch), 1, type);
+				bytes += xm_tensor_get_block_bytes(t->a,
+				    blkidxa);
+				bytes += xm_tensor_get_block_bytes(t->b,
+				    blkidxb);
+			}
+			xm_dim_inc_mask(&blkidxa, &nblocksa, &t->cidxa);
+			xm_dim_inc_mask(&blkidxb, &nblocksb, &t->cidxb);
+		}
+	}
+	return flops + TILE_BYTE_COST * (double)bytes;
+}
+
+static int
+cmp_tile_cost(const void *x, const void *y)
+{
+	const struct tile *p = x, *q = y;
+
+	if (p->cost != q->cost)
+		return (p->cost < q->cost) - (p->cost > q->cost);
+	return (p->first > q->first) - (p->first < q->first);
+}
+
+/* Order tiles from the most to the least expensive so that expensive tiles
+ * do not start last, and assign each tile to the least loaded process for
+ * the static distribution. */
+static void
+balance_tiles(const struct term *terms, size_t nterms, const xm_tensor_t *c,
+    int mpisize, struct schedule *sched)
+{
+	struct tile *tile;
+	double *load;
+	size_t i, j;
+	int rank;
+
+	for (i = 0; i < sched->ntiles; i++) {
+		tile = &sched->tiles[i];
+		tile->cost = 0;
+		sched->owner[i] = 0;
+		for (j = 0; j < tile->count; j++)
+			tile->cost += cblock_cost(terms, nterms, c,
+			    sched->cblocks[tile->first + j].blkidx);
+	}
+	qsort(sched->tiles, sched->ntiles, sizeof *sched->tiles,
+	    cmp_tile_cost);
+	if (mpisize == 1)
+		return;
+	if ((load = calloc((size_t)mpisize, sizeof *load)) == NULL)
 		fatal("out of memory");
+	for (i = 0; i < sched->ntiles; i++) {
+		for (rank = 1; rank < mpisize; rank++)
+			if (load[rank] < load[sched->owner[i]])
+				sched->owner[i] = rank;
+		load[sched->owner[i]] += sched->tiles[i].cost;
+	}
+	free(load);
+}
+
+/* Group output blocks into tiles that share either A or B blocks so that the
+ * shared blocks are read and unfolded once per tile.  The variant that reads
+ * the least data from the allocator is chosen.  Output blocks of multi-term
+ * contractions are not tiled.  Tiles are then ordered and distributed
+ * between processes by their estimated cost. */
+static void
+make_schedule(const struct term *terms, size_t nterms, const xm_tensor_t *c,
+    const xm_dim_t *blklist, size_t nblklist, int mpisize,
+    struct schedule *sched)
+{
+	struct cblock *cblocks;
+	const xm_tensor_t *a, *b;
+	xm_dim_t ia, ib, nblocksa, nblocksb;
+	xm_dim_t cidxa, aidxa, cidxb, aidxb, cidxc, aidxc;
+	size_t i, chunk, cost, costa, costb, costc, maxa = 0, maxb = 0;
+	size_t rowlimit;
+	int nworkers = mpisize;
+
 #ifdef _OPENMP
-#pragma omp for schedule(dynamic)
+	nworkers = omp_get_max_threads();
+#ifdef XM_USE_MPI
+	MPI_Allreduce(MPI_IN_PLACE, &nworkers, 1, MPI_INT, MPI_MAX,
+	    MPI_COMM_WORLD);
+#endif
+	nworkers *= mpisize;
 #endif
+	/* every thread may hold a row of its own tile */
+	rowlimit = panel_limit / (size_t)(nworkers / mpisize);
+	if ((cblocks = calloc(nblklist + 1, sizeof *cblocks)) == NULL)
+		fatal("out of memory");
+	if ((sched->tiles = malloc((nblklist + 1) *
+	    sizeof *sched->tiles)) == NULL)
+		fatal("out of memory");
+	if ((sched->owner = malloc((nblklist + 1) *
+	    sizeof *sched->owner)) == NULL)
+		fatal("out of memory");
+	sched->cblocks = cblocks;
+	for (i = 0; i < nblklist; i++) {
+		cblocks[i].blkidx = blklist[i];
+		cblocks[i].pos = i;
+	}
+	if (nterms != 1) {
+		sched->stationary = STATIONARY_C;
+		sched->ntiles = make_tiles(cblocks, nblklist, STATIONARY_C, 1,
+		    sched->tiles, &cost);
+		balance_tiles(terms, nterms, c, mpisize, sched);
+		return;
+	}
+	a = terms->a;
+	b = terms->b;
+	cidxa = terms->cidxa;
+	aidxa = terms->aidxa;
+	cidxb = terms->cidxb;
+	aidxb = terms->aidxb;
+	cidxc = terms->cidxc;
+	aidxc = terms->aidxc;
+	nblocksa = xm_tensor_get_nblocks(a);
+	nblocksb = xm_tensor_get_nblocks(b);
+	for (i = 0; i < nblklist; i++) {
+		ia = xm_dim_zero(nblocksa.n);
+		ib = xm_dim_zero(nblocksb.n);
+		xm_dim_set_mask(&ia, &aidxa, &blklist[i], &cidxc);
+		xm_dim_set_mask(&ib, &aidxb, &blklist[i], &aidxc);
+		cblocks[i].keya = xm_dim_offset(&ia, &nblocksa);
+		cblocks[i].keyb = xm_dim_offset(&ib, &nblocksb);
+	}
+	qsort(cblocks, nblklist, sizeof *cblocks, cmp_keyb);
+	for (i = 0; i < nblklist; i++) {
+		if (i > 0 && cblocks[i].keyb == cblocks[i-1].keyb) {
+			cblocks[i].bytesb = cblocks[i-1].bytesb;
+			continue;
+		}
+		ib = xm_dim_from_offset(cblocks[i].keyb, &nblocksb);
+		cblocks[i].bytesb = row_bytes(b, ib, cidxb);
+		if (cblocks[i].bytesb > maxb)
+			maxb = cblocks[i].bytesb;
+	}
+	qsort(cblocks, nblklist, sizeof *cblocks, cmp_keya);
 	for (i = 0; i < nblklist; i++) {
-		if ((int)i % mpisize == mpirank)
-			compute_block(alpha, a, b, beta, c, cidxa, aidxa, cidxb,
-			    aidxb, cidxc, aidxc, blklist[i], pairs, buf);
+		if (i > 0 && cblocks[i].keya == cblocks[i-1].keya) {
+			cblocks[i].bytesa = cblocks[i-1].bytesa;
+			continue;
+		}
+		ia = xm_dim_from_offset(cblocks[i].keya, &nblocksa);
+		cblocks[i].bytesa = row_bytes(a, ia, cidxa);
+		if (cblocks[i].bytesa > maxa)
+			maxa = cblocks[i].bytesa;
+	}
+	/* keep enough tiles to load-balance between threads and processes */
+	chunk = nworkers > 1 ? (nblklist + 2 * nworkers - 1) / (2 * nworkers) :
+	    nblklist;
+	if (chunk == 0)
+		chunk = 1;
+	make_tiles(cblocks, nblklist, STATIONARY_A, chunk, sched->tiles,
+	    &costa);
+	qsort(cblocks, nblklist, sizeof *cblocks, cmp_keyb);
+	make_tiles(cblocks, nblklist, STATIONARY_B, chunk, sched->tiles,
+	    &costb);
+	make_tiles(cblocks, nblklist, STATIONARY_C, 1, sched->tiles, &costc);
+	sched->stationary = STATIONARY_C;
+	cost = costc;
+	if (maxa <= rowlimit && costa < cost) {
+		sched->stationary = STATIONARY_A;
+		cost = costa;
 	}
-	free(buf);
-	free(pairs);
+	if (maxb <= rowlimit && costb < cost) {
+		sched->stationary = STATIONARY_B;
+		cost = costb;
+	}
+	switch (sched->stationary) {
+	case STATIONARY_A:
+		qsort(cblocks, nblklist, sizeof *cblocks, cmp_keya);
+		break;
+	case STATIONARY_B:
+		break;
+	default:
+		qsort(cblocks, nblklist, sizeof *cblocks, cmp_pos);
+		chunk = 1;
+		break;
+	}
+	sched->ntiles = make_tiles(cblocks, nblklist, sched->stationary, chunk,
+	    sched->tiles, &cost);
+	balance_tiles(terms, nterms, c, mpisize, sched);
 }
-	free(blklist);
-#ifdef XM_USE_MPI
-	MPI_Barrier(MPI_COMM_WORLD);
-#endif
+
+static void
+key_dim(xm_dim_t *to, xm_dim_t from)
+{
+	size_t i;
+
+	to->n = from.n;
+	for (i = 0; i < from.n; i++)
+		to->i[i] = from.i[i];
+}
+
+static void
+operand_key_init(struct operand_key *key, const xm_tensor_t *t,
+    xm_dim_t blkidx, xm_dim_t mask_i, xm_dim_t mask_j, size_t stride)
+{
+	memset(key, 0, sizeof *key);
+	key->tensor = t;
+	key->data_ptr = xm_tensor_get_block_data_ptr(t, blkidx);
+	key_dim(&key->permutation,
+	    xm_tensor_get_block_permutation(t, blkidx));
+	key_dim(&key->mask_i, mask_i);
+	key_dim(&key->mask_j, mask_j);
+	key->stride = stride;
+}
+
+/* Return unfolded block data.  The data is shared with other threads
+ * through the operand cache and must be released with operand_release.
+ * If the block does not fit into the cache it is unfolded into the
+ * fallback buffer instead. */
+static void *
+operand_get(xm_cache_t *cache, const xm_tensor_t *t, xm_dim_t blkidx,
+    xm_dim_t mask_i, xm_dim_t mask_j, size_t stride, void *buf,
+    void *fallback)
+{
+	struct operand_key key;
+	void *data;
+	int fill;
+
+	operand_key_init(&key, t, blkidx, mask_i, mask_j, stride);
+	data = xm_cache_get(cache, &key, sizeof key,
+	    xm_tensor_get_block_bytes(t, blkidx), &fill);
+	if (data == NULL) {
+		data = fallback;
+		fill = 1;
+	}
+	if (fill) {
+		xm_tensor_read_block(t, blkidx, buf);
+		xm_tensor_unfold_block(t, blkidx, mask_i, mask_j, buf, data,
+		    stride);
+		if (data != fallback)
+			xm_cache_done(cache, data);
+	}
+	return data;
+}
+
+static void
+operand_release(xm_cache_t *cache, void *data, void *fallback)
+{
+	if (data != fallback)
+		xm_cache_release(cache, data);
+}
+
+static void
+panel_reset(struct panel *panel, xm_cache_t *cache)
+{
+	size_t i;
+
+	for (i = 0; i < panel->n; i++) {
+		if (panel->data[i]) {
+			xm_cache_release(cache, panel->data[i]);
+			panel->data[i] = NULL;
+		}
+	}
+}
+
+/* Return unfolded block from the panel, reading it on first use. */
+static void *
+panel_get(struct panel *panel, xm_cache_t *cache, const xm_tensor_t *t,
+    size_t slot, xm_dim_t blkidx, xm_dim_t mask_i, xm_dim_t mask_j,
+    size_t stride, void *buf, void *fallback)
+{
+	void *data;
+
+	if (panel->data[slot])
+		return panel->data[slot];
+	data = operand_get(cache, t, blkidx, mask_i, mask_j, stride, buf,
+	    fallback);
+	if (data != fallback)
+		panel->data[slot] = data;
+	return data;
+}
+
+/* Return the first contributing pair starting from i. */
+static size_t
+next_pair(const struct blockpair *pairs, size_t i, size_t nblkk)
+{
+	while (i < nblkk && pairs[i].alpha == 0)
+		i++;
+	return i;
+}
+
+/* Start reading blocks of the pair in the background unless they are
+ * already loaded into the panels. */
+static void
+prefetch_pair(const xm_tensor_t *a, const xm_tensor_t *b,
+    const struct blockpair *pairs, size_t i, size_t nblkk,
+    const struct panel *pa, const struct panel *pb)
+{
+	if (i >= nblkk)
+		return;
+	if (pa == NULL || pa->data[i] == NULL)
+		xm_tensor_prefetch_block(a, pairs[i].blkidxa);
+	if (pb == NULL || pb->data[i] == NULL)
+		xm_tensor_prefetch_block(b, pairs[i].blkidxb);
+}
+
+static size_t
+concat_bytes(const xm_tensor_t *t)
+{
+	size_t bytes = xm_tensor_get_largest_block_bytes(t);
+	size_t limit = panel_limit < CONCAT_BYTES ? panel_limit : CONCAT_BYTES;
+
+	return bytes > limit ? bytes : limit;
+}
+
+/* Compute sizes of the buffers and return the total size in bytes. */
+static size_t
+workspace_size(struct workspace *ws, const struct term *terms, size_t nterms,
+    const xm_tensor_t *c, int concat, xm_precision_t precision)
+{
+	xm_scalar_type_t type;
+	size_t i, bytes;
+
+	ws->maxa = ws->maxb = 0;
+	ws->concatbytesa = ws->concatbytesb = 0;
+	for (i = 0; i < nterms; i++) {
+		bytes = xm_tensor_get_largest_block_bytes(terms[i].a);
+		if (bytes > ws->maxa)
+			ws->maxa = bytes;
+		bytes = xm_tensor_get_largest_block_bytes(terms[i].b);
+		if (bytes > ws->maxb)
+			ws->maxb = bytes;
+		if (concat) {
+			bytes = concat_bytes(terms[i].a);
+			if (bytes > ws->concatbytesa)
+				ws->concatbytesa = bytes;
+			bytes = concat_bytes(terms[i].b);
+			if (bytes > ws->concatbytesb)
+				ws->concatbytesb = bytes;
+		}
+	}
+	ws->maxc = xm_tensor_get_largest_block_bytes(c);
+	/* single precision copies take half the space */
+	ws->precision = XM_PRECISION_FULL;
+	ws->mixbytesa = ws->mixbytesb = ws->mixbytesc = 0;
+	type = xm_tensor_get_scalar_type(c);
+	if (precision != XM_PRECISION_FULL && (type == XM_SCALAR_DOUBLE ||
+	    type == XM_SCALAR_DOUBLE_COMPLEX)) {
+		ws->precision = precision;
+		ws->mixbytesa = (ws->maxa > ws->concatbytesa ? ws->maxa :
+		    ws->concatbytesa) / 2;
+		ws->mixbytesb = (ws->maxb > ws->concatbytesb ? ws->maxb :
+		    ws->concatbytesb) / 2;
+		ws->mixbytesc = ws->maxc / 2;
+	}
+	return 2 * (ws->maxa + ws->maxb + ws->maxc) + ws->concatbytesa +
+	    ws->concatbytesb + ws->mixbytesa + ws->mixbytesb + ws->mixbytesc;
+}
+
+static void
+workspace_init(struct workspace *ws, const struct term *terms, size_t nterms,
+    const xm_tensor_t *c, int concat, xm_precision_t precision)
+{
+	size_t bytes;
+
+	bytes = workspace_size(ws, terms, nterms, c, concat, precision);
+	if ((ws->bufa1 = malloc(bytes)) == NULL)
+		fatal("out of memory");
+	ws->bufa2 = (char *)ws->bufa1 + ws->maxa;
+	ws->bufb1 = (char *)ws->bufa2 + ws->maxa;
+	ws->bufb2 = (char *)ws->bufb1 + ws->maxb;
+	ws->bufc1 = (char *)ws->bufb2 + ws->maxb;
+	ws->bufc2 = (char *)ws->bufc1 + ws->maxc;
+	ws->concata = (char *)ws->bufc2 + ws->maxc;
+	ws->concatb = (char *)ws->concata + ws->concatbytesa;
+	ws->mixa = ws->mixb = ws->mixc = NULL;
+	if (ws->precision != XM_PRECISION_FULL) {
+		ws->mixa = (char *)ws->concatb + ws->concatbytesb;
+		ws->mixb = (char *)ws->mixa + ws->mixbytesa;
+		ws->mixc = (char *)ws->mixb + ws->mixbytesb;
+	}
+}
+
+static void
+workspace_free(struct workspace *ws)
+{
+	free(ws->bufa1);
+}
+
+/* Return the row and column masks of the unfolded output block.  Batch
+ * indices are the slowest so that the block is a sequence of matrices. */
+static void
+masks_c(const struct term *t, xm_dim_t *mask_i, xm_dim_t *mask_j)
+{
+	xm_dim_t fa, fb;
+	size_t i;
+
+	fa = mask_free(t->cidxc, t->nbatch);
+	fb = mask_free(t->aidxc, t->nbatch);
+	*mask_i = transposed_c(t) ? fb : fa;
+	*mask_j = transposed_c(t) ? fa : fb;
+	for (i = 0; i < t->nbatch; i++)
+		mask_j->i[mask_j->n++] = t->cidxc.i[t->cidxc.n - t->nbatch + i];
+}
+
+/* Unfold the output block from bufc2 into bufc1 for the term. */
+static void
+unfold_c(const struct term *t, const xm_tensor_t *c, xm_dim_t blkidxc,
+    struct workspace *ws)
+{
+	xm_dim_t dims, mask_i, mask_j;
+
+	dims = xm_tensor_get_block_dims(c, blkidxc);
+	masks_c(t, &mask_i, &mask_j);
+	xm_tensor_unfold_block(c, blkidxc, mask_i, mask_j, ws->bufc2,
+	    ws->bufc1, xm_dim_dot_mask(&dims, &mask_i));
+}
+
+/* Fold the output block from bufc1 back into bufc2. */
+static void
+fold_c(const struct term *t, const xm_tensor_t *c, xm_dim_t blkidxc,
+    struct workspace *ws)
+{
+	xm_dim_t dims, mask_i, mask_j;
+
+	dims = xm_tensor_get_block_dims(c, blkidxc);
+	masks_c(t, &mask_i, &mask_j);
+	xm_tensor_fold_block(c, blkidxc, mask_i, mask_j, ws->bufc1,
+	    ws->bufc2, xm_dim_dot_mask(&dims, &mask_i));
+}
+
+static int
+same_layout(const struct term *t, const struct term *u)
+{
+	return xm_dim_eq(&t->cidxc, &u->cidxc) &&
+	    xm_dim_eq(&t->aidxc, &u->aidxc) && t->nbatch == u->nbatch;
+}
+
+/* Find the pairs of blocks of A and B that contribute to the output block.
+ * Pairs that contract the same data are merged and screened pairs have
+ * their scalar factor set to zero. */
+static void
+make_pairs(const struct term *t, xm_dim_t blkidxc, struct pairmerge *pm,
+    xm_scalar_type_t type, int bounds)
+{
+	const xm_tensor_t *a = t->a, *b = t->b;
+	struct blockpair *pairs = pm->pairs;
+	struct pairkey *key;
+	xm_dim_t cidxa = t->cidxa, aidxa = t->aidxa, cidxb = t->cidxb;
+	xm_dim_t aidxb = t->aidxb, cidxc = t->cidxc, aidxc = t->aidxc;
+	xm_dim_t blkidxa, blkidxb, nblocksa, nblocksb;
+	xm_scalar_t alpha = t->alpha;
+	size_t i, j, nblkk = t->nblkk;
+
+	nblocksa = xm_tensor_get_nblocks(a);
+	nblocksb = xm_tensor_get_nblocks(b);
+	blkidxa = xm_dim_zero(nblocksa.n);
+	blkidxb = xm_dim_zero(nblocksb.n);
+	xm_dim_set_mask(&blkidxa, &aidxa, &blkidxc, &cidxc);
+	xm_dim_set_mask(&blkidxb, &aidxb, &blkidxc, &aidxc);
+	for (i = 0; i < nblkk; i++) {
+		int blktypea = xm_tensor_get_block_type(a, blkidxa);
+		int blktypeb = xm_tensor_get_block_type(b, blkidxb);
+		key = &pm->keys[i];
+		memset(key, 0, sizeof *key);
+		key->data_ptra = XM_NULL_PTR;
+		pairs[i].alpha = 0;
+		pairs[i].bound = 0;
+		pairs[i].blkidxa = blkidxa;
+		pairs[i].blkidxb = blkidxb;
+		if (blktypea != XM_BLOCK_TYPE_ZERO &&
+		    blktypeb != XM_BLOCK_TYPE_ZERO) {
+			xm_scalar_t sa = xm_tensor_get_block_scalar(a, blkidxa);
+			xm_scalar_t sb = xm_tensor_get_block_scalar(b, blkidxb);
+			xm_dim_t perma, permb;
+			pairs[i].alpha = xm_scalar_mul(sa, sb, type);
+			if (screen_threshold > 0 || bounds)
+				pairs[i].bound = cabs(alpha) *
+				    xm_tensor_get_block_norm(a, blkidxa) *
+				    xm_tensor_get_block_norm(b, blkidxb);
+			key->data_ptra = xm_tensor_get_block_data_ptr(a,
+			    blkidxa);
+			key->data_ptrb = xm_tensor_get_block_data_ptr(b,
+			    blkidxb);
+			perma = xm_tensor_get_block_permutation(a, blkidxa);
+			permb = xm_tensor_get_block_permutation(b, blkidxb);
+			for (j = 0; j < aidxa.n; j++)
+				key->perm[j] = perma.i[aidxa.i[j]];
+			for (j = 0; j < aidxb.n; j++)
+				key->perm[XM_MAX_DIM + j] = permb.i[aidxb.i[j]];
+		}
+		xm_dim_inc_mask(&blkidxa, &nblocksa, &cidxa);
+		xm_dim_inc_mask(&blkidxb, &nblocksb, &cidxb);
+	}
+	pairmerge_run(pm, nblkk, type);
+}
+
+/* Return the largest norm bound of the contributing pairs if the pairs are
+ * split between precisions, or zero otherwise. */
+static double
+max_bound(const struct blockpair *pairs, size_t nblkk,
+    const struct workspace *ws)
+{
+	double bound = 0;
+	size_t i;
+
+	if (ws->precision != XM_PRECISION_MIXED_ADAPTIVE)
+		return 0;
+	for (i = 0; i < nblkk; i++)
+		if (pairs[i].alpha != 0 && pairs[i].bound > bound)
+			bound = pairs[i].bound;
+	return bound;
+}
+
+/* Return non-zero if the pair is multiplied in single precision. */
+static int
+pair_single(const struct blockpair *pair, double maxbound,
+    const struct workspace *ws)
+{
+	if (ws->precision == XM_PRECISION_MIXED)
+		return 1;
+	if (ws->precision == XM_PRECISION_MIXED_ADAPTIVE)
+		return pair->bound * MIXED_BOUND_RATIO < maxbound;
+	return 0;
+}
+
+/* Unfold contributing blocks into an m x K panel of A and an n x K panel of
+ * B with pair scalars applied to B, then do a single GEMM.  The panels are
+ * flushed early when they do not fit the buffers.  Only pairs done in the
+ * given precision are stacked. */
+static void
+compute_stacked(const struct term *t, const struct blockpair *pairs,
+    size_t m, size_t n, double maxbound, int single, struct workspace *ws,
+    xm_cache_t *cache, struct panel *pa, struct panel *pb,
+    xm_scalar_type_t type)
+{
+	const xm_tensor_t *a = t->a, *b = t->b;
+	xm_dim_t cidxa = t->cidxa, aidxa = t->aidxa, cidxb = t->cidxb;
+	xm_dim_t aidxb = t->aidxb;
+	xm_dim_t dims, blkidxa, blkidxb;
+	xm_scalar_t alpha = t->alpha;
+	void *bufa1 = ws->bufa1, *bufa2 = ws->bufa2;
+	void *bufb1 = ws->bufb1, *bufb2 = ws->bufb2, *bufc1 = ws->bufc1;
+	void *concata = ws->concata, *concatb = ws->concatb, *dataa, *datab;
+	size_t i, k, kk, el, nblkk = t->nblkk;
+
+	el = xm_scalar_sizeof(type);
+	kk = k = 0;
+	for (i = 0; i <= nblkk; i++) {
+		if (i < nblkk) {
+			if (pairs[i].alpha == 0 ||
+			    pair_single(&pairs[i], maxbound, ws) != single)
+				continue;
+			prefetch_pair(a, b, pairs,
+			    next_pair(pairs, i + 1, nblkk), nblkk, pa, pb);
+			blkidxa = pairs[i].blkidxa;
+			blkidxb = pairs[i].blkidxb;
+			dims = xm_tensor_get_block_dims(a, blkidxa);
+			k = xm_dim_dot_mask(&dims, &cidxa);
+		}
+		if (kk > 0 && (i == nblkk ||
+		    (kk + k) * m * el > ws->concatbytesa ||
+		    (kk + k) * n * el > ws->concatbytesb)) {
+			if (transposed_c(t)) {
+				gemm_acc('N', 'T', n, m, kk, alpha, concatb,
+				    n, concata, m, bufc1, n, type, ws, single);
+			} else {
+				gemm_acc('N', 'T', m, n, kk, alpha, concata,
+				    m, concatb, n, bufc1, m, type, ws, single);
+			}
+			kk = 0;
+		}
+		if (i == nblkk)
+			break;
+		if (pa)
+			dataa = panel_get(pa, cache, a, i, blkidxa, aidxa,
+			    cidxa, m, bufa1, bufa2);
+		else
+			dataa = operand_get(cache, a, blkidxa, aidxa, cidxa,
+			    m, bufa1, bufa2);
+		memcpy((char *)concata + kk * m * el, dataa, k * m * el);
+		if (!pa)
+			operand_release(cache, dataa, bufa2);
+		if (pb)
+			datab = panel_get(pb, cache, b, i, blkidxb, aidxb,
+			    cidxb, n, bufb1, bufb2);
+		else
+			datab = operand_get(cache, b, blkidxb, aidxb, cidxb,
+			    n, bufb1, bufb2);
+		memcpy((char *)concatb + kk * n * el, datab, k * n * el);
+		if (!pb)
+			operand_release(cache, datab, bufb2);
+		xm_scalar_scale((char *)concatb + kk * n * el, pairs[i].alpha,
+		    k * n, type);
+		kk += k;
+	}
+}
+
+/* Add the contribution of the term to the output block unfolded in bufc1. */
+static void
+compute_term(const struct term *t, const xm_tensor_t *c, xm_dim_t blkidxc,
+    struct pairmerge *pm, struct workspace *ws, xm_cache_t *cache,
+    struct panel *pa, struct panel *pb, int concat)
+{
+	const xm_tensor_t *a = t->a, *b = t->b;
+	struct blockpair *pairs = pm->pairs;
+	xm_dim_t cidxa = t->cidxa, aidxa = t->aidxa, cidxb = t->cidxb;
+	xm_dim_t aidxb = t->aidxb, fa, fb, bidxc;
+	xm_dim_t dims, blkidxa, blkidxb;
+	xm_scalar_t al, alpha = t->alpha;
+	void *bufa1 = ws->bufa1, *bufa2 = ws->bufa2;
+	void *bufb1 = ws->bufb1, *bufb2 = ws->bufb2, *bufc1 = ws->bufc1;
+	void *dataa, *datab;
+	size_t i, m, n, k, nb, nblkk = t->nblkk;
+	xm_scalar_type_t type;
+	double maxbound;
+	int single;
+
+	type = xm_tensor_get_scalar_type(c);
+	dims = xm_tensor_get_block_dims(c, blkidxc);
+	fa = mask_free(t->cidxc, t->nbatch);
+	fb = mask_free(t->aidxc, t->nbatch);
+	bidxc = mask_batch(t->cidxc, t->nbatch);
+	m = xm_dim_dot_mask(&dims, &fa);
+	n = xm_dim_dot_mask(&dims, &fb);
+	nb = xm_dim_dot_mask(&dims, &bidxc);
+	make_pairs(t, blkidxc, pm, type,
+	    ws->precision == XM_PRECISION_MIXED_ADAPTIVE);
+	maxbound = max_bound(pairs, nblkk, ws);
+	/* blocks of the next pair are read ahead while the current pair
+	 * is being processed */
+	prefetch_pair(a, b, pairs, next_pair(pairs, 0, nblkk), nblkk, pa, pb);
+	/* blocks are not stacked along the contraction dimension if there
+	 * are batch indices */
+	if (concat && t->nbatch == 0) {
+		for (single = 0; single < 2; single++)
+			compute_stacked(t, pairs, m, n, maxbound, single, ws,
+			    cache, pa, pb, type);
+		return;
+	}
+	for (i = 0; i < nblkk; i++) {
+		if (pairs[i].alpha != 0) {
+			prefetch_pair(a, b, pairs,
+			    next_pair(pairs, i + 1, nblkk), nblkk, pa, pb);
+			blkidxa = pairs[i].blkidxa;
+			blkidxb = pairs[i].blkidxb;
+			dims = xm_tensor_get_block_dims(a, blkidxa);
+			k = xm_dim_dot_mask(&dims, &cidxa);
+
+			if (pa)
+				dataa = panel_get(pa, cache, a, i, blkidxa,
+				    cidxa, aidxa, k, bufa1, bufa2);
+			else
+				dataa = operand_get(cache, a, blkidxa, cidxa,
+				    aidxa, k, bufa1, bufa2);
+			if (pb)
+				datab = panel_get(pb, cache, b, i, blkidxb,
+				    cidxb, aidxb, k, bufb1, bufb2);
+			else
+				datab = operand_get(cache, b, blkidxb, cidxb,
+				    aidxb, k, bufb1, bufb2);
+
+			al = xm_scalar_mul(alpha, pairs[i].alpha, type);
+			single = pair_single(&pairs[i], maxbound, ws);
+			if (transposed_c(t)) {
+				gemm_batch('T', 'N', n, m, k, al, datab, k,
+				    k * n, dataa, k, k * m, bufc1, n, n * m,
+				    nb, type, ws, single);
+			} else {
+				gemm_batch('T', 'N', m, n, k, al, dataa, k,
+				    k * m, datab, k, k * n, bufc1, m, m * n,
+				    nb, type, ws, single);
+			}
+			if (!pa)
+				operand_release(cache, dataa, bufa2);
+			if (!pb)
+				operand_release(cache, datab, bufb2);
+		}
+	}
+}
+
+/* Add the dot product of the output block in bufc2 and the same block of d
+ * to the thread's sum.  The block of d is unfolded into the layout of a
+ * canonical block. */
+static void
+dot_block(const xm_tensor_t *d, xm_dim_t blkidx, struct workspace *ws,
+    xm_scalar_type_t type)
+{
+	xm_dim_t mask_i, mask_j;
+	xm_scalar_t dot;
+	size_t blksize;
+
+	blksize = xm_tensor_get_block_size(d, blkidx);
+	mask_i = xm_dim_identity_permutation(blkidx.n);
+	mask_j = xm_dim_zero(0);
+	xm_tensor_read_block(d, blkidx, ws->bufd);
+	xm_tensor_unfold_block(d, blkidx, mask_i, mask_j, ws->bufd,
+	    ws->bufc1, blksize);
+	dot = xm_scalar_dot(ws->bufc1, ws->bufc2, blksize, type);
+	dot = xm_scalar_mul(dot, xm_tensor_get_block_scalar(d, blkidx), type);
+	ws->dot = xm_scalar_add(ws->dot, dot, type);
+}
+
+/* Compute an output block.  The block is read once, the contributions of
+ * all terms are accumulated in memory and the result is written once, or
+ * dotted with the block of d without being written. */
+static void
+compute_block(const struct term *terms, size_t nterms, xm_scalar_t beta,
+    xm_tensor_t *c, xm_dim_t blkidxc, struct pairmerge *pms,
+    struct workspace *ws, xm_cache_t *cache, struct panel *pa,
+    struct panel *pb, int concat)
+{
+	const struct term *layout = NULL;
+	xm_scalar_type_t type;
+	size_t i, blksize;
+
+	type = xm_tensor_get_scalar_type(c);
+	blksize = xm_tensor_get_block_size(c, blkidxc);
+	if (beta == 0)
+		xm_scalar_set(ws->bufc2, 0, blksize, type);
+	else {
+		xm_tensor_read_block(c, blkidxc, ws->bufc2);
+		if (beta != 1)
+			xm_scalar_scale(ws->bufc2, beta, blksize, type);
+	}
+	for (i = 0; i < nterms; i++) {
+		if (terms[i].alpha == 0)
+			continue;
+		/* consecutive terms with the same layout of C share the
+		 * unfolded block */
+		if (layout == NULL || !same_layout(layout, &terms[i])) {
+			if (layout)
+				fold_c(layout, c, blkidxc, ws);
+			unfold_c(&terms[i], c, blkidxc, ws);
+			layout = &terms[i];
+		}
+		compute_term(&terms[i], c, blkidxc, &pms[i], ws, cache, pa, pb,
+		    concat);
+	}
+	if (layout)
+		fold_c(layout, c, blkidxc, ws);
+	if (ws->epilogue)
+		ws->epilogue(c, blkidxc, ws->bufc2, ws->bufd,
+		    ws->epilogue_data);
+	if (ws->d)
+		dot_block(ws->d, blkidxc, ws, type);
+	else
+		xm_tensor_write_block(c, blkidxc, ws->bufc2);
+}
+
+void
+xm_contract_set_threshold(double threshold)
+{
+	screen_threshold = threshold;
+}
+
+double
+xm_contract_get_threshold(void)
+{
+	return screen_threshold;
+}
+
+void
+xm_contract_set_memory_limit(size_t bytes)
+{
+	panel_limit = bytes;
+}
+
+size_t
+xm_contract_get_memory_limit(void)
+{
+	return panel_limit;
+}
+
+void
+xm_contract_set_precision(xm_precision_t precision)
+{
+	if (precision != XM_PRECISION_FULL &&
+	    precision != XM_PRECISION_MIXED &&
+	    precision != XM_PRECISION_MIXED_ADAPTIVE)
+		fatal("unknown precision");
+	gemm_precision = precision;
+}
+
+xm_precision_t
+xm_contract_get_precision(void)
+{
+	return gemm_precision;
+}
+
+void
+xm_contract_set_adaptive_threads(int enable)
+{
+	adaptive_threads = enable;
+}
+
+int
+xm_contract_get_adaptive_threads(void)
+{
+	return adaptive_threads;
+}
+
+void
+xm_contract_set_concat_k(int enable)
+{
+	concat_k = enable;
+}
+
+int
+xm_contract_get_concat_k(void)
+{
+	return concat_k;
+}
+
+/* Make the index masks of the term.  Indices that appear in all three
+ * tensors are batch indices and are appended to the masks of the free
+ * indices of both a and b. */
+static void
+make_masks(struct term *t, const char *idxa, const char *idxb,
+    const char *idxc)
+{
+	xm_dim_t ab, ba, ca, ac, cb, bc;
+	size_t i, j;
+
+	xm_make_masks(idxa, idxb, &ab, &ba);
+	xm_make_masks(idxc, idxa, &ca, &ac);
+	xm_make_masks(idxc, idxb, &cb, &bc);
+	t->cidxa.n = t->cidxb.n = t->cidxc.n = 0;
+	t->aidxa.n = t->aidxb.n = t->aidxc.n = 0;
+	t->nbatch = 0;
+	for (i = 0; i < ab.n; i++) {
+		if (strchr(idxc, idxa[ab.i[i]]) == NULL) {
+			t->cidxa.i[t->cidxa.n++] = ab.i[i];
+			t->cidxb.i[t->cidxb.n++] = ba.i[i];
+		}
+	}
+	for (i = 0; i < ca.n; i++) {
+		if (strchr(idxb, idxc[ca.i[i]]) == NULL) {
+			t->cidxc.i[t->cidxc.n++] = ca.i[i];
+			t->aidxa.i[t->aidxa.n++] = ac.i[i];
+		}
+	}
+	for (i = 0; i < cb.n; i++) {
+		if (strchr(idxa, idxc[cb.i[i]]) == NULL) {
+			t->aidxc.i[t->aidxc.n++] = cb.i[i];
+			t->aidxb.i[t->aidxb.n++] = bc.i[i];
+		}
+	}
+	for (i = 0; i < ca.n; i++) {
+		for (j = 0; j < cb.n; j++) {
+			if (ca.i[i] == cb.i[j]) {
+				t->cidxc.i[t->cidxc.n++] = ca.i[i];
+				t->aidxa.i[t->aidxa.n++] = ac.i[i];
+				t->aidxc.i[t->aidxc.n++] = cb.i[j];
+				t->aidxb.i[t->aidxb.n++] = bc.i[j];
+				t->nbatch++;
+			}
+		}
+	}
+}
+
+static void
+make_term(struct term *t, xm_scalar_t alpha, const xm_tensor_t *a,
+    const xm_tensor_t *b, const xm_tensor_t *c, const char *idxa,
+    const char *idxb, const char *idxc)
+{
+	const xm_block_space_t *bsa, *bsb, *bsc;
+	xm_dim_t nblocksa;
+	size_t i;
+
+	if (xm_tensor_get_allocator(a) != xm_tensor_get_allocator(c) ||
+	    xm_tensor_get_allocator(b) != xm_tensor_get_allocator(c))
+		fatal("tensors must use same allocator");
+	if (xm_tensor_get_scalar_type(a) != xm_tensor_get_scalar_type(c) ||
+	    xm_tensor_get_scalar_type(b) != xm_tensor_get_scalar_type(c))
+		fatal("tensors must have same scalar type");
+	bsa = xm_tensor_get_block_space(a);
+	bsb = xm_tensor_get_block_space(b);
+	bsc = xm_tensor_get_block_space(c);
+
+	if (strlen(idxa) != xm_block_space_get_ndims(bsa))
+		fatal("bad contraction indices");
+	if (strlen(idxb) != xm_block_space_get_ndims(bsb))
+		fatal("bad contraction indices");
+	if (strlen(idxc) != xm_block_space_get_ndims(bsc))
+		fatal("bad contraction indices");
+
+	make_masks(t, idxa, idxb, idxc);
+
+	if (t->aidxa.n + t->cidxa.n != xm_block_space_get_ndims(bsa))
+		fatal("bad contraction indices");
+	if (t->aidxb.n + t->cidxb.n != xm_block_space_get_ndims(bsb))
+		fatal("bad contraction indices");
+	if (t->aidxc.n + t->cidxc.n - t->nbatch !=
+	    xm_block_space_get_ndims(bsc))
+		fatal("bad contraction indices");
+	if (idxc[0] == '\0' || (strchr(idxa, idxc[0]) == NULL &&
+	    strchr(idxb, idxc[0]) == NULL))
+		fatal("bad contraction indices");
+
+	for (i = 0; i < t->cidxa.n; i++)
+		if (!xm_block_space_eq1(bsa, t->cidxa.i[i],
+		    bsb, t->cidxb.i[i]))
+			fatal("inconsistent a and b tensor block-spaces");
+	for (i = 0; i < t->cidxc.n; i++)
+		if (!xm_block_space_eq1(bsc, t->cidxc.i[i],
+		    bsa, t->aidxa.i[i]))
+			fatal("inconsistent a and c tensor block-spaces");
+	for (i = 0; i < t->aidxc.n; i++)
+		if (!xm_block_space_eq1(bsc, t->aidxc.i[i],
+		    bsb, t->aidxb.i[i]))
+			fatal("inconsistent b and c tensor block-spaces");
+
+	nblocksa = xm_tensor_get_nblocks(a);
+	t->nblkk = xm_dim_dot_mask(&nblocksa, &t->cidxa);
+	t->alpha = alpha;
+	t->a = a;
+	t->b = b;
+}
+
+/* Divide threads between workers that compute output blocks and BLAS
+ * threads of each worker.  When there are fewer tiles than threads and the
+ * blocks are large the spare threads are given to BLAS.  Each worker gets
+ * inner threads and the first spare workers get one more. */
+static void
+split_threads(size_t ntiles, const xm_tensor_t *c, int *workers, int *inner,
+    int *spare)
+{
+	int nthreads = 1;
+
+#ifdef _OPENMP
+	nthreads = omp_get_max_threads();
+#endif
+	*workers = nthreads;
+	*inner = 1;
+	*spare = 0;
+	if (!adaptive_threads || !xm_blas_has_threads() ||
+	    xm_tensor_get_largest_block_size(c) < BLAS_THREAD_BLOCK_SIZE ||
+	    ntiles >= (size_t)nthreads)
+		return;
+	*workers = ntiles > 0 ? (int)ntiles : 1;
+	*inner = nthreads / *workers;
+	*spare = nthreads % *workers;
+}
+
+/* Block norms recorded by direct writes are only known to the process that
+ * wrote the block.  Screening and adaptive precision compare norms, so all
+ * processes must see the same values to skip the same pairs. */
+static void
+sync_operand_norms(const struct term *terms, size_t nterms)
+{
+	size_t i;
+
+	if (screen_threshold == 0 &&
+	    gemm_precision != XM_PRECISION_MIXED_ADAPTIVE)
+		return;
+	for (i = 0; i < nterms; i++) {
+		xm_tensor_sync_block_norms((xm_tensor_t *)terms[i].a);
+		xm_tensor_sync_block_norms((xm_tensor_t *)terms[i].b);
+	}
+}
+
+/* Compute the canonical blocks of c and apply the epilogue to them.  If d is
+ * given the blocks are not written and the dot product of c and d is
+ * returned instead. */
+static xm_scalar_t
+contract_terms(const struct term *terms, size_t nterms, xm_scalar_t beta,
+    xm_tensor_t *c, const xm_tensor_t *d, xm_epilogue_t epilogue,
+    void *epilogue_data)
+{
+	struct schedule sched;
+	xm_cache_t *cache;
+	xm_dim_t *blklist;
+	xm_work_t *work;
+	xm_precision_t precision;
+	xm_scalar_t dot = 0;
+	size_t i, nblklist;
+	int mpisize = 1, concat, parallel, workers, inner, spare;
+#ifdef _OPENMP
+	int levels = omp_get_max_active_levels();
+#endif
+
+#ifdef XM_USE_MPI
+	MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
+#endif
+	concat = concat_k;
+	precision = gemm_precision;
+	sync_operand_norms(terms, nterms);
+	xm_tensor_get_canonical_block_list(c, &blklist, &nblklist);
+	make_schedule(terms, nterms, c, blklist, nblklist, mpisize, &sched);
+	work = xm_work_create(sched.ntiles, sched.owner);
+	cache = xm_cache_create(panel_limit);
+	split_threads((sched.ntiles + mpisize - 1) / mpisize, c, &workers,
+	    &inner, &spare);
+	/* With sequential BLAS, blocks are only processed one at a time
+	 * (with parallel fold/unfold) if there is a single tile per rank. */
+	parallel = workers > 1 && (sched.ntiles > (size_t)mpisize ||
+	    xm_parallel_blocks(1, xm_tensor_get_largest_block_size(c)));
+#ifdef _OPENMP
+	if ((inner > 1 || spare > 0) && parallel && levels < 2)
+		omp_set_max_active_levels(2);
+#pragma omp parallel private(i) reduction(+:dot) num_threads(workers) \
+    if (parallel)
+#endif
+{
+	struct pairmerge *pms;
+	struct panel panel, *pa = NULL, *pb = NULL;
+	struct workspace ws;
+	const struct tile *tile;
+	size_t j;
+	int blas_threads = 0, nblas = inner;
+
+#ifdef _OPENMP
+	if (omp_get_thread_num() < spare)
+		nblas++;
+#endif
+	if (nblas > 1)
+		blas_threads = xm_blas_set_threads(nblas);
+	if ((pms = malloc(nterms * sizeof *pms)) == NULL)
+		fatal("out of memory");
+	for (j = 0; j < nterms; j++)
+		pairmerge_init(&pms[j], terms[j].nblkk);
+	workspace_init(&ws, terms, nterms, c, concat, precision);
+	ws.d = d;
+	ws.bufd = NULL;
+	ws.dot = 0;
+	ws.epilogue = epilogue;
+	ws.epilogue_data = epilogue_data;
+	if ((d || epilogue) && (ws.bufd = malloc(2 * ws.maxc)) == NULL)
+		fatal("out of memory");
+	if (sched.stationary == STATIONARY_A)
+		pa = &panel;
+	if (sched.stationary == STATIONARY_B)
+		pb = &panel;
+	panel.n = terms->nblkk;
+	if ((panel.data = calloc(panel.n, sizeof *panel.data)) == NULL)
+		fatal("out of memory");
+	while (xm_work_next(work, &i)) {
+		tile = &sched.tiles[i];
+		for (j = 0; j < tile->count; j++) {
+			/* the next C block is read while this one is computed
+			 * and its write-back drains through the page cache */
+			if (j + 1 < tile->count)
+				xm_tensor_prefetch_block(d ? d : c,
+				    sched.cblocks[tile->first + j + 1].blkidx);
+			compute_block(terms, nterms, beta, c,
+			    sched.cblocks[tile->first + j].blkidx, pms, &ws,
+			    cache, pa, pb, concat);
+		}
+		if (pa || pb)
+			panel_reset(&panel, cache);
+	}
+	free(panel.data);
+	dot = ws.dot;
+	free(ws.bufd);
+	workspace_free(&ws);
+	for (j = 0; j < nterms; j++)
+		pairmerge_free(&pms[j]);
+	free(pms);
+	if (nblas > 1)
+		xm_blas_set_threads(blas_threads);
+}
+#ifdef _OPENMP
+	omp_set_max_active_levels(levels);
+#endif
+	xm_work_destroy(work);
+	xm_cache_destroy(cache);
+	free(sched.cblocks);
+	free(sched.tiles);
+	free(sched.owner);
+	free(blklist);
+	if (d == NULL)
+		xm_tensor_sync_block_norms(c);
+#ifdef XM_USE_MPI
+	if (d)
+		MPI_Allreduce(MPI_IN_PLACE, &dot, 1, MPI_DOUBLE_COMPLEX,
+		    MPI_SUM, MPI_COMM_WORLD);
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+	return dot;
+}
+
+void
+xm_contract(xm_scalar_t alpha, const xm_tensor_t *a, const xm_tensor_t *b,
+    xm_scalar_t beta, xm_tensor_t *c, const char *idxa, const char *idxb,
+    const char *idxc)
+{
+	struct term term;
+
+	make_term(&term, alpha, a, b, c, idxa, idxb, idxc);
+	contract_terms(&term, 1, beta, c, NULL, NULL, NULL);
+}
+
+void
+xm_contract_epilogue(xm_scalar_t alpha, const xm_tensor_t *a,
+    const xm_tensor_t *b, xm_scalar_t beta, xm_tensor_t *c, const char *idxa,
+    const char *idxb, const char *idxc, xm_epilogue_t fn, void *data)
+{
+	struct term term;
+
+	make_term(&term, alpha, a, b, c, idxa, idxb, idxc);
+	contract_terms(&term, 1, beta, c, NULL, fn, data);
+}
+
+void
+xm_epilogue_scale(const xm_tensor_t *c, xm_dim_t blkidx, void *buf,
+    void *scratch, void *data)
+{
+	(void)scratch;
+	xm_scalar_scale(buf, *(const xm_scalar_t *)data,
+	    xm_tensor_get_block_size(c, blkidx), xm_tensor_get_scalar_type(c));
+}
+
+void
+xm_epilogue_divide(const xm_tensor_t *c, xm_dim_t blkidx, void *buf,
+    void *scratch, void *data)
+{
+	const xm_tensor_t *t = data;
+	xm_dim_t mask_i, mask_j;
+	size_t blksize;
+	void *buf2;
+
+	if (!xm_block_space_eq(xm_tensor_get_block_space(c),
+	    xm_tensor_get_block_space(t)))
+		fatal("inconsistent block-spaces");
+	if (xm_tensor_get_scalar_type(c) != xm_tensor_get_scalar_type(t))
+		fatal("tensors must have same scalar type");
+	if (xm_tensor_get_block_type(t, blkidx) == XM_BLOCK_TYPE_ZERO)
+		fatal("division by zero");
+	blksize = xm_tensor_get_block_size(c, blkidx);
+	buf2 = (char *)scratch + xm_tensor_get_block_bytes(c, blkidx);
+	mask_i = xm_dim_identity_permutation(blkidx.n);
+	mask_j = xm_dim_zero(0);
+	xm_tensor_read_block(t, blkidx, scratch);
+	xm_tensor_unfold_block(t, blkidx, mask_i, mask_j, scratch, buf2,
+	    blksize);
+	xm_scalar_vec_div(buf, xm_tensor_get_block_scalar(t, blkidx), buf2,
+	    blksize, xm_tensor_get_scalar_type(c));
+}
+
+void
+xm_epilogue_clip(const xm_tensor_t *c, xm_dim_t blkidx, void *buf,
+    void *scratch, void *data)
+{
+	(void)scratch;
+	xm_scalar_clip(buf, *(const double *)data,
+	    xm_tensor_get_block_size(c, blkidx), xm_tensor_get_scalar_type(c));
+}
+
+void
+xm_epilogue_norm2(const xm_tensor_t *c, xm_dim_t blkidx, void *buf,
+    void *scratch, void *data)
+{
+	double *sum = data, norm;
+
+	(void)scratch;
+	norm = xm_scalar_norm(buf, xm_tensor_get_block_size(c, blkidx),
+	    xm_tensor_get_scalar_type(c));
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+	*sum += norm * norm;
+}
+
+void
+xm_contract_multi(const xm_contract_term_t *terms, size_t nterms,
+    xm_scalar_t beta, xm_tensor_t *c)
+{
+	struct term *t;
+	size_t i;
+
+	if (nterms == 0)
+		fatal("no contraction terms");
+	if ((t = malloc(nterms * sizeof *t)) == NULL)
+		fatal("out of memory");
+	for (i = 0; i < nterms; i++)
+		make_term(&t[i], terms[i].alpha, terms[i].a, terms[i].b, c,
+		    terms[i].idxa, terms[i].idxb, terms[i].idxc);
+	contract_terms(t, nterms, beta, c, NULL, NULL, NULL);
+	free(t);
+}
+
+xm_scalar_t
+xm_contract_dot(const xm_tensor_t *a, const xm_tensor_t *b,
+    const xm_tensor_t *d, const char *idxa, const char *idxb,
+    const char *idxd)
+{
+	struct term term;
+	xm_tensor_t *c;
+	xm_dim_t idx, nblocks;
+	xm_scalar_t dot;
+
+	/* every non-zero block of d needs a canonical output block; the
+	 * output blocks are never read or written, so they get no data */
+	c = xm_tensor_create(xm_tensor_get_block_space(d),
+	    xm_tensor_get_scalar_type(d), xm_tensor_get_allocator(d));
+	nblocks = xm_tensor_get_nblocks(d);
+	idx = xm_dim_zero(nblocks.n);
+	while (xm_dim_ne(&idx, &nblocks)) {
+		if (xm_tensor_get_block_type(d, idx) != XM_BLOCK_TYPE_ZERO)
+			xm_tensor_set_canonical_block_raw(c, idx,
+			    xm_dim_offset(&idx, &nblocks));
+		xm_dim_inc(&idx, &nblocks);
+	}
+	make_term(&term, 1, a, b, c, idxa, idxb, idxd);
+	dot = contract_terms(&term, 1, 0, c, d, NULL, NULL);
+	xm_tensor_free(c);
+	return dot;
+}
+
+/* Return the position of dim in the mask or mask->n if it is not there. */
+static size_t
+mask_find(const xm_dim_t *mask, size_t dim)
+{
+	size_t i;
+
+	for (i = 0; i < mask->n; i++)
+		if (mask->i[i] == dim)
+			break;
+	return i;
+}
+
+/* Return non-zero if the block structure of the tensor implies
+ * t(p(i)) = scalar * t(i) for the permutation p of its dimensions.  Blocks
+ * that the permutation maps onto themselves are assumed to follow the
+ * symmetry, so at least one pair of related non-zero blocks is required. */
+static int
+operand_symmetry(const xm_tensor_t *t, xm_dim_t perm, xm_scalar_t *scalar)
+{
+	const xm_block_space_t *bs;
+	xm_dim_t id, x, y, px, py, u, v, nblocks;
+	xm_block_type_t typex, typey;
+	xm_scalar_t s;
+	size_t i;
+	int found = 0;
+
+	*scalar = 1;
+	id = xm_dim_identity_permutation(perm.n);
+	if (xm_dim_eq(&perm, &id))
+		return 1;
+	bs = xm_tensor_get_block_space(t);
+	for (i = 0; i < perm.n; i++)
+		if (!xm_block_space_eq1(bs, i, bs, perm.i[i]))
+			return 0;
+	nblocks = xm_tensor_get_nblocks(t);
+	x = xm_dim_zero(nblocks.n);
+	while (xm_dim_ne(&x, &nblocks)) {
+		y = xm_dim_permute(&x, &perm);
+		typex = xm_tensor_get_block_type(t, x);
+		typey = xm_tensor_get_block_type(t, y);
+		if ((typex == XM_BLOCK_TYPE_ZERO) !=
+		    (typey == XM_BLOCK_TYPE_ZERO))
+			return 0;
+		if (typex != XM_BLOCK_TYPE_ZERO && xm_dim_ne(&x, &y)) {
+			/* both blocks must come from the same data with the
+			 * permutation of y equal to that of x after p */
+			if (xm_tensor_get_block_data_ptr(t, x) !=
+			    xm_tensor_get_block_data_ptr(t, y))
+				return 0;
+			px = xm_tensor_get_block_permutation(t, x);
+			py = xm_tensor_get_block_permutation(t, y);
+			u = xm_dim_permute(&id, &perm);
+			u = xm_dim_permute(&u, &py);
+			v = xm_dim_permute(&id, &px);
+			if (xm_dim_ne(&u, &v))
+				return 0;
+			s = xm_tensor_get_block_scalar(t, y) /
+			    xm_tensor_get_block_scalar(t, x);
+			if (found && s != *scalar)
+				return 0;
+			*scalar = s;
+			found = 1;
+		}
+		xm_dim_inc(&x, &nblocks);
+	}
+	return found;
+}
+
+/* Return non-zero if the symmetry of the operands implies
+ * c(p(i)) = scalar * c(i) for the exchange p of pairs of dimensions of c. */
+static int
+term_symmetry(const struct term *t, xm_dim_t perm, xm_scalar_t *scalar)
+{
+	xm_dim_t perma, permb;
+	xm_scalar_t sa, sb;
+	size_t i, j, ia, ja, ib, jb;
+
+	perma = xm_dim_identity_permutation(t->aidxa.n + t->cidxa.n);
+	permb = xm_dim_identity_permutation(t->aidxb.n + t->cidxb.n);
+	for (i = 0; i < perm.n; i++) {
+		j = perm.i[i];
+		ia = mask_find(&t->cidxc, i);
+		ja = mask_find(&t->cidxc, j);
+		ib = mask_find(&t->aidxc, i);
+		jb = mask_find(&t->aidxc, j);
+		/* exchanged indices must come from the same operands */
+		if ((ia < t->cidxc.n) != (ja < t->cidxc.n) ||
+		    (ib < t->aidxc.n) != (jb < t->aidxc.n))
+			return 0;
+		if (ia < t->cidxc.n)
+			perma.i[t->aidxa.i[ia]] = t->aidxa.i[ja];
+		if (ib < t->aidxc.n)
+			permb.i[t->aidxb.i[ib]] = t->aidxb.i[jb];
+	}
+	if (!operand_symmetry(t->a, perma, &sa) ||
+	    !operand_symmetry(t->b, permb, &sb))
+		return 0;
+	*scalar = sa * sb;
+	return 1;
+}
+
+/* Return non-zero if exchanging the operands of the term gives the same
+ * result, which requires a and b to be the same tensor.  The permutation of
+ * the dimensions of c that corresponds to the exchange is stored in perm. */
+static int
+swap_symmetry(const struct term *t, xm_dim_t *perm)
+{
+	size_t i, j;
+
+	if (t->a != t->b || t->nbatch > 0 || t->aidxa.n == 0 ||
+	    t->aidxa.n != t->aidxb.n)
+		return 0;
+	for (i = 0; i < t->cidxa.n; i++) {
+		j = mask_find(&t->cidxa, t->cidxb.i[i]);
+		if (j == t->cidxa.n || t->cidxb.i[j] != t->cidxa.i[i])
+			return 0;
+	}
+	*perm = xm_dim_identity_permutation(t->cidxc.n + t->aidxc.n);
+	for (i = 0; i < t->aidxa.n; i++) {
+		j = mask_find(&t->aidxb, t->aidxa.i[i]);
+		if (j == t->aidxb.n)
+			return 0;
+		perm->i[t->cidxc.i[i]] = t->aidxc.i[j];
+		perm->i[t->aidxc.i[j]] = t->cidxc.i[i];
+	}
+	return 1;
+}
+
+/* Make blocks related by the symmetries derivative blocks.  Blocks are
+ * visited in storage order, so a block is only ever derived from a block
+ * that comes before it and the sources are always canonical. */
+static void
+apply_symmetries(xm_tensor_t *c, const xm_dim_t *perms,
+    const xm_scalar_t *scalars, size_t nperms)
+{
+	xm_dim_t id, x, y, z, px, py, u, nblocks;
+	xm_scalar_t sx;
+	size_t i, j, nblk;
+
+	nblocks = xm_tensor_get_nblocks(c);
+	nblk = xm_dim_dot(&nblocks);
+	id = xm_dim_identity_permutation(nblocks.n);
+	for (i = 0; i < nblk; i++) {
+		x = xm_dim_from_offset(i, &nblocks);
+		if (xm_tensor_get_block_type(c, x) == XM_BLOCK_TYPE_ZERO)
+			continue;
+		/* data pointers of the scratch tensor are block offsets */
+		z = xm_dim_from_offset(xm_tensor_get_block_data_ptr(c, x),
+		    &nblocks);
+		px = xm_tensor_get_block_permutation(c, x);
+		sx = xm_tensor_get_block_scalar(c, x);
+		for (j = 0; j < nperms; j++) {
+			y = xm_dim_permute(&x, &perms[j]);
+			if (xm_dim_offset(&y, &nblocks) <= i ||
+			    xm_tensor_get_block_type(c, y) !=
+			    XM_BLOCK_TYPE_CANONICAL)
+				continue;
+			u = xm_dim_permute(&id, &perms[j]);
+			u = xm_dim_permute(&u, &px);
+			py = xm_dim_permute(&id, &u);
+			xm_tensor_set_zero_block(c, y);
+			xm_tensor_set_derivative_block(c, y, z, py,
+			    scalars[j] * sx);
+		}
+	}
+}
+
+xm_tensor_t *
+xm_contract_structure(const xm_tensor_t *a, const xm_tensor_t *b,
+    const char *idxa, const char *idxb, const char *idxc)
+{
+	struct term t;
+	const xm_block_space_t *bsa, *bsb, *src[XM_MAX_DIM];
+	xm_block_space_t *bs;
+	xm_tensor_t *c, *ret;
+	xm_dim_t absdims, dims, nblocksa, nblocksb, nblocksc, blkidxa, blkidxb;
+	xm_dim_t blkidxc, perm, perms[XM_MAX_DIM * XM_MAX_DIM * XM_MAX_DIM];
+	xm_scalar_t scalars[XM_MAX_DIM * XM_MAX_DIM * XM_MAX_DIM];
+	const char *p;
+	size_t i, j, k, l, n, nperms = 0;
+
+	bsa = xm_tensor_get_block_space(a);
+	bsb = xm_tensor_get_block_space(b);
+	n = strlen(idxc);
+	if (n == 0 || n > XM_MAX_DIM ||
+	    strlen(idxa) != xm_block_space_get_ndims(bsa) ||
+	    strlen(idxb) != xm_block_space_get_ndims(bsb))
+		fatal("bad contraction indices");
+	/* each index of c takes its blocks from a or b */
+	absdims = xm_dim_zero(n);
+	dims = xm_dim_zero(n);
+	for (i = 0; i < n; i++) {
+		if ((p = strchr(idxa, idxc[i])) != NULL) {
+			src[i] = bsa;
+			dims.i[i] = p - idxa;
+		} else if ((p = strchr(idxb, idxc[i])) != NULL) {
+			src[i] = bsb;
+			dims.i[i] = p - idxb;
+		} else
+			fatal("bad contraction indices");
+		absdims.i[i] = xm_block_space_get_abs_dims(src[i]).i[dims.i[i]];
+	}
+	if ((bs = xm_block_space_create(absdims)) == NULL)
+		fatal("out of memory");
+	for (i = 0; i < n; i++) {
+		nblocksc = xm_block_space_get_nblocks(src[i]);
+		for (j = 1; j < nblocksc.i[dims.i[i]]; j++)
+			xm_block_space_split(bs, i, xm_block_space_get_split(
+			    (xm_block_space_t *)src[i], dims.i[i], j));
+	}
+	/* the structure is built in a scratch tensor whose canonical blocks
+	 * hold their own offsets instead of data */
+	c = xm_tensor_create(bs, xm_tensor_get_scalar_type(a),
+	    xm_tensor_get_allocator(a));
+	xm_block_space_free(bs);
+	make_term(&t, 1, a, b, c, idxa, idxb, idxc);
+	nblocksa = xm_tensor_get_nblocks(a);
+	nblocksb = xm_tensor_get_nblocks(b);
+	nblocksc = xm_tensor_get_nblocks(c);
+	blkidxc = xm_dim_zero(nblocksc.n);
+	while (xm_dim_ne(&blkidxc, &nblocksc)) {
+		blkidxa = xm_dim_zero(nblocksa.n);
+		blkidxb = xm_dim_zero(nblocksb.n);
+		xm_dim_set_mask(&blkidxa, &t.aidxa, &blkidxc, &t.cidxc);
+		xm_dim_set_mask(&blkidxb, &t.aidxb, &blkidxc, &t.aidxc);
+		for (k = 0; k < t.nblkk; k++) {
+			if (xm_tensor_get_block_type(a, blkidxa) !=
+			    XM_BLOCK_TYPE_ZERO &&
+			    xm_tensor_get_block_type(b, blkidxb) !=
+			    XM_BLOCK_TYPE_ZERO) {
+				xm_tensor_set_canonical_block_raw(c, blkidxc,
+				    xm_dim_offset(&blkidxc, &nblocksc));
+				break;
+			}
+			xm_dim_inc_mask(&blkidxa, &nblocksa, &t.cidxa);
+			xm_dim_inc_mask(&blkidxb, &nblocksb, &t.cidxb);
+		}
+		xm_dim_inc(&blkidxc, &nblocksc);
+	}
+	/* symmetries are looked for among exchanges of one or two pairs of
+	 * indices of c */
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++) {
+			perm = xm_dim_identity_permutation(n);
+			perm.i[i] = j;
+			perm.i[j] = i;
+			if (term_symmetry(&t, perm, &scalars[nperms]))
+				perms[nperms++] = perm;
+			for (k = i + 1; k < n; k++) {
+				if (k == j)
+					continue;
+				for (l = k + 1; l < n; l++) {
+					if (l == j)
+						continue;
+					perm = xm_dim_identity_permutation(n);
+					perm.i[i] = j;
+					perm.i[j] = i;
+					perm.i[k] = l;
+					perm.i[l] = k;
+					if (term_symmetry(&t, perm,
+					    &scalars[nperms]))
+						perms[nperms++] = perm;
+				}
+			}
+		}
+	}
+	if (swap_symmetry(&t, &perm)) {
+		scalars[nperms] = 1;
+		perms[nperms++] = perm;
+	}
+	apply_symmetries(c, perms, scalars, nperms);
+	ret = xm_tensor_create_structure(c, xm_tensor_get_scalar_type(a),
+	    NULL);
+	xm_tensor_free(c);
+	return ret;
+}
+
+/* Count reads of an operand block the same way panel_get and operand_get
+ * do, using a cache that holds no data. */
+static void
+estimate_operand(xm_cost_t *cost, xm_cache_t *cache, struct panel *panel,
+    size_t slot, const xm_tensor_t *t, xm_dim_t blkidx, xm_dim_t mask_i,
+    xm_dim_t mask_j, size_t stride)
+{
+	struct operand_key key;
+	size_t bytes;
+	void *data;
+	int fill;
+
+	if (panel && panel->data[slot])
+		return;
+	bytes = xm_tensor_get_block_bytes(t, blkidx);
+	operand_key_init(&key, t, blkidx, mask_i, mask_j, stride);
+	data = xm_cache_get(cache, &key, sizeof key, bytes, &fill);
+	if (data == NULL || fill)
+		cost->bytes_read += bytes;
+	if (data == NULL)
+		return;
+	if (fill)
+		xm_cache_done(cache, data);
+	if (panel)
+		panel->data[slot] = data;
+	else
+		xm_cache_release(cache, data);
+}
+
+/* Same as compute_term but only counts the work. */
+static void
+estimate_term(xm_cost_t *cost, const struct term *t, const xm_tensor_t *c,
+    xm_dim_t blkidxc, struct pairmerge *pm, const struct workspace *ws,
+    xm_cache_t *cache, struct panel *pa, struct panel *pb, int concat)
+{
+	const struct blockpair *pairs = pm->pairs;
+	xm_dim_t dims, fa, fb, bidxc;
+	xm_scalar_type_t type;
+	size_t i, m, n, k, nb, kk[2] = { 0, 0 }, el;
+	double maxbound;
+	int single;
+
+	type = xm_tensor_get_scalar_type(c);
+	el = xm_scalar_sizeof(type);
+	dims = xm_tensor_get_block_dims(c, blkidxc);
+	fa = mask_free(t->cidxc, t->nbatch);
+	fb = mask_free(t->aidxc, t->nbatch);
+	bidxc = mask_batch(t->cidxc, t->nbatch);
+	m = xm_dim_dot_mask(&dims, &fa);
+	n = xm_dim_dot_mask(&dims, &fb);
+	nb = xm_dim_dot_mask(&dims, &bidxc);
+	if (t->nbatch > 0)
+		concat = 0;
+	make_pairs(t, blkidxc, pm, type,
+	    ws->precision == XM_PRECISION_MIXED_ADAPTIVE);
+	maxbound = max_bound(pairs, t->nblkk, ws);
+	for (i = 0; i < t->nblkk; i++) {
+		if (pairs[i].alpha == 0)
+			continue;
+		dims = xm_tensor_get_block_dims(t->a, pairs[i].blkidxa);
+		k = xm_dim_dot_mask(&dims, &t->cidxa);
+		cost->flops += xm_flops((double)m * n * k * nb, 1, type);
+		if (!concat) {
+			estimate_operand(cost, cache, pa, i, t->a,
+			    pairs[i].blkidxa, t->cidxa, t->aidxa, k);
+			estimate_operand(cost, cache, pb, i, t->b,
+			    pairs[i].blkidxb, t->cidxb, t->aidxb, k);
+			cost->ngemm += nb;
+			continue;
+		}
+		estimate_operand(cost, cache, pa, i, t->a, pairs[i].blkidxa,
+		    t->aidxa, t->cidxa, m);
+		estimate_operand(cost, cache, pb, i, t->b, pairs[i].blkidxb,
+		    t->aidxb, t->cidxb, n);
+		cost->flops += xm_flops((double)k * n, 0, type);
+		/* pairs of each precision are stacked separately */
+		single = pair_single(&pairs[i], maxbound, ws);
+		if (kk[single] > 0 &&
+		    ((kk[single] + k) * m * el > ws->concatbytesa ||
+		    (kk[single] + k) * n * el > ws->concatbytesb)) {
+			cost->ngemm++;
+			kk[single] = 0;
+		}
+		kk[single] += k;
+	}
+	for (single = 0; single < 2; single++)
+		if (kk[single] > 0)
+			cost->ngemm++;
+}
+
+/* Walk the schedule of contract_terms without touching any data.  Each
+ * process is simulated separately with its own operand cache.  Tiles are
+ * assigned by the static owner split even when xm_work_next hands them
+ * out on demand, so cache reuse and peak memory are approximate then. */
+static xm_cost_t
+estimate_terms(const struct term *terms, size_t nterms, xm_scalar_t beta,
+    const xm_tensor_t *c)
+{
+	struct schedule sched;
+	struct pairmerge *pms;
+	struct panel panel, *pa = NULL, *pb = NULL;
+	struct workspace ws;
+	const struct tile *tile;
+	xm_cache_t *cache;
+	xm_cost_t cost;
+	xm_dim_t blkidxc, *blklist;
+	xm_scalar_type_t type;
+	size_t i, j, k, bytes, wsbytes, peak, nblklist;
+	int rank, mpisize = 1, concat, workers, inner, spare;
+
+	memset(&cost, 0, sizeof cost);
+#ifdef XM_USE_MPI
+	MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
+#endif
+	concat = concat_k;
+	type = xm_tensor_get_scalar_type(c);
+	sync_operand_norms(terms, nterms);
+	xm_tensor_get_canonical_block_list(c, &blklist, &nblklist);
+	make_schedule(terms, nterms, c, blklist, nblklist, mpisize, &sched);
+	split_threads((sched.ntiles + mpisize - 1) / mpisize, c, &workers,
+	    &inner, &spare);
+	if ((pms = malloc(nterms * sizeof *pms)) == NULL)
+		fatal("out of memory");
+	for (j = 0; j < nterms; j++)
+		pairmerge_init(&pms[j], terms[j].nblkk);
+	wsbytes = workspace_size(&ws, terms, nterms, c, concat,
+	    gemm_precision);
+	if (sched.stationary == STATIONARY_A)
+		pa = &panel;
+	if (sched.stationary == STATIONARY_B)
+		pb = &panel;
+	panel.n = terms->nblkk;
+	if ((panel.data = calloc(panel.n, sizeof *panel.data)) == NULL)
+		fatal("out of memory");
+	for (rank = 0; rank < mpisize; rank++) {
+		cache = xm_cache_create_dry(panel_limit);
+		for (i = 0; i < sched.ntiles; i++) {
+			if (sched.owner[i] != rank)
+				continue;
+			tile = &sched.tiles[i];
+			for (j = 0; j < tile->count; j++) {
+				blkidxc = sched.cblocks[tile->first + j].blkidx;
+				bytes = xm_tensor_get_block_bytes(c, blkidxc);
+				if (beta != 0) {
+					cost.bytes_read += bytes;
+					if (beta != 1)
+						cost.flops += xm_flops((double)
+						    xm_tensor_get_block_size(c,
+						    blkidxc), 0, type);
+				}
+				cost.bytes_written += bytes;
+				for (k = 0; k < nterms; k++)
+					if (terms[k].alpha != 0)
+						estimate_term(&cost, &terms[k],
+						    c, blkidxc, &pms[k], &ws,
+						    cache, pa, pb, concat);
+			}
+			if (pa || pb)
+				panel_reset(&panel, cache);
+		}
+		peak = (size_t)workers * wsbytes +
+		    xm_cache_get_peak_bytes(cache);
+		if (peak > cost.peak_memory)
+			cost.peak_memory = peak;
+		xm_cache_destroy(cache);
+	}
+	free(panel.data);
+	for (j = 0; j < nterms; j++)
+		pairmerge_free(&pms[j]);
+	free(pms);
+	free(sched.cblocks);
+	free(sched.tiles);
+	free(sched.owner);
+	free(blklist);
+	return cost;
+}
+
+xm_cost_t
+xm_contract_estimate(xm_scalar_t alpha, const xm_tensor_t *a,
+    const xm_tensor_t *b, xm_scalar_t beta, const xm_tensor_t *c,
+    const char *idxa, const char *idxb, const char *idxc)
+{
+	struct term term;
+
+	make_term(&term, alpha, a, b, c, idxa, idxb, idxc);
+	return estimate_terms(&term, 1, beta, c);
 }
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2014-2018 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xm.h"
+#include "util.h"
+
+#define EINSUM_MAX_TENSORS 12
+#define EINSUM_MAX_INDICES 64
+
+/* A byte read or written through the allocator costs as much as this many
+ * floating-point operations. */
+#define EINSUM_BYTE_COST 8.0
+
+struct einsum_index {
+	char name;
+	const xm_tensor_t *tensor; /* tensor and dimension giving the splits */
+	size_t dim, absdim, nblocks;
+};
+
+/* Best way to contract a subset of the operands. */
+struct einsum_node {
+	uint64_t idx; /* indices of the result */
+	double density; /* estimated fraction of non-zero blocks */
+	double cost;
+	unsigned left; /* operands of the left subtree, zero for operands */
+};
+
+struct einsum {
+	const xm_tensor_t *tensors[EINSUM_MAX_TENSORS];
+	char idx[EINSUM_MAX_TENSORS][XM_MAX_DIM + 1];
+	size_t ntensors;
+	struct einsum_index indices[EINSUM_MAX_INDICES];
+	size_t nindices;
+	struct einsum_node *nodes;
+	xm_scalar_type_t type;
+};
+
+static size_t
+popcount(uint64_t x)
+{
+	size_t n = 0;
+
+	for (; x; x &= x - 1)
+		n++;
+	return n;
+}
+
+static size_t
+einsum_find_index(struct einsum *es, char name)
+{
+	size_t i;
+
+	for (i = 0; i < es->nindices; i++)
+		if (es->indices[i].name == name)
+			return i;
+	return es->nindices;
+}
+
+static uint64_t
+einsum_mask(struct einsum *es, const char *idx)
+{
+	uint64_t mask = 0;
+
+	for (; *idx; idx++)
+		mask |= (uint64_t)1 << einsum_find_index(es, *idx);
+	return mask;
+}
+
+/* Record indices of a tensor checking that block-spaces agree. */
+static void
+einsum_add_indices(struct einsum *es, const xm_tensor_t *t, const char *idx)
+{
+	const xm_block_space_t *bs = xm_tensor_get_block_space(t);
+	struct einsum_index *ei;
+	xm_dim_t absdims, nblocks;
+	size_t i, j;
+
+	if (strlen(idx) != xm_block_space_get_ndims(bs))
+		fatal("einsum indices do not match tensor dimensions");
+	absdims = xm_block_space_get_abs_dims(bs);
+	nblocks = xm_block_space_get_nblocks(bs);
+	for (i = 0; idx[i]; i++) {
+		if (strchr(idx + i + 1, idx[i]))
+			fatal("repeated index in einsum operand");
+		j = einsum_find_index(es, idx[i]);
+		if (j < es->nindices) {
+			ei = &es->indices[j];
+			if (!xm_block_space_eq1(
+			    xm_tensor_get_block_space(ei->tensor), ei->dim,
+			    bs, i))
+				fatal("inconsistent einsum block-spaces");
+			continue;
+		}
+		if (es->nindices == EINSUM_MAX_INDICES)
+			fatal("too many einsum indices");
+		ei = &es->indices[es->nindices++];
+		ei->name = idx[i];
+		ei->tensor = t;
+		ei->dim = i;
+		ei->absdim = absdims.i[i];
+		ei->nblocks = nblocks.i[i];
+	}
+}
+
+static double
+einsum_elements(struct einsum *es, uint64_t mask)
+{
+	double n = 1;
+	size_t i;
+
+	for (i = 0; i < es->nindices; i++)
+		if (mask & ((uint64_t)1 << i))
+			n *= (double)es->indices[i].absdim;
+	return n;
+}
+
+static double
+einsum_blocks(struct einsum *es, uint64_t mask)
+{
+	double n = 1;
+	size_t i;
+
+	for (i = 0; i < es->nindices; i++)
+		if (mask & ((uint64_t)1 << i))
+			n *= (double)es->indices[i].nblocks;
+	return n;
+}
+
+static double
+tensor_density(const xm_tensor_t *t)
+{
+	xm_dim_t idx, nblocks;
+	size_t i, n, nnz = 0;
+
+	nblocks = xm_tensor_get_nblocks(t);
+	n = xm_dim_dot(&nblocks);
+	idx = xm_dim_zero(nblocks.n);
+	for (i = 0; i < n; i++) {
+		if (xm_tensor_get_block_type(t, idx) != XM_BLOCK_TYPE_ZERO)
+			nnz++;
+		xm_dim_inc(&idx, &nblocks);
+	}
+	return n > 0 ? (double)nnz / (double)n : 0;
+}
+
+/* Find the cheapest order of pairwise contractions for every subset of
+ * operands.  The cost counts floating-point operations and bytes moved
+ * through the allocator.  Block sparsity of operands is taken into account
+ * and the sparsity of intermediates is estimated assuming that non-zero
+ * blocks are placed independently. */
+static void
+einsum_plan(struct einsum *es)
+{
+	struct einsum_node *node, *l, *r;
+	unsigned s, left, full;
+	uint64_t cidx;
+	size_t i, el;
+	double dens, flops, bytes, cost;
+
+	full = (1u << es->ntensors) - 1;
+	el = xm_scalar_sizeof(es->type);
+	if ((es->nodes = calloc(full + 1, sizeof *es->nodes)) == NULL)
+		fatal("out of memory");
+	for (i = 0; i < es->ntensors; i++) {
+		node = &es->nodes[1u << i];
+		node->idx = einsum_mask(es, es->idx[i]);
+		node->density = tensor_density(es->tensors[i]);
+	}
+	for (s = 1; s <= full; s++) {
+		if (popcount(s) < 2)
+			continue;
+		node = &es->nodes[s];
+		node->cost = HUGE_VAL;
+		/* indices shared by two operands of the subset are
+		 * contracted */
+		node->idx = es->nodes[s & -s].idx ^
+		    es->nodes[s & (s - 1)].idx;
+		if (popcount(node->idx) > XM_MAX_DIM ||
+		    (node->idx == 0 && s != full))
+			continue;
+		for (left = (s - 1) & s; left > 0; left = (left - 1) & s) {
+			/* visit each split once */
+			if (!(left & (s & -s)))
+				continue;
+			l = &es->nodes[left];
+			r = &es->nodes[s ^ left];
+			if (l->cost == HUGE_VAL || r->cost == HUGE_VAL)
+				continue;
+			cidx = l->idx & r->idx;
+			flops = 2 * einsum_elements(es, l->idx | r->idx) *
+			    l->density * r->density;
+			dens = 1 - pow(1 - l->density * r->density,
+			    einsum_blocks(es, cidx));
+			bytes = el * (l->density *
+			    einsum_elements(es, l->idx) + r->density *
+			    einsum_elements(es, r->idx));
+			if (s != full)
+				bytes += el * dens *
+				    einsum_elements(es, node->idx);
+			cost = l->cost + r->cost + flops +
+			    EINSUM_BYTE_COST * bytes;
+			if (cost < node->cost) {
+				node->cost = cost;
+				node->density = dens;
+				node->left = left;
+			}
+		}
+	}
+	if (es->nodes[full].cost == HUGE_VAL)
+		fatal("no valid einsum contraction order");
+}
+
+/* Create an intermediate for the contraction of x and y.  Blocks that get
+ * no contribution from non-zero blocks of x and y are left zero. */
+static xm_tensor_t *
+einsum_intermediate(struct einsum *es, const xm_tensor_t *x,
+    const char *idxx, const xm_tensor_t *y, const char *idxy, char *idxz,
+    xm_allocator_t *allocator)
+{
+	const struct einsum_index *ei;
+	xm_block_space_t *bs, *src;
+	xm_tensor_t *z;
+	xm_dim_t absdims, nblocksx, nblocksy, nblocksz;
+	xm_dim_t zx, xz, zy, yz, cx, cy, blkx, blky, blkz;
+	size_t i, j, k, n, nk;
+
+	n = 0;
+	for (i = 0; idxx[i]; i++)
+		if (strchr(idxy, idxx[i]) == NULL)
+			idxz[n++] = idxx[i];
+	for (i = 0; idxy[i]; i++)
+		if (strchr(idxx, idxy[i]) == NULL)
+			idxz[n++] = idxy[i];
+	idxz[n] = '\0';
+	absdims = xm_dim_zero(n);
+	for (i = 0; i < n; i++)
+		absdims.i[i] = es->indices[einsum_find_index(es,
+		    idxz[i])].absdim;
+	bs = xm_block_space_create(absdims);
+	for (i = 0; i < n; i++) {
+		ei = &es->indices[einsum_find_index(es, idxz[i])];
+		src = (xm_block_space_t *)xm_tensor_get_block_space(
+		    ei->tensor);
+		for (j = 1; j < ei->nblocks; j++)
+			xm_block_space_split(bs, i,
+			    xm_block_space_get_split(src, ei->dim, j));
+	}
+	z = xm_tensor_create(bs, es->type, allocator);
+	xm_block_space_free(bs);
+
+	xm_make_masks(idxz, idxx, &zx, &xz);
+	xm_make_masks(idxz, idxy, &zy, &yz);
+	xm_make_masks(idxx, idxy, &cx, &cy);
+	nblocksx = xm_tensor_get_nblocks(x);
+	nblocksy = xm_tensor_get_nblocks(y);
+	nblocksz = xm_tensor_get_nblocks(z);
+	nk = xm_dim_dot_mask(&nblocksx, &cx);
+	blkz = xm_dim_zero(n);
+	for (i = 0; i < xm_dim_dot(&nblocksz); i++) {
+		blkx = xm_dim_zero(nblocksx.n);
+		blky = xm_dim_zero(nblocksy.n);
+		xm_dim_set_mask(&blkx, &xz, &blkz, &zx);
+		xm_dim_set_mask(&blky, &yz, &blkz, &zy);
+		for (k = 0; k < nk; k++) {
+			if (xm_tensor_get_block_type(x, blkx) !=
+			    XM_BLOCK_TYPE_ZERO &&
+			    xm_tensor_get_block_type(y, blky) !=
+			    XM_BLOCK_TYPE_ZERO) {
+				xm_tensor_set_canonical_block(z, blkz);
+				break;
+			}
+			xm_dim_inc_mask(&blkx, &nblocksx, &cx);
+			xm_dim_inc_mask(&blky, &nblocksy, &cy);
+		}
+		xm_dim_inc(&blkz, &nblocksz);
+	}
+	return z;
+}
+
+static void
+einsum_free_intermediate(xm_tensor_t *t)
+{
+	xm_tensor_free_block_data(t);
+	xm_tensor_free(t);
+}
+
+/* Compute the result for a subset of operands.  The result is either one of
+ * the operands or a new intermediate, in which case *tmp is set. */
+static const xm_tensor_t *
+einsum_exec(struct einsum *es, unsigned s, char *idx, int *tmp,
+    xm_scalar_t alpha, xm_scalar_t beta, xm_tensor_t *c, const char *idxc)
+{
+	const struct einsum_node *node = &es->nodes[s];
+	const xm_tensor_t *x, *y;
+	xm_tensor_t *z;
+	char idxx[XM_MAX_DIM + 1], idxy[XM_MAX_DIM + 1];
+	int tmpx, tmpy;
+	size_t i;
+
+	*tmp = 0;
+	if (node->left == 0) {
+		for (i = 0; (1u << i) != s; i++)
+			continue;
+		strcpy(idx, es->idx[i]);
+		return es->tensors[i];
+	}
+	x = einsum_exec(es, node->left, idxx, &tmpx, 1, 0, NULL, NULL);
+	y = einsum_exec(es, s ^ node->left, idxy, &tmpy, 1, 0, NULL, NULL);
+	if (c) {
+		z = c;
+		strcpy(idx, idxc);
+	} else {
+		z = einsum_intermediate(es, x, idxx, y, idxy, idx,
+		    xm_tensor_get_allocator(x));
+		*tmp = 1;
+	}
+	xm_contract(alpha, x, y, beta, z, idxx, idxy, idx);
+	/* intermediates are freed as soon as they are consumed */
+	if (tmpx)
+		einsum_free_intermediate((xm_tensor_t *)x);
+	if (tmpy)
+		einsum_free_intermediate((xm_tensor_t *)y);
+	return z;
+}
+
+void
+xm_einsum(const char *spec, xm_scalar_t alpha, const xm_tensor_t **tensors,
+    xm_scalar_t beta, xm_tensor_t *c)
+{
+	struct einsum es;
+	const char *p, *arrow, *end;
+	char idx[XM_MAX_DIM + 1];
+	size_t i, len, count[EINSUM_MAX_INDICES];
+	uint64_t mask;
+	int tmp;
+
+	memset(&es, 0, sizeof es);
+	es.type = xm_tensor_get_scalar_type(c);
+	if ((arrow = strstr(spec, "->")) == NULL)
+		fatal("einsum specification must contain \"->\"");
+	for (p = spec; p < arrow; p = end + 1) {
+		if ((end = strchr(p, ',')) == NULL || end > arrow)
+			end = arrow;
+		len = (size_t)(end - p);
+		if (es.ntensors == EINSUM_MAX_TENSORS)
+			fatal("too many einsum operands");
+		if (len > XM_MAX_DIM)
+			fatal("bad einsum specification");
+		memcpy(es.idx[es.ntensors], p, len);
+		es.idx[es.ntensors][len] = '\0';
+		es.tensors[es.ntensors] = tensors[es.ntensors];
+		einsum_add_indices(&es, tensors[es.ntensors],
+		    es.idx[es.ntensors]);
+		es.ntensors++;
+	}
+	einsum_add_indices(&es, c, arrow + 2);
+	/* every index must appear in exactly two tensors, counting the
+	 * output, and in at least one operand */
+	memset(count, 0, sizeof count);
+	for (i = 0; i < es.ntensors; i++)
+		for (p = es.idx[i]; *p; p++)
+			count[einsum_find_index(&es, *p)]++;
+	mask = einsum_mask(&es, arrow + 2);
+	for (i = 0; i < es.nindices; i++)
+		if (count[i] + ((mask >> i) & 1) != 2 || count[i] == 0)
+			fatal("unsupported einsum indices");
+	if (es.ntensors == 1) {
+		if (beta == 0)
+			xm_copy(c, alpha, es.tensors[0], arrow + 2, es.idx[0]);
+		else
+			xm_add(beta, c, alpha, es.tensors[0], arrow + 2,
+			    es.idx[0]);
+		return;
+	}
+	einsum_plan(&es);
+	einsum_exec(&es, (1u << es.ntensors) - 1, idx, &tmp, alpha, beta, c,
+	    arrow + 2);
+	free(es.nodes);
+}
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2014-2018 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef XM_USE_MPI
+#include <mpi.h>
+#endif
+
+#include "xm.h"
+#include "util.h"
+#include "work.h"
+
+typedef enum {
+	EXPR_OP_SET = 0,
+	EXPR_OP_ADD,
+	EXPR_OP_MUL,
+	EXPR_OP_DIV,
+} expr_op_type_t;
+
+struct expr_operand {
+	const xm_tensor_t *tensor;
+	char *idx;
+	xm_dim_t cidxa, cidxb;
+};
+
+struct expr_op {
+	expr_op_type_t type;
+	xm_scalar_t alpha, beta;
+	size_t operand;
+};
+
+struct xm_expr {
+	xm_tensor_t *tensor;
+	char *idx;
+	struct expr_operand *operands;
+	size_t noperands;
+	struct expr_op *ops;
+	size_t nops;
+};
+
+static char *
+expr_strdup(const char *s)
+{
+	char *ret;
+
+	if ((ret = malloc(strlen(s) + 1)) == NULL)
+		fatal("out of memory");
+	strcpy(ret, s);
+	return ret;
+}
+
+static size_t
+expr_add_operand(xm_expr_t *expr, const xm_tensor_t *b, const char *idxb)
+{
+	const xm_block_space_t *bsa, *bsb;
+	struct expr_operand *operand;
+	const xm_tensor_t *a = expr->tensor;
+	const char *idxa = expr->idx;
+	size_t i;
+
+	for (i = 0; i < expr->noperands; i++)
+		if (expr->operands[i].tensor == b &&
+		    strcmp(expr->operands[i].idx, idxb) == 0)
+			return i;
+	if (b == a)
+		fatal("operand must be different from the output tensor");
+	if (xm_tensor_get_allocator(a) != xm_tensor_get_allocator(b))
+		fatal("tensors must use same allocator");
+	if (xm_tensor_get_scalar_type(a) != xm_tensor_get_scalar_type(b))
+		fatal("tensors must have same scalar type");
+	bsa = xm_tensor_get_block_space(a);
+	bsb = xm_tensor_get_block_space(b);
+	if (strlen(idxb) != xm_block_space_get_ndims(bsb))
+		fatal("idxb does not match tensor dimensions");
+	expr->operands = realloc(expr->operands,
+	    (expr->noperands + 1) * sizeof *expr->operands);
+	if (expr->operands == NULL)
+		fatal("out of memory");
+	operand = &expr->operands[expr->noperands];
+	xm_make_masks(idxa, idxb, &operand->cidxa, &operand->cidxb);
+	if (operand->cidxa.n != xm_block_space_get_ndims(bsa) ||
+	    operand->cidxb.n != xm_block_space_get_ndims(bsb))
+		fatal("index spaces do not match");
+	for (i = 0; i < operand->cidxa.n; i++)
+		if (!xm_block_space_eq1(bsa, operand->cidxa.i[i],
+		    bsb, operand->cidxb.i[i]))
+			fatal("inconsistent block-spaces");
+	operand->tensor = b;
+	operand->idx = expr_strdup(idxb);
+	return expr->noperands++;
+}
+
+static void
+expr_add_op(xm_expr_t *expr, expr_op_type_t type, xm_scalar_t alpha,
+    xm_scalar_t beta, const xm_tensor_t *b, const char *idxb)
+{
+	struct expr_op *op;
+	size_t operand = 0;
+
+	if (b)
+		operand = expr_add_operand(expr, b, idxb);
+	expr->ops = realloc(expr->ops, (expr->nops + 1) * sizeof *expr->ops);
+	if (expr->ops == NULL)
+		fatal("out of memory");
+	op = &expr->ops[expr->nops++];
+	op->type = type;
+	op->alpha = alpha;
+	op->beta = beta;
+	op->operand = operand;
+}
+
+/* Returns non-zero if the op does not depend on the previous value. */
+static int
+expr_op_overwrites(const struct expr_op *op)
+{
+	return op->type == EXPR_OP_SET ||
+	    (op->type == EXPR_OP_ADD && op->alpha == 0);
+}
+
+xm_expr_t *
+xm_expr_create(xm_tensor_t *a, const char *idxa)
+{
+	xm_expr_t *ret;
+
+	if (strlen(idxa) != xm_block_space_get_ndims(
+	    xm_tensor_get_block_space(a)))
+		fatal("idxa does not match tensor dimensions");
+	if ((ret = calloc(1, sizeof *ret)) == NULL)
+		fatal("out of memory");
+	ret->tensor = a;
+	ret->idx = expr_strdup(idxa);
+	return ret;
+}
+
+void
+xm_expr_set(xm_expr_t *expr, xm_scalar_t x)
+{
+	expr_add_op(expr, EXPR_OP_SET, x, 0, NULL, NULL);
+}
+
+void
+xm_expr_copy(xm_expr_t *expr, xm_scalar_t s, const xm_tensor_t *b,
+    const char *idxb)
+{
+	expr_add_op(expr, EXPR_OP_ADD, 0, s, b, idxb);
+}
+
+void
+xm_expr_add(xm_expr_t *expr, xm_scalar_t alpha, xm_scalar_t beta,
+    const xm_tensor_t *b, const char *idxb)
+{
+	expr_add_op(expr, EXPR_OP_ADD, alpha, beta, b, idxb);
+}
+
+void
+xm_expr_mul(xm_expr_t *expr, const xm_tensor_t *b, const char *idxb)
+{
+	expr_add_op(expr, EXPR_OP_MUL, 0, 1, b, idxb);
+}
+
+void
+xm_expr_div(xm_expr_t *expr, const xm_tensor_t *b, const char *idxb)
+{
+	expr_add_op(expr, EXPR_OP_DIV, 0, 1, b, idxb);
+}
+
+void
+xm_expr_eval(xm_expr_t *expr)
+{
+	xm_tensor_t *a = expr->tensor;
+	xm_dim_t zero, *blklist;
+	xm_scalar_type_t scalartype;
+	size_t i, maxblkbytes, nblklist;
+	xm_work_t *work;
+	int mpisize = 1, parallel;
+
+	if (expr->nops == 0)
+		return;
+#ifdef XM_USE_MPI
+	MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
+#endif
+	scalartype = xm_tensor_get_scalar_type(a);
+	zero = xm_dim_zero(0);
+	maxblkbytes = xm_tensor_get_largest_block_bytes(a);
+	xm_tensor_get_canonical_block_list(a, &blklist, &nblklist);
+	parallel = xm_parallel_blocks((nblklist + mpisize - 1) / mpisize,
+	    xm_tensor_get_largest_block_size(a));
+	work = xm_work_create(nblklist, NULL);
+#ifdef _OPENMP
+#pragma omp parallel private(i) if (parallel)
+#endif
+{
+	const struct expr_operand *operand;
+	const struct expr_op *op;
+	xm_dim_t ia, ib;
+	xm_scalar_t scalar;
+	void *acc, *buf1, *buf2, **bufs;
+	size_t j, blksize;
+	int *loaded;
+
+	if ((acc = malloc(maxblkbytes)) == NULL)
+		fatal("out of memory");
+	if ((buf1 = malloc(maxblkbytes)) == NULL)
+		fatal("out of memory");
+	if ((buf2 = malloc(maxblkbytes)) == NULL)
+		fatal("out of memory");
+	if ((bufs = calloc(expr->noperands + 1, sizeof *bufs)) == NULL)
+		fatal("out of memory");
+	if ((loaded = calloc(expr->noperands + 1, sizeof *loaded)) == NULL)
+		fatal("out of memory");
+	for (j = 0; j < expr->noperands; j++)
+		if ((bufs[j] = malloc(maxblkbytes)) == NULL)
+			fatal("out of memory");
+	while (xm_work_next(work, &i)) {
+		ia = blklist[i];
+		blksize = xm_tensor_get_block_size(a, ia);
+		if (!expr_op_overwrites(&expr->ops[0]))
+			xm_tensor_read_block(a, ia, acc);
+		for (j = 0; j < expr->noperands; j++)
+			loaded[j] = 0;
+		for (j = 0; j < expr->nops; j++) {
+			op = &expr->ops[j];
+			if (op->type == EXPR_OP_SET) {
+				xm_scalar_set(acc, op->alpha, blksize,
+				    scalartype);
+				continue;
+			}
+			operand = &expr->operands[op->operand];
+			ib = xm_dim_zero(operand->cidxb.n);
+			xm_dim_set_mask(&ib, &operand->cidxb, &ia,
+			    &operand->cidxa);
+			/* each operand block is read at most once */
+			if (!loaded[op->operand]) {
+				loaded[op->operand] = -1;
+				if (xm_tensor_get_block_type(operand->tensor,
+				    ib) != XM_BLOCK_TYPE_ZERO) {
+					xm_tensor_read_block(operand->tensor,
+					    ib, buf1);
+					xm_tensor_unfold_block(operand->tensor,
+					    ib, operand->cidxb, zero, buf1,
+					    buf2, blksize);
+					xm_tensor_fold_block(a, ia,
+					    operand->cidxa, zero, buf2,
+					    bufs[op->operand], blksize);
+					loaded[op->operand] = 1;
+				}
+			}
+			scalar = 0;
+			if (loaded[op->operand] > 0)
+				scalar = xm_tensor_get_block_scalar(
+				    operand->tensor, ib);
+			switch (op->type) {
+			case EXPR_OP_ADD:
+				if (op->alpha == 0)
+					memset(acc, 0, maxblkbytes);
+				scalar = xm_scalar_mul(op->beta, scalar,
+				    scalartype);
+				if (scalar == 0)
+					xm_scalar_scale(acc, op->alpha,
+					    blksize, scalartype);
+				else
+					xm_scalar_axpy(acc, op->alpha,
+					    bufs[op->operand], scalar,
+					    blksize, scalartype);
+				break;
+			case EXPR_OP_MUL:
+				if (loaded[op->operand] < 0)
+					memset(acc, 0, maxblkbytes);
+				else
+					xm_scalar_vec_mul(acc, scalar,
+					    bufs[op->operand], blksize,
+					    scalartype);
+				break;
+			case EXPR_OP_DIV:
+				if (loaded[op->operand] < 0)
+					fatal("division by zero");
+				xm_scalar_vec_div(acc, scalar,
+				    bufs[op->operand], blksize, scalartype);
+				break;
+			default:
+				fatal("unexpected expression op");
+			}
+		}
+		xm_tensor_write_block(a, ia, acc);
+	}
+	for (j = 0; j < expr->noperands; j++)
+		free(bufs[j]);
+	free(bufs);
+	free(loaded);
+	free(acc);
+	free(buf1);
+	free(buf2);
+}
+	xm_work_destroy(work);
+	free(blklist);
+	free(expr->ops);
+	expr->ops = NULL;
+	expr->nops = 0;
+	/* operands are checked again when the expression is reused */
+	for (i = 0; i < expr->noperands; i++)
+		free(expr->operands[i].idx);
+	free(expr->operands);
+	expr->operands = NULL;
+	expr->noperands = 0;
+	xm_tensor_sync_block_norms(a);
+#ifdef XM_USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+}
+
+void
+xm_expr_free(xm_expr_t *expr)
+{
+	size_t i;
+
+	if (expr) {
+		for (i = 0; i < expr->noperands; i++)
+			free(expr->operands[i].idx);
+		free(expr->operands);
+		free(expr->ops);
+		free(expr->idx);
+		free(expr);
+	}
+}
@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2014-2018 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "gemm.h"
+#include "util.h"
+
+/* Panels of op(A) and op(B) padded to the register tile.  A product that
+ * passes xm_small_gemm_fits never needs more elements than this. */
+#define SMALL_PANEL (XM_SMALL_GEMM_VOLUME / 4)
+
+/* The kernels copy op(A) and op(B) into panels padded with zeros to a
+ * multiple of the register tile, so that the inner loop has no transpose
+ * branches and no edge cases.  Each tile of C is then accumulated in local
+ * variables the compiler keeps in registers: 4 x 4 for real types and
+ * 2 x 2 for complex types.  Complex panels hold real and imaginary parts
+ * separately and are multiplied in real arithmetic, which avoids the slow
+ * library calls C uses for complex products.  Only the valid part of the
+ * tile is written back. */
+
+static void
+small_sgemm(char transa, char transb, size_t m, size_t n, size_t k,
+    float alpha, const float *a, size_t lda, const float *b, size_t ldb,
+    float beta, float *c, size_t ldc)
+{
+	float pa[SMALL_PANEL], pb[SMALL_PANEL], t[16];
+	float a0, a1, a2, a3, b0, b1, b2, b3;
+	float c00, c10, c20, c30, c01, c11, c21, c31;
+	float c02, c12, c22, c32, c03, c13, c23, c33;
+	const float *ap, *bp;
+	size_t i, j, p, ii, jj, mr, nr;
+
+	mr = (m + 3) & ~(size_t)3;
+	nr = (n + 3) & ~(size_t)3;
+	for (p = 0; p < k; p++) {
+		if (transa == 'N')
+			for (i = 0; i < m; i++)
+				pa[i + p * mr] = a[i + p * lda];
+		else
+			for (i = 0; i < m; i++)
+				pa[i + p * mr] = a[p + i * lda];
+		for (; i < mr; i++)
+			pa[i + p * mr] = 0;
+		if (transb == 'N')
+			for (j = 0; j < n; j++)
+				pb[j + p * nr] = b[p + j * ldb];
+		else
+			for (j = 0; j < n; j++)
+				pb[j + p * nr] = b[j + p * ldb];
+		for (; j < nr; j++)
+			pb[j + p * nr] = 0;
+	}
+	for (j = 0; j < n; j += 4) {
+		for (i = 0; i < m; i += 4) {
+			c00 = c10 = c20 = c30 = c01 = c11 = c21 = c31 = 0;
+			c02 = c12 = c22 = c32 = c03 = c13 = c23 = c33 = 0;
+			ap = pa + i;
+			bp = pb + j;
+			for (p = 0; p < k; p++, ap += mr, bp += nr) {
+				a0 = ap[0]; a1 = ap[1]; a2 = ap[2]; a3 = ap[3];
+				b0 = bp[0]; b1 = bp[1]; b2 = bp[2]; b3 = bp[3];
+				c00 += a0 * b0; c10 += a1 * b0;
+				c20 += a2 * b0; c30 += a3 * b0;
+				c01 += a0 * b1; c11 += a1 * b1;
+				c21 += a2 * b1; c31 += a3 * b1;
+				c02 += a0 * b2; c12 += a1 * b2;
+				c22 += a2 * b2; c32 += a3 * b2;
+				c03 += a0 * b3; c13 += a1 * b3;
+				c23 += a2 * b3; c33 += a3 * b3;
+			}
+			t[0] = c00; t[1] = c10; t[2] = c20; t[3] = c30;
+			t[4] = c01; t[5] = c11; t[6] = c21; t[7] = c31;
+			t[8] = c02; t[9] = c12; t[10] = c22; t[11] = c32;
+			t[12] = c03; t[13] = c13; t[14] = c23; t[15] = c33;
+			for (jj = 0; jj < 4 && j + jj < n; jj++) {
+				float *cc = c + i + (j + jj) * ldc;
+				const float *tt = t + 4 * jj;
+
+				if (beta == 0)
+					for (ii = 0; ii < 4 && i + ii < m; ii++)
+						cc[ii] = alpha * tt[ii];
+				else
+					for (ii = 0; ii < 4 && i + ii < m; ii++)
+						cc[ii] = beta * cc[ii] +
+						    alpha * tt[ii];
+			}
+		}
+	}
+}
+
+static void
+small_cgemm(char transa, char transb, size_t m, size_t n, size_t k,
+    float complex alpha, const float complex *a, size_t lda,
+    const float complex *b, size_t ldb, float complex beta,
+    float complex *c, size_t ldc)
+{
+	float pra[SMALL_PANEL], pia[SMALL_PANEL];
+	float prb[SMALL_PANEL], pib[SMALL_PANEL];
+	float ar0, ai0, ar1, ai1, br0, bi0, br1, bi1;
+	float r00, i00, r10, i10, r01, i01, r11, i11;
+	float tr[4], ti[4], xr, xi;
+	float complex x;
+	size_t i, j, p, ii, jj, mr, nr, ia, ib;
+
+	mr = (m + 1) & ~(size_t)1;
+	nr = (n + 1) & ~(size_t)1;
+	for (p = 0; p < k; p++) {
+		for (i = 0; i < m; i++) {
+			x = transa == 'N' ? a[i + p * lda] : a[p + i * lda];
+			pra[i + p * mr] = crealf(x);
+			pia[i + p * mr] = cimagf(x);
+		}
+		for (; i < mr; i++)
+			pra[i + p * mr] = pia[i + p * mr] = 0;
+		for (j = 0; j < n; j++) {
+			x = transb == 'N' ? b[p + j * ldb] : b[j + p * ldb];
+			prb[j + p * nr] = crealf(x);
+			pib[j + p * nr] = cimagf(x);
+		}
+		for (; j < nr; j++)
+			prb[j + p * nr] = pib[j + p * nr] = 0;
+	}
+	for (j = 0; j < n; j += 2) {
+		for (i = 0; i < m; i += 2) {
+			r00 = i00 = r10 = i10 = r01 = i01 = r11 = i11 = 0;
+			for (p = 0, ia = i, ib = j; p < k;
+			    p++, ia += mr, ib += nr) {
+				ar0 = pra[ia]; ai0 = pia[ia];
+				ar1 = pra[ia + 1]; ai1 = pia[ia + 1];
+				br0 = prb[ib]; bi0 = pib[ib];
+				br1 = prb[ib + 1]; bi1 = pib[ib + 1];
+				r00 += ar0 * br0 - ai0 * bi0;
+				i00 += ar0 * bi0 + ai0 * br0;
+				r10 += ar1 * br0 - ai1 * bi0;
+				i10 += ar1 * bi0 + ai1 * br0;
+				r01 += ar0 * br1 - ai0 * bi1;
+				i01 += ar0 * bi1 + ai0 * br1;
+				r11 += ar1 * br1 - ai1 * bi1;
+				i11 += ar1 * bi1 + ai1 * br1;
+			}
+			tr[0] = r00; tr[1] = r10; tr[2] = r01; tr[3] = r11;
+			ti[0] = i00; ti[1] = i10; ti[2] = i01; ti[3] = i11;
+			for (jj = 0; jj < 2 && j + jj < n; jj++) {
+				for (ii = 0; ii < 2 && i + ii < m; ii++) {
+					float complex *cc;
+					size_t it = ii + 2 * jj;
+
+					cc = c + i + ii + (j + jj) * ldc;
+					xr = crealf(alpha) * tr[it] -
+					    cimagf(alpha) * ti[it];
+					xi = crealf(alpha) * ti[it] +
+					    cimagf(alpha) * tr[it];
+					if (beta != 0) {
+						x = *cc;
+						xr += crealf(beta) * crealf(x) -
+						    cimagf(beta) * cimagf(x);
+						xi += crealf(beta) * cimagf(x) +
+						    cimagf(beta) * crealf(x);
+					}
+					*cc = xr + xi * I;
+				}
+			}
+		}
+	}
+}
+
+static void
+small_dgemm(char transa, char transb, size_t m, size_t n, size_t k,
+    double alpha, const double *a, size_t lda, const double *b, size_t ldb,
+    double beta, double *c, size_t ldc)
+{
+	double pa[SMALL_PANEL], pb[SMALL_PANEL], t[16];
+	double a0, a1, a2, a3, b0, b1, b2, b3;
+	double c00, c10, c20, c30, c01, c11, c21, c31;
+	double c02, c12, c22, c32, c03, c13, c23, c33;
+	const double *ap, *bp;
+	size_t i, j, p, ii, jj, mr, nr;
+
+	mr = (m + 3) & ~(size_t)3;
+	nr = (n + 3) & ~(size_t)3;
+	for (p = 0; p < k; p++) {
+		if (transa == 'N')
+			for (i = 0; i < m; i++)
+				pa[i + p * mr] = a[i + p * lda];
+		else
+			for (i = 0; i < m; i++)
+				pa[i + p * mr] = a[p + i * lda];
+		for (; i < mr; i++)
+			pa[i + p * mr] = 0;
+		if (transb == 'N')
+			for (j = 0; j < n; j++)
+				pb[j + p * nr] = b[p + j * ldb];
+		else
+			for (j = 0; j < n; j++)
+				pb[j + p * nr] = b[j + p * ldb];
+		for (; j < nr; j++)
+			pb[j + p * nr] = 0;
+	}
+	for (j = 0; j < n; j += 4) {
+		for (i = 0; i < m; i += 4) {
+			c00 = c10 = c20 = c30 = c01 = c11 = c21 = c31 = 0;
+			c02 = c12 = c22 = c32 = c03 = c13 = c23 = c33 = 0;
+			ap = pa + i;
+			bp = pb + j;
+			for (p = 0; p < k; p++, ap += mr, bp += nr) {
+				a0 = ap[0]; a1 = ap[1]; a2 = ap[2]; a3 = ap[3];
+				b0 = bp[0]; b1 = bp[1]; b2 = bp[2]; b3 = bp[3];
+				c00 += a0 * b0; c10 += a1 * b0;
+				c20 += a2 * b0; c30 += a3 * b0;
+				c01 += a0 * b1; c11 += a1 * b1;
+				c21 += a2 * b1; c31 += a3 * b1;
+				c02 += a0 * b2; c12 += a1 * b2;
+				c22 += a2 * b2; c32 += a3 * b2;
+				c03 += a0 * b3; c13 += a1 * b3;
+				c23 += a2 * b3; c33 += a3 * b3;
+			}
+			t[0] = c00; t[1] = c10; t[2] = c20; t[3] = c30;
+			t[4] = c01; t[5] = c11; t[6] = c21; t[7] = c31;
+			t[8] = c02; t[9] = c12; t[10] = c22; t[11] = c32;
+			t[12] = c03; t[13] = c13; t[14] = c23; t[15] = c33;
+			for (jj = 0; jj < 4 && j + jj < n; jj++) {
+				double *cc = c + i + (j + jj) * ldc;
+				const double *tt = t + 4 * jj;
+
+				if (beta == 0)
+					for (ii = 0; ii < 4 && i + ii < m; ii++)
+						cc[ii] = alpha * tt[ii];
+				else
+					for (ii = 0; ii < 4 && i + ii < m; ii++)
+						cc[ii] = beta * cc[ii] +
+						    alpha * tt[ii];
+			}
+		}
+	}
+}
+
+static void
+small_zgemm(char transa, char transb, size_t m, size_t n, size_t k,
+    double complex alpha, const double complex *a, size_t lda,
+    const double complex *b, size_t ldb, double complex beta,
+    double complex *c, size_t ldc)
+{
+	double pra[SMALL_PANEL], pia[SMALL_PANEL];
+	double prb[SMALL_PANEL], pib[SMALL_PANEL];
+	double ar0, ai0, ar1, ai1, br0, bi0, br1, bi1;
+	double r00, i00, r10, i10, r01, i01, r11, i11;
+	double tr[4], ti[4], xr, xi;
+	double complex x;
+	size_t i, j, p, ii, jj, mr, nr, ia, ib;
+
+	mr = (m + 1) & ~(size_t)1;
+	nr = (n + 1) & ~(size_t)1;
+	for (p = 0; p < k; p++) {
+		for (i = 0; i < m; i++) {
+			x = transa == 'N' ? a[i + p * lda] : a[p + i * lda];
+			pra[i + p * mr] = creal(x);
+			pia[i + p * mr] = cimag(x);
+		}
+		for (; i < mr; i++)
+			pra[i + p * mr] = pia[i + p * mr] = 0;
+		for (j = 0; j < n; j++) {
+			x = transb == 'N' ? b[p + j * ldb] : b[j + p * ldb];
+			prb[j + p * nr] = creal(x);
+			pib[j + p * nr] = cimag(x);
+		}
+		for (; j < nr; j++)
+			prb[j + p * nr] = pib[j + p * nr] = 0;
+	}
+	for (j = 0; j < n; j += 2) {
+		for (i = 0; i < m; i += 2) {
+			r00 = i00 = r10 = i10 = r01 = i01 = r11 = i11 = 0;
+			for (p = 0, ia = i, ib = j; p < k;
+			    p++, ia += mr, ib += nr) {
+				ar0 = pra[ia]; ai0 = pia[ia];
+				ar1 = pra[ia + 1]; ai1 = pia[ia + 1];
+				br0 = prb[ib]; bi0 = pib[ib];
+				br1 = prb[ib + 1]; bi1 = pib[ib + 1];
+				r00 += ar0 * br0 - ai0 * bi0;
+				i00 += ar0 * bi0 + ai0 * br0;
+				r10 += ar1 * br0 - ai1 * bi0;
+				i10 += ar1 * bi0 + ai1 * br0;
+				r01 += ar0 * br1 - ai0 * bi1;
+				i01 += ar0 * bi1 + ai0 * br1;
+				r11 += ar1 * br1 - ai1 * bi1;
+				i11 += ar1 * bi1 + ai1 * br1;
+			}
+			tr[0] = r00; tr[1] = r10; tr[2] = r01; tr[3] = r11;
+			ti[0] = i00; ti[1] = i10; ti[2] = i01; ti[3] = i11;
+			for (jj = 0; jj < 2 && j + jj < n; jj++) {
+				for (ii = 0; ii < 2 && i + ii < m; ii++) {
+					double complex *cc;
+					size_t it = ii + 2 * jj;
+
+					cc = c + i + ii + (j + jj) * ldc;
+					xr = creal(alpha) * tr[it] -
+					    cimag(alpha) * ti[it];
+					xi = creal(alpha) * ti[it] +
+					    cimag(alpha) * tr[it];
+					if (beta != 0) {
+						x = *cc;
+						xr += creal(beta) * creal(x) -
+						    cimag(beta) * cimag(x);
+						xi += creal(beta) * cimag(x) +
+						    cimag(beta) * creal(x);
+					}
+					*cc = xr + xi * I;
+				}
+			}
+		}
+	}
+}
+
+int
+xm_small_gemm_fits(size_t m, size_t n, size_t k, xm_scalar_type_t type)
+{
+	size_t mr, nr;
+
+	if (m == 0 || n == 0)
+		return 0;
+	switch (type) {
+	case XM_SCALAR_FLOAT:
+	case XM_SCALAR_DOUBLE:
+		mr = (m + 3) & ~(size_t)3;
+		nr = (n + 3) & ~(size_t)3;
+		return mr * nr * k <= XM_SMALL_GEMM_VOLUME;
+	case XM_SCALAR_FLOAT_COMPLEX:
+	case XM_SCALAR_DOUBLE_COMPLEX:
+		mr = (m + 1) & ~(size_t)1;
+		nr = (n + 1) & ~(size_t)1;
+		return mr * nr * k <= XM_SMALL_GEMM_VOLUME_COMPLEX;
+	}
+	return 0;
+}
+
+void
+xm_small_gemm(char transa, char transb, size_t m, size_t n, size_t k,
+    xm_scalar_t alpha, const void *a, size_t lda, const void *b, size_t ldb,
+    xm_scalar_t beta, void *c, size_t ldc, xm_scalar_type_t type)
+{
+	if (!xm_small_gemm_fits(m, n, k, type))
+		fatal("matrix is too large");
+	switch (type) {
+	case XM_SCALAR_FLOAT:
+		small_sgemm(transa, transb, m, n, k, (float)alpha, a, lda,
+		    b, ldb, (float)beta, c, ldc);
+		return;
+	case XM_SCALAR_FLOAT_COMPLEX:
+		small_cgemm(transa, transb, m, n, k, (float complex)alpha, a,
+		    lda, b, ldb, (float complex)beta, c, ldc);
+		return;
+	case XM_SCALAR_DOUBLE:
+		small_dgemm(transa, transb, m, n, k, (double)alpha, a, lda,
+		    b, ldb, (double)beta, c, ldc);
+		return;
+	case XM_SCALAR_DOUBLE_COMPLEX:
+		small_zgemm(transa, transb, m, n, k, (double complex)alpha, a,
+		    lda, b, ldb, (double complex)beta, c, ldc);
+		return;
+	default:
+		fatal("unexpected scalar type");
+	}
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2014-2018 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef XM_GEMM_H_INCLUDED
+#define XM_GEMM_H_INCLUDED
+
+/* Private header */
+
+#include "scalar.h"
+
+/* Largest product of k and m and n rounded up to the register tile that
+ * is multiplied by the built-in kernels instead of BLAS.  Above this the
+ * call overhead of BLAS no longer dominates.  The tile is 4 x 4 for real
+ * and 2 x 2 for complex types. */
+#define XM_SMALL_GEMM_VOLUME 128
+#define XM_SMALL_GEMM_VOLUME_COMPLEX 16
+
+/* Return non-zero if the m x k by k x n product is small enough for
+ * xm_small_gemm. */
+int xm_small_gemm_fits(size_t m, size_t n, size_t k, xm_scalar_type_t type);
+
+/* Compute C = alpha * op(A) * op(B) + beta * C for small column-major
+ * matrices, where op(X) is X for 'N' and the transpose of X for 'T'.  This
+ * has the same semantics as the BLAS xGEMM routines, including that C is
+ * not read if beta is zero.  The sizes must pass xm_small_gemm_fits. */
+void xm_small_gemm(char transa, char transb, size_t m, size_t n, size_t k,
+    xm_scalar_t alpha, const void *a, size_t lda, const void *b, size_t ldb,
+    xm_scalar_t beta, void *c, size_t ldc, xm_scalar_type_t type);
+
+#endif /* XM_GEMM_H_INCLUDED */
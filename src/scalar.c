@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <math.h>
 #include <string.h>
 
 #include "scalar.h"
@@ -370,6 +371,87 @@ xm_scalar_dot(const void *x, const void *y, size_t len, xm_scalar_type_t type)
 	return 0;
 }
 
+double
+xm_scalar_norm(const void *x, size_t len, xm_scalar_type_t type)
+{
+	size_t i;
+	double norm = 0.0;
+
+	switch (type) {
+	case XM_SCALAR_FLOAT: {
+		const float *xx = x;
+		for (i = 0; i < len; i++)
+			norm += (double)xx[i] * (double)xx[i];
+		break;
+	}
+	case XM_SCALAR_FLOAT_COMPLEX: {
+		const float *xx = x;
+		for (i = 0; i < 2 * len; i++)
+			norm += (double)xx[i] * (double)xx[i];
+		break;
+	}
+	case XM_SCALAR_DOUBLE: {
+		const double *xx = x;
+		for (i = 0; i < len; i++)
+			norm += xx[i] * xx[i];
+		break;
+	}
+	case XM_SCALAR_DOUBLE_COMPLEX: {
+		const double *xx = x;
+		for (i = 0; i < 2 * len; i++)
+			norm += xx[i] * xx[i];
+		break;
+	}
+	default:
+		fatal("unexpected scalar type");
+	}
+	return sqrt(norm);
+}
+
+void
+xm_scalar_clip(void *x, double limit, size_t len, xm_scalar_type_t type)
+{
+	size_t i;
+
+	switch (type) {
+	case XM_SCALAR_FLOAT: {
+		float *xx = x;
+		for (i = 0; i < len; i++) {
+			if (xx[i] > limit)
+				xx[i] = limit;
+			else if (xx[i] < -limit)
+				xx[i] = -limit;
+		}
+		return;
+	}
+	case XM_SCALAR_FLOAT_COMPLEX: {
+		float complex *xx = x;
+		for (i = 0; i < len; i++)
+			if (cabsf(xx[i]) > limit)
+				xx[i] *= limit / cabsf(xx[i]);
+		return;
+	}
+	case XM_SCALAR_DOUBLE: {
+		double *xx = x;
+		for (i = 0; i < len; i++) {
+			if (xx[i] > limit)
+				xx[i] = limit;
+			else if (xx[i] < -limit)
+				xx[i] = -limit;
+		}
+		return;
+	}
+	case XM_SCALAR_DOUBLE_COMPLEX: {
+		double complex *xx = x;
+		for (i = 0; i < len; i++)
+			if (cabs(xx[i]) > limit)
+				xx[i] *= limit / cabs(xx[i]);
+		return;
+	}
+	}
+	fatal("unexpected scalar type");
+}
+
 void
 xm_scalar_convert(void *x, const void *y, size_t len, xm_scalar_type_t xtype,
     xm_scalar_type_t ytype)
@@ -134,6 +134,21 @@ void xm_scalar_vec_div(void *x, xm_scalar_t a, const void *y, size_t len,
 xm_scalar_t xm_scalar_dot(const void *x, const void *y, size_t len,
     xm_scalar_type_t type);
 
+/** Compute Frobenius norm of a vector.
+ *  \param x Data vector.
+ *  \param len Length of vector \p x in number of elements.
+ *  \param type Scalar type.
+ *  \return Square root of the sum of squared absolute values of elements. */
+double xm_scalar_norm(const void *x, size_t len, xm_scalar_type_t type);
+
+/** Limit the absolute value of vector elements. Elements with absolute value
+ *  above the limit are scaled down to it, keeping their sign or phase.
+ *  \param x Data vector.
+ *  \param limit Largest allowed absolute value.
+ *  \param len Length of vector \p x in number of elements.
+ *  \param type Scalar type. */
+void xm_scalar_clip(void *x, double limit, size_t len, xm_scalar_type_t type);
+
 /** Convert data from one scalar type to another.
  *  \param x Destination vector.
  *  \param y Source vector.
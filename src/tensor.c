@@ -15,20 +15,68 @@
  */
 
 #include <assert.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef XM_USE_MPI
+#include <mpi.h>
+#endif
+
+#include "cache.h"
 #include "tensor.h"
 #include "util.h"
 
+/* Number of hash buckets in the fold/unfold plan cache. */
+#define XM_PLAN_BUCKETS 64
+
+/* Maximum number of plans cached per tensor. */
+#define XM_PLAN_MAX 4096
+
+/* Precompiled fold/unfold plan. Block elements are visited by two mixed-radix
+ * counters along the row (i) and column (j) dimensions of the matrix form with
+ * the stride of each counter digit in the raw block data precomputed. */
+struct xm_plan {
+	xm_dim_t blkdims, permutation, mask_i, mask_j;
+	size_t block_size_i, block_size_j, lead_ii_nel, inc;
+	size_t ni, dims_i[XM_MAX_DIM], strides_i[XM_MAX_DIM];
+	size_t nj, dims_j[XM_MAX_DIM], strides_j[XM_MAX_DIM];
+	struct xm_plan *next;
+};
+
+/* Plans are never changed or removed once inserted, so lookups walk the
+ * buckets without the lock.  The lock only serializes insertions. */
+struct xm_plan_cache {
+	struct xm_plan *buckets[XM_PLAN_BUCKETS];
+	size_t nplans;
+#ifdef _OPENMP
+	omp_lock_t mutex;
+#endif
+};
+
 struct xm_block {
 	xm_block_type_t type;
 	xm_dim_t permutation;
 	xm_scalar_t scalar;
 	uint64_t data_ptr; /* for derivative blocks stores offset of the
 			      corresponding canonical block */
+	double norm; /* Frobenius norm of canonical block data or HUGE_VAL if
+			the block was never written */
+	int norm_dirty; /* norm changed since last MPI synchronization */
+};
+
+/* Block data of generated tensors is computed by a user function.  Canonical
+ * blocks store their own offset in the blocks array as the data pointer. */
+struct xm_generator {
+	xm_block_generator_t fn;
+	void *data;
+	xm_cache_t *cache; /* recently generated blocks; NULL if disabled */
 };
 
 struct xm_tensor {
@@ -36,18 +84,50 @@ struct xm_tensor {
 	xm_block_space_t *bs;
 	xm_allocator_t *allocator;
 	struct xm_block *blocks;
+	xm_dim_t blkstore; /* dimensions of the blocks array */
+	xm_dim_t blkoff; /* position of the first block in the blocks array */
+	int is_view; /* blocks array is owned by another tensor */
+	struct xm_plan_cache *plans;
+	struct xm_generator *gen; /* NULL if block data is stored */
 };
 
-static struct xm_block *
-tensor_get_block(const xm_tensor_t *tensor, xm_dim_t blkidx)
+static size_t
+tensor_block_offset(const xm_tensor_t *tensor, xm_dim_t blkidx)
 {
 	xm_dim_t nblocks;
-	size_t offset;
+	size_t i;
 
 	nblocks = xm_tensor_get_nblocks(tensor);
-	offset = xm_dim_offset(&blkidx, &nblocks);
+	assert(xm_dim_less(&blkidx, &nblocks));
+	for (i = 0; i < blkidx.n; i++)
+		blkidx.i[i] += tensor->blkoff.i[i];
+	return xm_dim_offset(&blkidx, &tensor->blkstore);
+}
 
-	return (&tensor->blocks[offset]);
+static struct xm_block *
+tensor_get_block(const xm_tensor_t *tensor, xm_dim_t blkidx)
+{
+	return (&tensor->blocks[tensor_block_offset(tensor, blkidx)]);
+}
+
+static xm_tensor_t *
+tensor_alloc(const xm_block_space_t *bs, xm_scalar_type_t type,
+    xm_allocator_t *allocator)
+{
+	xm_tensor_t *ret;
+
+	if ((ret = calloc(1, sizeof *ret)) == NULL)
+		fatal("out of memory");
+	if ((ret->bs = xm_block_space_clone(bs)) == NULL)
+		fatal("out of memory");
+	if ((ret->plans = calloc(1, sizeof *ret->plans)) == NULL)
+		fatal("out of memory");
+#ifdef _OPENMP
+	omp_init_lock(&ret->plans->mutex);
+#endif
+	ret->type = type;
+	ret->allocator = allocator;
+	return ret;
 }
 
 xm_tensor_t *
@@ -62,16 +142,13 @@ xm_tensor_create(const xm_block_space_t *bs, xm_scalar_type_t type,
 
 	if (!xm_scalar_check_type(type))
 		fatal("unexpected scalar type");
-	if ((ret = calloc(1, sizeof *ret)) == NULL)
-		fatal("out of memory");
-	if ((ret->bs = xm_block_space_clone(bs)) == NULL)
-		fatal("out of memory");
-	ret->type = type;
-	ret->allocator = allocator;
+	ret = tensor_alloc(bs, type, allocator);
 	nblocks = xm_block_space_get_nblocks(bs);
 	if ((ret->blocks = calloc(xm_dim_dot(&nblocks),
 	    sizeof *ret->blocks)) == NULL)
 		fatal("out of memory");
+	ret->blkstore = nblocks;
+	ret->blkoff = xm_dim_zero(nblocks.n);
 	idx = xm_dim_zero(nblocks.n);
 	while (xm_dim_ne(&idx, &nblocks)) {
 		xm_tensor_set_zero_block(ret, idx);
@@ -97,12 +174,33 @@ xm_tensor_create_canonical(const xm_block_space_t *bs, xm_scalar_type_t type,
 	return ret;
 }
 
+xm_tensor_t *
+xm_tensor_create_generated(const xm_block_space_t *bs, xm_scalar_type_t type,
+    xm_allocator_t *allocator, xm_block_generator_t fn, void *data,
+    size_t cachebytes)
+{
+	xm_tensor_t *ret;
+
+	assert(fn);
+
+	ret = xm_tensor_create(bs, type, allocator);
+	if ((ret->gen = calloc(1, sizeof *ret->gen)) == NULL)
+		fatal("out of memory");
+	ret->gen->fn = fn;
+	ret->gen->data = data;
+	if (cachebytes > 0)
+		ret->gen->cache = xm_cache_create(cachebytes);
+	return ret;
+}
+
 xm_tensor_t *
 xm_tensor_create_structure(const xm_tensor_t *tensor, xm_scalar_type_t type,
     xm_allocator_t *allocator)
 {
+	struct xm_block *block;
 	xm_tensor_t *ret;
-	xm_dim_t idx, nblocks;
+	xm_dim_t idx, nblocks, source;
+	size_t i;
 
 	if (allocator == NULL)
 		allocator = xm_tensor_get_allocator(tensor);
@@ -110,17 +208,59 @@ xm_tensor_create_structure(const xm_tensor_t *tensor, xm_scalar_type_t type,
 	nblocks = xm_tensor_get_nblocks(ret);
 	idx = xm_dim_zero(nblocks.n);
 	while (xm_dim_ne(&idx, &nblocks)) {
-		size_t i = xm_dim_offset(&idx, &nblocks);
-		ret->blocks[i] = tensor->blocks[i];
-		if (ret->blocks[i].type == XM_BLOCK_TYPE_CANONICAL) {
-			ret->blocks[i].type = XM_BLOCK_TYPE_ZERO;
+		if (tensor_get_block(tensor, idx)->type ==
+		    XM_BLOCK_TYPE_CANONICAL)
 			xm_tensor_set_canonical_block(ret, idx);
+		xm_dim_inc(&idx, &nblocks);
+	}
+	idx = xm_dim_zero(nblocks.n);
+	while (xm_dim_ne(&idx, &nblocks)) {
+		block = tensor_get_block(tensor, idx);
+		if (block->type == XM_BLOCK_TYPE_DERIVATIVE) {
+			/* source blocks outside of a view become canonical */
+			source = xm_dim_from_offset(block->data_ptr,
+			    &tensor->blkstore);
+			for (i = 0; i < source.n; i++)
+				source.i[i] -= tensor->blkoff.i[i];
+			if (xm_dim_less(&source, &nblocks))
+				xm_tensor_set_derivative_block(ret, idx, source,
+				    block->permutation, block->scalar);
+			else
+				xm_tensor_set_canonical_block(ret, idx);
 		}
 		xm_dim_inc(&idx, &nblocks);
 	}
 	return ret;
 }
 
+xm_tensor_t *
+xm_tensor_view(xm_tensor_t *tensor, xm_dim_t blk_lo, xm_dim_t blk_hi)
+{
+	xm_block_space_t *bs;
+	xm_tensor_t *ret;
+	xm_dim_t nblocks;
+	size_t i;
+
+	nblocks = xm_tensor_get_nblocks(tensor);
+	if (blk_lo.n != nblocks.n || blk_hi.n != nblocks.n)
+		fatal("invalid block range");
+	for (i = 0; i < nblocks.n; i++)
+		if (blk_lo.i[i] >= blk_hi.i[i] || blk_hi.i[i] > nblocks.i[i])
+			fatal("invalid block range");
+	if ((bs = xm_block_space_slice(tensor->bs, blk_lo, blk_hi)) == NULL)
+		fatal("out of memory");
+	ret = tensor_alloc(bs, tensor->type, tensor->allocator);
+	xm_block_space_free(bs);
+	ret->blocks = tensor->blocks;
+	ret->blkstore = tensor->blkstore;
+	ret->blkoff = tensor->blkoff;
+	for (i = 0; i < nblocks.n; i++)
+		ret->blkoff.i[i] += blk_lo.i[i];
+	ret->is_view = 1;
+	ret->gen = tensor->gen;
+	return ret;
+}
+
 const xm_block_space_t *
 xm_tensor_get_block_space(const xm_tensor_t *tensor)
 {
@@ -240,6 +380,20 @@ xm_tensor_get_block_scalar(const xm_tensor_t *tensor, xm_dim_t blkidx)
 	return tensor_get_block(tensor, blkidx)->scalar;
 }
 
+double
+xm_tensor_get_block_norm(const xm_tensor_t *tensor, xm_dim_t blkidx)
+{
+	struct xm_block *block;
+
+	block = tensor_get_block(tensor, blkidx);
+	if (block->type == XM_BLOCK_TYPE_CANONICAL)
+		return block->norm;
+	if (block->type == XM_BLOCK_TYPE_DERIVATIVE)
+		return cabs(block->scalar) *
+		    tensor->blocks[block->data_ptr].norm;
+	return 0;
+}
+
 void
 xm_tensor_set_zero_block(xm_tensor_t *tensor, xm_dim_t blkidx)
 {
@@ -250,6 +404,8 @@ xm_tensor_set_zero_block(xm_tensor_t *tensor, xm_dim_t blkidx)
 	block->permutation = xm_dim_identity_permutation(blkidx.n);
 	block->scalar = 0;
 	block->data_ptr = XM_NULL_PTR;
+	block->norm = 0;
+	block->norm_dirty = 0;
 }
 
 void
@@ -260,6 +416,11 @@ xm_tensor_set_canonical_block(xm_tensor_t *tensor, xm_dim_t blkidx)
 
 	if (xm_tensor_get_block_type(tensor, blkidx) != XM_BLOCK_TYPE_ZERO)
 		fatal("block must be zero");
+	if (tensor->gen) {
+		xm_tensor_set_canonical_block_raw(tensor, blkidx,
+		    tensor_block_offset(tensor, blkidx));
+		return;
+	}
 	blkbytes = xm_tensor_get_block_bytes(tensor, blkidx);
 	data_ptr = xm_allocator_allocate(tensor->allocator, blkbytes);
 	if (data_ptr == XM_NULL_PTR)
@@ -282,6 +443,8 @@ xm_tensor_set_canonical_block_raw(xm_tensor_t *tensor, xm_dim_t blkidx,
 	block->permutation = xm_dim_identity_permutation(blkidx.n);
 	block->scalar = 1;
 	block->data_ptr = data_ptr;
+	block->norm = HUGE_VAL;
+	block->norm_dirty = 0;
 }
 
 void
@@ -289,7 +452,7 @@ xm_tensor_set_derivative_block(xm_tensor_t *tensor, xm_dim_t blkidx,
     xm_dim_t source_blkidx, xm_dim_t permutation, xm_scalar_t scalar)
 {
 	struct xm_block *block;
-	xm_dim_t blkdims1, blkdims2, nblocks;
+	xm_dim_t blkdims1, blkdims2;
 	xm_block_type_t blocktype;
 
 	if (xm_tensor_get_block_type(tensor, blkidx) != XM_BLOCK_TYPE_ZERO)
@@ -302,12 +465,13 @@ xm_tensor_set_derivative_block(xm_tensor_t *tensor, xm_dim_t blkidx,
 	blkdims2 = xm_block_space_get_block_dims(tensor->bs, source_blkidx);
 	if (xm_dim_ne(&blkdims1, &blkdims2))
 		fatal("invalid block permutation");
-	nblocks = xm_tensor_get_nblocks(tensor);
 	block = tensor_get_block(tensor, blkidx);
 	block->type = XM_BLOCK_TYPE_DERIVATIVE;
 	block->permutation = permutation;
 	block->scalar = scalar;
-	block->data_ptr = xm_dim_offset(&source_blkidx, &nblocks);
+	block->data_ptr = tensor_block_offset(tensor, source_blkidx);
+	block->norm = 0;
+	block->norm_dirty = 0;
 }
 
 void
@@ -335,6 +499,31 @@ xm_tensor_get_canonical_block_list(const xm_tensor_t *tensor,
 	*nblklist = nlist;
 }
 
+static void
+generate_block(const xm_tensor_t *tensor, uint64_t data_ptr, void *buf,
+    size_t blkbytes)
+{
+	struct xm_generator *gen = tensor->gen;
+	xm_dim_t idx;
+	void *data = NULL;
+	int fill;
+
+	idx = xm_dim_from_offset(data_ptr, &tensor->blkstore);
+	if (gen->cache)
+		data = xm_cache_get(gen->cache, &data_ptr, sizeof data_ptr,
+		    blkbytes, &fill);
+	if (data == NULL) {
+		gen->fn(idx, buf, gen->data);
+		return;
+	}
+	if (fill) {
+		gen->fn(idx, data, gen->data);
+		xm_cache_done(gen->cache, data);
+	}
+	memcpy(buf, data, blkbytes);
+	xm_cache_release(gen->cache, data);
+}
+
 void
 xm_tensor_read_block(const xm_tensor_t *tensor, xm_dim_t blkidx, void *buf)
 {
@@ -347,27 +536,309 @@ xm_tensor_read_block(const xm_tensor_t *tensor, xm_dim_t blkidx, void *buf)
 		fatal("cannot read data from zero-blocks");
 	blkbytes = xm_tensor_get_block_bytes(tensor, blkidx);
 	data_ptr = xm_tensor_get_block_data_ptr(tensor, blkidx);
-	xm_allocator_read(tensor->allocator, data_ptr, buf, blkbytes);
+	if (tensor->gen)
+		generate_block(tensor, data_ptr, buf, blkbytes);
+	else
+		xm_allocator_read(tensor->allocator, data_ptr, buf, blkbytes);
+}
+
+void
+xm_tensor_prefetch_block(const xm_tensor_t *tensor, xm_dim_t blkidx)
+{
+	uint64_t data_ptr;
+
+	if (tensor->gen)
+		return;
+	data_ptr = xm_tensor_get_block_data_ptr(tensor, blkidx);
+	if (data_ptr == XM_NULL_PTR)
+		return;
+	xm_allocator_prefetch(tensor->allocator, data_ptr,
+	    xm_tensor_get_block_bytes(tensor, blkidx));
 }
 
 void
 xm_tensor_write_block(xm_tensor_t *tensor, xm_dim_t blkidx, const void *buf)
 {
-	size_t blkbytes;
+	struct xm_block *block;
+	size_t blksize, blkbytes;
 	uint64_t data_ptr;
 	xm_block_type_t blocktype;
 
+	if (tensor->gen)
+		fatal("cannot write to a generated tensor");
 	blocktype = xm_tensor_get_block_type(tensor, blkidx);
 	if (blocktype != XM_BLOCK_TYPE_CANONICAL)
 		fatal("can only write to canonical blocks");
+	blksize = xm_tensor_get_block_size(tensor, blkidx);
 	blkbytes = xm_tensor_get_block_bytes(tensor, blkidx);
 	data_ptr = xm_tensor_get_block_data_ptr(tensor, blkidx);
 	xm_allocator_write(tensor->allocator, data_ptr, buf, blkbytes);
+	block = tensor_get_block(tensor, blkidx);
+	block->norm = xm_scalar_norm(buf, blksize, tensor->type);
+	block->norm_dirty = 1;
+}
+
+void
+xm_tensor_sync_block_norms(xm_tensor_t *tensor)
+{
+#ifdef XM_USE_MPI
+	size_t i, nblk;
+	double *norms;
+
+	nblk = xm_dim_dot(&tensor->blkstore);
+	if ((norms = malloc(nblk * sizeof *norms)) == NULL)
+		fatal("out of memory");
+	for (i = 0; i < nblk; i++) {
+		struct xm_block *block = &tensor->blocks[i];
+		norms[i] = block->norm_dirty ? block->norm : -1.0;
+	}
+	MPI_Allreduce(MPI_IN_PLACE, norms, (int)nblk, MPI_DOUBLE, MPI_MAX,
+	    MPI_COMM_WORLD);
+	for (i = 0; i < nblk; i++) {
+		struct xm_block *block = &tensor->blocks[i];
+		if (norms[i] >= 0.0 &&
+		    block->type == XM_BLOCK_TYPE_CANONICAL)
+			block->norm = norms[i];
+		block->norm_dirty = 0;
+	}
+	free(norms);
+#else
+	(void)tensor;
+#endif
+}
+
+static void
+plan_compile(struct xm_plan *plan, xm_dim_t blkdims, xm_dim_t permutation,
+    xm_dim_t mask_i, xm_dim_t mask_j)
+{
+	xm_dim_t blkdimsp;
+	size_t i, kk, strides[XM_MAX_DIM];
+
+	plan->blkdims = blkdims;
+	plan->permutation = permutation;
+	plan->mask_i = mask_i;
+	plan->mask_j = mask_j;
+	plan->block_size_i = xm_dim_dot_mask(&blkdims, &mask_i);
+	plan->block_size_j = xm_dim_dot_mask(&blkdims, &mask_j);
+	plan->next = NULL;
+
+	/* stride of each block dimension in the raw (permuted) block data */
+	blkdimsp = xm_dim_permute(&blkdims, &permutation);
+	for (i = 0; i < blkdims.n; i++) {
+		strides[i] = 1;
+		for (kk = 0; kk < permutation.i[i]; kk++)
+			strides[i] *= blkdimsp.i[kk];
+	}
+	plan->inc = 1;
+	plan->lead_ii_nel = 1;
+	plan->ni = 0;
+	plan->nj = 0;
+	for (i = 0; i < mask_i.n; i++) {
+		size_t dim = mask_i.i[i];
+		if (i == 0) {
+			plan->inc = strides[dim];
+			plan->lead_ii_nel = blkdims.i[dim];
+		} else if (blkdims.i[dim] > 1) {
+			plan->dims_i[plan->ni] = blkdims.i[dim];
+			plan->strides_i[plan->ni] = strides[dim];
+			plan->ni++;
+		}
+	}
+	for (i = 0; i < mask_j.n; i++) {
+		size_t dim = mask_j.i[i];
+		if (blkdims.i[dim] > 1) {
+			plan->dims_j[plan->nj] = blkdims.i[dim];
+			plan->strides_j[plan->nj] = strides[dim];
+			plan->nj++;
+		}
+	}
+}
+
+static int
+plan_matches(const struct xm_plan *plan, const xm_dim_t *blkdims,
+    const xm_dim_t *permutation, const xm_dim_t *mask_i,
+    const xm_dim_t *mask_j)
+{
+	return (xm_dim_eq(&plan->blkdims, blkdims) &&
+		xm_dim_eq(&plan->permutation, permutation) &&
+		xm_dim_eq(&plan->mask_i, mask_i) &&
+		xm_dim_eq(&plan->mask_j, mask_j));
+}
+
+static size_t
+plan_hash(const xm_dim_t *blkdims, const xm_dim_t *permutation,
+    const xm_dim_t *mask_i, const xm_dim_t *mask_j)
+{
+	size_t i, hash = 5381;
+
+	for (i = 0; i < blkdims->n; i++)
+		hash = hash * 33 + blkdims->i[i];
+	for (i = 0; i < permutation->n; i++)
+		hash = hash * 33 + permutation->i[i];
+	for (i = 0; i < mask_i->n; i++)
+		hash = hash * 33 + mask_i->i[i];
+	hash = hash * 33 + mask_i->n;
+	for (i = 0; i < mask_j->n; i++)
+		hash = hash * 33 + mask_j->i[i];
+	return hash % XM_PLAN_BUCKETS;
+}
+
+/* Return the cached plan with the given parameters or NULL. */
+static struct xm_plan *
+plan_find(struct xm_plan_cache *cache, size_t bucket, const xm_dim_t *blkdims,
+    const xm_dim_t *permutation, const xm_dim_t *mask_i,
+    const xm_dim_t *mask_j)
+{
+	struct xm_plan *plan;
+
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+	plan = cache->buckets[bucket];
+#ifdef _OPENMP
+#pragma omp flush
+#endif
+	for (; plan; plan = plan->next)
+		if (plan_matches(plan, blkdims, permutation, mask_i, mask_j))
+			break;
+	return plan;
+}
+
+/* Find plan in the tensor's plan cache compiling it if necessary. If the
+ * cache is full the plan is compiled into the storage provided by caller. */
+static const struct xm_plan *
+plan_get(const xm_tensor_t *tensor, xm_dim_t blkdims, xm_dim_t permutation,
+    xm_dim_t mask_i, xm_dim_t mask_j, struct xm_plan *storage)
+{
+	struct xm_plan_cache *cache = tensor->plans;
+	struct xm_plan *plan;
+	size_t bucket;
+
+	bucket = plan_hash(&blkdims, &permutation, &mask_i, &mask_j);
+	plan = plan_find(cache, bucket, &blkdims, &permutation, &mask_i,
+	    &mask_j);
+	if (plan)
+		return plan;
+#ifdef _OPENMP
+	omp_set_lock(&cache->mutex);
+#endif
+	/* another thread may have inserted the plan in the meantime */
+	plan = plan_find(cache, bucket, &blkdims, &permutation, &mask_i,
+	    &mask_j);
+	if (plan == NULL && cache->nplans < XM_PLAN_MAX) {
+		if ((plan = malloc(sizeof *plan)) == NULL)
+			fatal("out of memory");
+		plan_compile(plan, blkdims, permutation, mask_i, mask_j);
+		plan->next = cache->buckets[bucket];
+		/* the plan is complete before other threads can see it */
+#ifdef _OPENMP
+#pragma omp flush
+#pragma omp atomic write
+#endif
+		cache->buckets[bucket] = plan;
+		cache->nplans++;
+	}
+#ifdef _OPENMP
+	omp_unset_lock(&cache->mutex);
+#endif
+	if (plan == NULL) {
+		plan_compile(storage, blkdims, permutation, mask_i, mask_j);
+		plan = storage;
+	}
+	return plan;
+}
+
+static void
+plan_free(struct xm_plan_cache *cache)
+{
+	struct xm_plan *plan, *next;
+	size_t i;
+
+	for (i = 0; i < XM_PLAN_BUCKETS; i++) {
+		for (plan = cache->buckets[i]; plan; plan = next) {
+			next = plan->next;
+			free(plan);
+		}
+	}
+#ifdef _OPENMP
+	omp_destroy_lock(&cache->mutex);
+#endif
+	free(cache);
+}
+
+/* Advance a mixed-radix counter updating the corresponding data offset. */
+static inline void
+plan_inc(size_t *cnt, size_t *offset, size_t n, const size_t *dims,
+    const size_t *strides)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		*offset += strides[i];
+		if (++cnt[i] < dims[i])
+			return;
+		*offset -= strides[i] * dims[i];
+		cnt[i] = 0;
+	}
 }
 
 typedef void (*kernel_fn_t)(void *, const void *, size_t, size_t, size_t,
     size_t, size_t, size_t);
 
+static void
+plan_execute(const struct xm_plan *plan, kernel_fn_t kernel_fn,
+    const void *from, void *to, size_t stride, size_t size, size_t jj0,
+    size_t jj1)
+{
+	size_t d, ii, jj, rem, offset_i, offset_j;
+	size_t cnt_i[XM_MAX_DIM] = { 0 }, cnt_j[XM_MAX_DIM] = { 0 };
+
+	offset_j = 0;
+	for (d = 0, rem = jj0; d < plan->nj; d++) {
+		cnt_j[d] = rem % plan->dims_j[d];
+		rem /= plan->dims_j[d];
+		offset_j += cnt_j[d] * plan->strides_j[d];
+	}
+	for (jj = jj0; jj < jj1; jj++) {
+		offset_i = 0;
+		for (ii = 0; ii < plan->block_size_i; ii += plan->lead_ii_nel) {
+			kernel_fn(to, from, ii, jj, offset_j + offset_i,
+			    stride, size, plan->lead_ii_nel);
+			plan_inc(cnt_i, &offset_i, plan->ni, plan->dims_i,
+			    plan->strides_i);
+		}
+		plan_inc(cnt_j, &offset_j, plan->nj, plan->dims_j,
+		    plan->strides_j);
+	}
+}
+
+/* Large blocks are split along the column dimension between threads unless
+ * we are already inside of an active parallel region. */
+static void
+plan_run(const struct xm_plan *plan, kernel_fn_t kernel_fn,
+    const void *from, void *to, size_t stride, size_t size)
+{
+#ifdef _OPENMP
+	size_t nel = plan->block_size_i * plan->block_size_j;
+
+	if (nel >= XM_PARALLEL_BLOCK_SIZE && plan->block_size_j > 1 &&
+	    !omp_in_parallel()) {
+#pragma omp parallel
+{
+		size_t nthreads = (size_t)omp_get_num_threads();
+		size_t tid = (size_t)omp_get_thread_num();
+		size_t nj = plan->block_size_j;
+
+		plan_execute(plan, kernel_fn, from, to, stride, size,
+		    tid * nj / nthreads, (tid + 1) * nj / nthreads);
+}
+		return;
+	}
+#endif
+	plan_execute(plan, kernel_fn, from, to, stride, size, 0,
+	    plan->block_size_j);
+}
+
 static void
 fold_kernel_memcpy(void *to, const void *from, size_t i, size_t j,
     size_t offset, size_t stride, size_t size, size_t lead_ii_nel)
@@ -438,10 +909,11 @@ xm_tensor_fold_block(const xm_tensor_t *tensor, xm_dim_t blkidx,
     xm_dim_t mask_i, xm_dim_t mask_j, const void *from, void *to,
     size_t stride)
 {
+	struct xm_plan storage;
+	const struct xm_plan *plan;
 	kernel_fn_t kernel_fn;
-	xm_dim_t blkdims, elidx;
-	size_t ii, jj, kk, offset, inc, lead_ii, lead_ii_nel;
-	size_t block_size_i, block_size_j, size;
+	xm_dim_t blkdims;
+	size_t size;
 	xm_block_type_t blocktype;
 
 	if (from == NULL || to == NULL || from == to)
@@ -454,27 +926,13 @@ xm_tensor_fold_block(const xm_tensor_t *tensor, xm_dim_t blkidx,
 		fatal("can only fold canonical blocks");
 
 	blkdims = xm_tensor_get_block_dims(tensor, blkidx);
-	block_size_i = xm_dim_dot_mask(&blkdims, &mask_i);
-	block_size_j = xm_dim_dot_mask(&blkdims, &mask_j);
-	elidx = xm_dim_zero(blkdims.n);
-
-	inc = 1;
-	lead_ii_nel = 1;
-
-	if (mask_i.n > 0) {
-		lead_ii = mask_i.i[0];
-		for (kk = 0; kk < lead_ii; kk++)
-			inc *= blkdims.i[kk];
-		for (ii = 0; ii < mask_i.n-1; ii++)
-			mask_i.i[ii] = mask_i.i[ii+1];
-		mask_i.n--;
-		lead_ii_nel = blkdims.i[lead_ii];
-	}
-	if (inc == 1) {
+	plan = plan_get(tensor, blkdims, xm_dim_identity_permutation(blkdims.n),
+	    mask_i, mask_j, &storage);
+	if (plan->inc == 1) {
 		size = xm_scalar_sizeof(tensor->type);
 		kernel_fn = fold_kernel_memcpy;
 	} else {
-		size = inc;
+		size = plan->inc;
 		switch (tensor->type) {
 		case XM_SCALAR_FLOAT:
 			kernel_fn = fold_kernel_float;
@@ -492,16 +950,7 @@ xm_tensor_fold_block(const xm_tensor_t *tensor, xm_dim_t blkidx,
 			fatal("unexpected scalar type");
 		}
 	}
-	for (jj = 0; jj < block_size_j; jj++) {
-		xm_dim_zero_mask(&elidx, &mask_i);
-		for (ii = 0; ii < block_size_i; ii += lead_ii_nel) {
-			offset = xm_dim_offset(&elidx, &blkdims);
-			kernel_fn(to, from, ii, jj, offset, stride, size,
-			    lead_ii_nel);
-			xm_dim_inc_mask(&elidx, &blkdims, &mask_i);
-		}
-		xm_dim_inc_mask(&elidx, &blkdims, &mask_j);
-	}
+	plan_run(plan, kernel_fn, from, to, stride, size);
 }
 
 static void
@@ -574,10 +1023,11 @@ xm_tensor_unfold_block(const xm_tensor_t *tensor, xm_dim_t blkidx,
     xm_dim_t mask_i, xm_dim_t mask_j, const void *from, void *to,
     size_t stride)
 {
+	struct xm_plan storage;
+	const struct xm_plan *plan;
 	kernel_fn_t kernel_fn;
-	xm_dim_t blkdims, blkdimsp, elidx, idx, permutation;
-	size_t ii, jj, kk, offset, inc, lead_ii, lead_ii_nel;
-	size_t block_size_i, block_size_j, size;
+	xm_dim_t blkdims, permutation;
+	size_t size;
 
 	if (from == NULL || to == NULL || from == to)
 		fatal("invalid argument");
@@ -585,29 +1035,14 @@ xm_tensor_unfold_block(const xm_tensor_t *tensor, xm_dim_t blkidx,
 		fatal("invalid mask dimensions");
 
 	blkdims = xm_tensor_get_block_dims(tensor, blkidx);
-	block_size_i = xm_dim_dot_mask(&blkdims, &mask_i);
-	block_size_j = xm_dim_dot_mask(&blkdims, &mask_j);
 	permutation = xm_tensor_get_block_permutation(tensor, blkidx);
-	blkdimsp = xm_dim_permute(&blkdims, &permutation);
-	elidx = xm_dim_zero(blkdims.n);
-
-	inc = 1;
-	lead_ii_nel = 1;
-
-	if (mask_i.n > 0) {
-		lead_ii = mask_i.i[0];
-		for (kk = 0; kk < permutation.i[lead_ii]; kk++)
-			inc *= blkdimsp.i[kk];
-		for (ii = 0; ii < mask_i.n-1; ii++)
-			mask_i.i[ii] = mask_i.i[ii+1];
-		mask_i.n--;
-		lead_ii_nel = blkdims.i[lead_ii];
-	}
-	if (inc == 1) {
+	plan = plan_get(tensor, blkdims, permutation, mask_i, mask_j,
+	    &storage);
+	if (plan->inc == 1) {
 		size = xm_scalar_sizeof(tensor->type);
 		kernel_fn = unfold_kernel_memcpy;
 	} else {
-		size = inc;
+		size = plan->inc;
 		switch (tensor->type) {
 		case XM_SCALAR_FLOAT:
 			kernel_fn = unfold_kernel_float;
@@ -625,17 +1060,49 @@ xm_tensor_unfold_block(const xm_tensor_t *tensor, xm_dim_t blkidx,
 			fatal("unexpected scalar type");
 		}
 	}
-	for (jj = 0; jj < block_size_j; jj++) {
-		xm_dim_zero_mask(&elidx, &mask_i);
-		for (ii = 0; ii < block_size_i; ii += lead_ii_nel) {
-			idx = xm_dim_permute(&elidx, &permutation);
-			offset = xm_dim_offset(&idx, &blkdimsp);
-			kernel_fn(to, from, ii, jj, offset, stride, size,
-			    lead_ii_nel);
-			xm_dim_inc_mask(&elidx, &blkdims, &mask_i);
+	plan_run(plan, kernel_fn, from, to, stride, size);
+}
+
+size_t
+xm_tensor_prune_blocks(xm_tensor_t *tensor, double threshold)
+{
+	xm_dim_t nblocks;
+	size_t i, nblk, npruned = 0;
+	unsigned char *prune;
+
+	if (tensor->is_view)
+		fatal("cannot prune blocks of a tensor view");
+	/* every process must prune the same blocks */
+	xm_tensor_sync_block_norms(tensor);
+	nblocks = xm_tensor_get_nblocks(tensor);
+	nblk = xm_dim_dot(&nblocks);
+	if ((prune = calloc(nblk, 1)) == NULL)
+		fatal("out of memory");
+	for (i = 0; i < nblk; i++) {
+		struct xm_block *block = &tensor->blocks[i];
+		if (block->type == XM_BLOCK_TYPE_CANONICAL &&
+		    block->norm <= threshold)
+			prune[i] = 1;
+	}
+	for (i = 0; i < nblk; i++) {
+		struct xm_block *block = &tensor->blocks[i];
+		if (block->type == XM_BLOCK_TYPE_DERIVATIVE &&
+		    prune[block->data_ptr])
+			xm_tensor_set_zero_block(tensor,
+			    xm_dim_from_offset(i, &nblocks));
+	}
+	for (i = 0; i < nblk; i++) {
+		if (prune[i]) {
+			if (tensor->gen == NULL)
+				xm_allocator_deallocate(tensor->allocator,
+				    tensor->blocks[i].data_ptr);
+			xm_tensor_set_zero_block(tensor,
+			    xm_dim_from_offset(i, &nblocks));
+			npruned++;
 		}
-		xm_dim_inc_mask(&elidx, &blkdims, &mask_j);
 	}
+	free(prune);
+	return npruned;
 }
 
 void
@@ -645,11 +1112,14 @@ xm_tensor_free_block_data(xm_tensor_t *tensor)
 	uint64_t data_ptr;
 	xm_block_type_t blocktype;
 
+	if (tensor->is_view)
+		fatal("cannot free block data of a tensor view");
 	nblocks = xm_tensor_get_nblocks(tensor);
 	idx = xm_dim_zero(nblocks.n);
 	while (xm_dim_ne(&idx, &nblocks)) {
 		blocktype = xm_tensor_get_block_type(tensor, idx);
-		if (blocktype == XM_BLOCK_TYPE_CANONICAL) {
+		if (blocktype == XM_BLOCK_TYPE_CANONICAL &&
+		    tensor->gen == NULL) {
 			data_ptr = xm_tensor_get_block_data_ptr(tensor, idx);
 			xm_allocator_deallocate(tensor->allocator, data_ptr);
 		}
@@ -663,7 +1133,14 @@ xm_tensor_free(xm_tensor_t *tensor)
 {
 	if (tensor) {
 		xm_block_space_free(tensor->bs);
-		free(tensor->blocks);
+		plan_free(tensor->plans);
+		if (!tensor->is_view) {
+			free(tensor->blocks);
+			if (tensor->gen) {
+				xm_cache_destroy(tensor->gen->cache);
+				free(tensor->gen);
+			}
+		}
 		free(tensor);
 	}
 }
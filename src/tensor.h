@@ -41,6 +41,16 @@ typedef enum {
 /** Opaque tensor structure. */
 typedef struct xm_tensor xm_tensor_t;
 
+/** Function that computes data of a canonical block of a generated tensor.
+ *  It can be called concurrently from several threads.
+ *  See ::xm_tensor_create_generated.
+ *  \param blkidx Index of the canonical block in the tensor the generator was
+ *         attached to. Views of the tensor pass the index in the source tensor.
+ *  \param buf Output buffer. Data has the same layout as the data returned by
+ *         ::xm_tensor_read_block.
+ *  \param data User data passed to ::xm_tensor_create_generated. */
+typedef void (*xm_block_generator_t)(xm_dim_t blkidx, void *buf, void *data);
+
 /** Create new block-tensor with all blocks set to zero-blocks.
  *  \param bs Block-space.
  *  \param type Scalar type of tensor data.
@@ -58,6 +68,26 @@ xm_tensor_t *xm_tensor_create(const xm_block_space_t *bs, xm_scalar_type_t type,
 xm_tensor_t *xm_tensor_create_canonical(const xm_block_space_t *bs,
     xm_scalar_type_t type, xm_allocator_t *allocator);
 
+/** Create new block-tensor whose block data is computed on demand by a user
+ *  function instead of being stored. All blocks are initially zero-blocks.
+ *  Canonical blocks set with ::xm_tensor_set_canonical_block do not allocate
+ *  any data and are computed by the generator every time they are read.
+ *  Generated tensors can be used as inputs of all operations but cannot be
+ *  written to. Block norms of generated tensors are not known, so blocks are
+ *  never screened.
+ *  \param bs Block-space.
+ *  \param type Scalar type of tensor data.
+ *  \param allocator Allocator. It is not used for block data, but operands of
+ *         an operation must share the allocator.
+ *  \param fn Function that computes canonical blocks.
+ *  \param data User data passed to the function.
+ *  \param cachebytes Size in bytes of a cache that keeps the most recently
+ *         generated blocks. Zero disables the cache.
+ *  \return New instance of ::xm_tensor_t. */
+xm_tensor_t *xm_tensor_create_generated(const xm_block_space_t *bs,
+    xm_scalar_type_t type, xm_allocator_t *allocator, xm_block_generator_t fn,
+    void *data, size_t cachebytes);
+
 /** Create new block-tensor using block structure from the source tensor.
  *  This function only copies the block structure and does not copy the data.
  *  \param tensor Source tensor.
@@ -67,6 +97,19 @@ xm_tensor_t *xm_tensor_create_canonical(const xm_block_space_t *bs,
 xm_tensor_t *xm_tensor_create_structure(const xm_tensor_t *tensor,
     xm_scalar_type_t type, xm_allocator_t *allocator);
 
+/** Create a view of a rectangular range of blocks of a tensor. The view
+ *  shares block data and block structure with the source tensor, so changes
+ *  made through either one are visible in both. Views can be passed to all
+ *  tensor operations except the ones that release block data. The source
+ *  tensor must outlive the view. The view must be freed using
+ *  ::xm_tensor_free, which does not affect the source tensor.
+ *  \param tensor Source tensor.
+ *  \param blk_lo Index of the first block of the range.
+ *  \param blk_hi Index past the last block of the range.
+ *  \return New tensor view. */
+xm_tensor_t *xm_tensor_view(xm_tensor_t *tensor, xm_dim_t blk_lo,
+    xm_dim_t blk_hi);
+
 /** Return block-space associated with the tensor.
  *  \param tensor Input tensor.
  *  \return Block-space of the tensor. */
@@ -157,6 +200,15 @@ xm_dim_t xm_tensor_get_block_permutation(const xm_tensor_t *tensor,
 xm_scalar_t xm_tensor_get_block_scalar(const xm_tensor_t *tensor,
     xm_dim_t blkidx);
 
+/** Return norm of a specific tensor block. The Frobenius norm of block data
+ *  is recorded on every ::xm_tensor_write_block. Derivative blocks return the
+ *  norm of their source block multiplied by the absolute value of the block
+ *  scalar factor. Canonical blocks that were never written return HUGE_VAL.
+ *  \param tensor Input tensor.
+ *  \param blkidx Index of the block.
+ *  \return Frobenius norm of the block. */
+double xm_tensor_get_block_norm(const xm_tensor_t *tensor, xm_dim_t blkidx);
+
 /** Set tensor block as zero-block (all elements of a block are zeros).
  *  No actual data are stored for zero-blocks.
  *  \param tensor Input tensor.
@@ -211,6 +263,12 @@ void xm_tensor_get_canonical_block_list(const xm_tensor_t *tensor,
 void xm_tensor_read_block(const xm_tensor_t *tensor, xm_dim_t blkidx,
     void *buf);
 
+/** Hint that tensor block data will be read soon. For disk-backed tensors
+ *  this starts reading the block in the background. Zero-blocks are ignored.
+ *  \param tensor Input tensor.
+ *  \param blkidx Index of the block. */
+void xm_tensor_prefetch_block(const xm_tensor_t *tensor, xm_dim_t blkidx);
+
 /** Write tensor block data from memory buffer.
  *  \param tensor Input tensor.
  *  \param blkidx Index of the block.
@@ -218,6 +276,17 @@ void xm_tensor_read_block(const xm_tensor_t *tensor, xm_dim_t blkidx,
 void xm_tensor_write_block(xm_tensor_t *tensor, xm_dim_t blkidx,
     const void *buf);
 
+/** Synchronize block norms recorded by ::xm_tensor_write_block between MPI
+ *  processes. All tensor operations do this for their output tensors.
+ *  ::xm_contract does it for its input tensors when screening or adaptive
+ *  mixed precision is enabled, and ::xm_tensor_prune_blocks does it before
+ *  pruning. Otherwise, after a direct write by any process, including a
+ *  single process filling in input data, this function must be called by
+ *  all processes before ::xm_tensor_get_block_norm is used. It does nothing
+ *  without MPI.
+ *  \param tensor Input tensor. */
+void xm_tensor_sync_block_norms(xm_tensor_t *tensor);
+
 /** Unfold block into the matrix form. The sequences of unfolding indices are
  *  specified using the masks. The \p from parameter should point to the raw
  *  block data in memory. The \p stride must be equal to or greater than the
@@ -248,6 +317,18 @@ void xm_tensor_fold_block(const xm_tensor_t *tensor, xm_dim_t blkidx,
     xm_dim_t mask_i, xm_dim_t mask_j, const void *from, void *to,
     size_t stride);
 
+/** Convert canonical blocks with norm (see ::xm_tensor_get_block_norm) not
+ *  greater than \p threshold to zero-blocks and release their data.
+ *  Derivative blocks of such blocks also become zero-blocks. Block norms are
+ *  recorded on write so no block data are read. Operations skip zero-blocks
+ *  of input tensors and never write to zero-blocks of output tensors.
+ *  When using MPI this function must be called by all processes.
+ *  \param tensor Input tensor.
+ *  \param threshold Norm threshold. Use zero to only remove blocks that
+ *  contain exact zeros.
+ *  \return Number of released canonical blocks. */
+size_t xm_tensor_prune_blocks(xm_tensor_t *tensor, double threshold);
+
 /** Deallocate associated data for all blocks of this tensor.
  *  This resets all blocks to zero.
  *  \param tensor Input tensor. */
@@ -19,6 +19,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "util.h"
 
 void
@@ -51,3 +55,32 @@ xm_make_masks(const char *str1, const char *str2, xm_dim_t *mask1,
 				mask2->i[mask2->n++] = j;
 			}
 }
+
+/* Decide whether an operation should distribute its nblocks blocks between
+ * threads. When there are fewer blocks than threads and the blocks are large
+ * the blocks are processed one by one instead so that each fold and unfold
+ * uses all threads. */
+int
+xm_parallel_blocks(size_t nblocks, size_t maxblksize)
+{
+#ifdef _OPENMP
+	if (maxblksize >= XM_PARALLEL_BLOCK_SIZE &&
+	    nblocks < (size_t)omp_get_max_threads())
+		return 0;
+#else
+	(void)nblocks;
+	(void)maxblksize;
+#endif
+	return 1;
+}
+
+/* Return the number of floating-point operations of n multiplications or,
+ * if fma is non-zero, n multiply-adds of scalars of the given type. */
+double
+xm_flops(double n, int fma, xm_scalar_type_t type)
+{
+	if (type == XM_SCALAR_FLOAT_COMPLEX ||
+	    type == XM_SCALAR_DOUBLE_COMPLEX)
+		return n * (fma ? 8 : 6);
+	return n * (fma ? 2 : 1);
+}
@@ -20,6 +20,7 @@
 /* Private header */
 
 #include "dim.h"
+#include "scalar.h"
 
 #ifndef __dead
 #if defined(__GNUC__)
@@ -31,7 +32,13 @@
 
 #define fatal(x) xm_fatal("%s: %s", __func__, (x))
 
+/* Blocks with at least this number of elements are folded and unfolded by
+ * all threads when called outside of an active parallel region. */
+#define XM_PARALLEL_BLOCK_SIZE (4 * 1024 * 1024)
+
 void xm_fatal(const char *, ...) __dead;
 void xm_make_masks(const char *, const char *, xm_dim_t *, xm_dim_t *);
+int xm_parallel_blocks(size_t, size_t);
+double xm_flops(double, int, xm_scalar_type_t);
 
 #endif /* UTIL_H_INCLUDED */
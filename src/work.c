@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2014-2018 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef XM_USE_MPI
+#include <mpi.h>
+#endif
+
+#include "work.h"
+#include "util.h"
+
+/* Each worker takes about this many chunks of iterations. */
+#define WORK_CHUNKS_PER_WORKER 16
+
+struct xm_work {
+	const int *owner;
+	size_t n, chunk;
+	size_t next, end; /* iterations of the current chunk */
+	int mpirank, mpisize, dynamic, done;
+#ifdef XM_USE_MPI
+	MPI_Win win;
+	uint64_t *counter; /* next chunk, only on rank 0 */
+#endif
+#ifdef _OPENMP
+	omp_lock_t lock;
+#endif
+};
+
+xm_work_t *
+xm_work_create(size_t n, const int *owner)
+{
+	xm_work_t *work;
+	int nthreads = 1;
+
+	if ((work = calloc(1, sizeof *work)) == NULL)
+		fatal("out of memory");
+#ifdef _OPENMP
+	nthreads = omp_get_max_threads();
+	omp_init_lock(&work->lock);
+#endif
+	work->owner = owner;
+	work->n = n;
+	work->mpisize = 1;
+#ifdef XM_USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &work->mpirank);
+	MPI_Comm_size(MPI_COMM_WORLD, &work->mpisize);
+	if (work->mpisize > 1) {
+		int provided;
+
+		MPI_Query_thread(&provided);
+		work->dynamic = nthreads == 1 ||
+		    provided >= MPI_THREAD_SERIALIZED;
+		/* all processes must agree on the kind of distribution */
+		MPI_Allreduce(MPI_IN_PLACE, &work->dynamic, 1, MPI_INT,
+		    MPI_MIN, MPI_COMM_WORLD);
+	}
+	if (work->dynamic) {
+		MPI_Win_allocate(work->mpirank == 0 ? sizeof(uint64_t) : 0,
+		    sizeof(uint64_t), MPI_INFO_NULL, MPI_COMM_WORLD,
+		    &work->counter, &work->win);
+		if (work->mpirank == 0) {
+			MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, work->win);
+			*work->counter = 0;
+			MPI_Win_unlock(0, work->win);
+		}
+		MPI_Barrier(MPI_COMM_WORLD);
+	}
+#endif
+	work->chunk = n / ((size_t)work->mpisize * (size_t)nthreads *
+	    WORK_CHUNKS_PER_WORKER);
+	if (work->chunk == 0)
+		work->chunk = 1;
+	if (!work->dynamic && owner == NULL)
+		work->next = (size_t)work->mpirank;
+	return work;
+}
+
+/* Take the next chunk from the shared counter.  Called with the lock. */
+static void
+work_fetch(xm_work_t *work)
+{
+#ifdef XM_USE_MPI
+	uint64_t chunk = work->chunk, start;
+
+	MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, work->win);
+	MPI_Fetch_and_op(&chunk, &start, MPI_UINT64_T, 0, 0, MPI_SUM,
+	    work->win);
+	MPI_Win_unlock(0, work->win);
+	work->next = (size_t)start;
+	work->end = work->next + work->chunk;
+	if (work->end > work->n)
+		work->end = work->n;
+#else
+	(void)work;
+#endif
+}
+
+static int
+work_next(xm_work_t *work, size_t *i)
+{
+	if (work->dynamic) {
+		if (work->next >= work->end && !work->done)
+			work_fetch(work);
+		if (work->next >= work->end) {
+			work->done = 1;
+			return 0;
+		}
+		*i = work->next++;
+		return 1;
+	}
+	if (work->owner) {
+		while (work->next < work->n &&
+		    work->owner[work->next] != work->mpirank)
+			work->next++;
+		if (work->next >= work->n)
+			return 0;
+		*i = work->next++;
+		return 1;
+	}
+	if (work->next >= work->n)
+		return 0;
+	*i = work->next;
+	work->next += (size_t)work->mpisize;
+	return 1;
+}
+
+int
+xm_work_next(xm_work_t *work, size_t *i)
+{
+	int ret;
+
+#ifdef _OPENMP
+	omp_set_lock(&work->lock);
+#endif
+	ret = work_next(work, i);
+#ifdef _OPENMP
+	omp_unset_lock(&work->lock);
+#endif
+	return ret;
+}
+
+void
+xm_work_destroy(xm_work_t *work)
+{
+	if (work == NULL)
+		return;
+#ifdef XM_USE_MPI
+	if (work->dynamic)
+		MPI_Win_free(&work->win);
+#endif
+#ifdef _OPENMP
+	omp_destroy_lock(&work->lock);
+#endif
+	free(work);
+}
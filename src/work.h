@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2014-2018 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef XM_WORK_H_INCLUDED
+#define XM_WORK_H_INCLUDED
+
+/* Private header */
+
+#include <stddef.h>
+
+/* Distribution of loop iterations between all threads of all processes.
+ * With MPI, processes take chunks of iterations from a counter shared
+ * through one-sided communication, so that a slow process takes less work.
+ * If MPI was not initialized with at least MPI_THREAD_SERIALIZED support
+ * while several threads are used, iterations are assigned statically. */
+typedef struct xm_work xm_work_t;
+
+/* Create a distribution of iterations 0 to n-1.  The owner array gives the
+ * process of each iteration for the static assignment.  If it is NULL,
+ * iterations are assigned round-robin.  With MPI this is collective. */
+xm_work_t *xm_work_create(size_t n, const int *owner);
+
+/* Get the next iteration of the calling process.  Can be called from
+ * multiple threads.  Returns zero when there are no iterations left. */
+int xm_work_next(xm_work_t *work, size_t *i);
+
+/* With MPI this is collective. */
+void xm_work_destroy(xm_work_t *work);
+
+#endif /* XM_WORK_H_INCLUDED */
@@ -18,12 +18,16 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #ifdef XM_USE_MPI
 #include <mpi.h>
 #endif
 
 #include "xm.h"
 #include "util.h"
+#include "work.h"
 
 void
 xm_set(xm_tensor_t *a, xm_scalar_t x)
@@ -32,32 +36,26 @@ xm_set(xm_tensor_t *a, xm_scalar_t x)
 	xm_scalar_type_t scalartype;
 	size_t i, maxblksize, nblklist;
 	void *buf;
-	int mpirank = 0, mpisize = 1;
+	xm_work_t *work;
 
-#ifdef XM_USE_MPI
-	MPI_Comm_rank(MPI_COMM_WORLD, &mpirank);
-	MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
-#endif
 	if ((buf = malloc(xm_tensor_get_largest_block_bytes(a))) == NULL)
 		fatal("out of memory");
 	maxblksize = xm_tensor_get_largest_block_size(a);
 	scalartype = xm_tensor_get_scalar_type(a);
 	xm_scalar_set(buf, x, maxblksize, scalartype);
 	xm_tensor_get_canonical_block_list(a, &blklist, &nblklist);
+	work = xm_work_create(nblklist, NULL);
 #ifdef _OPENMP
 #pragma omp parallel private(i)
 #endif
 {
-#ifdef _OPENMP
-#pragma omp for schedule(dynamic)
-#endif
-	for (i = 0; i < nblklist; i++) {
-		if ((int)i % mpisize == mpirank)
-			xm_tensor_write_block(a, blklist[i], buf);
-	}
+	while (xm_work_next(work, &i))
+		xm_tensor_write_block(a, blklist[i], buf);
 }
+	xm_work_destroy(work);
 	free(buf);
 	free(blklist);
+	xm_tensor_sync_block_norms(a);
 #ifdef XM_USE_MPI
 	MPI_Barrier(MPI_COMM_WORLD);
 #endif
@@ -71,12 +69,12 @@ xm_copy(xm_tensor_t *a, xm_scalar_t s, const xm_tensor_t *b, const char *idxa,
 	xm_dim_t cidxa, cidxb, zero, *blklist;
 	xm_scalar_type_t scalartypea, scalartypeb;
 	size_t i, maxblkbytesa, maxblkbytesb, nblklist;
-	int mpirank = 0, mpisize = 1;
+	xm_work_t *work;
+	int mpisize = 1, parallel;
 
 	if (xm_tensor_get_allocator(a) != xm_tensor_get_allocator(b))
 		fatal("tensors must use same allocator");
 #ifdef XM_USE_MPI
-	MPI_Comm_rank(MPI_COMM_WORLD, &mpirank);
 	MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
 #endif
 	bsa = xm_tensor_get_block_space(a);
@@ -99,8 +97,11 @@ xm_copy(xm_tensor_t *a, xm_scalar_t s, const xm_tensor_t *b, const char *idxa,
 	maxblkbytesa = xm_tensor_get_largest_block_bytes(a);
 	maxblkbytesb = xm_tensor_get_largest_block_bytes(b);
 	xm_tensor_get_canonical_block_list(a, &blklist, &nblklist);
+	parallel = xm_parallel_blocks((nblklist + mpisize - 1) / mpisize,
+	    xm_tensor_get_largest_block_size(a));
+	work = xm_work_create(nblklist, NULL);
 #ifdef _OPENMP
-#pragma omp parallel private(i)
+#pragma omp parallel private(i) if (parallel)
 #endif
 {
 	xm_dim_t ia, ib;
@@ -117,40 +118,37 @@ xm_copy(xm_tensor_t *a, xm_scalar_t s, const xm_tensor_t *b, const char *idxa,
 	if ((buf2b = malloc(maxblkbytesb)) == NULL)
 		fatal("out of memory");
 	ib = xm_dim_zero(cidxb.n);
-#ifdef _OPENMP
-#pragma omp for schedule(dynamic)
-#endif
-	for (i = 0; i < nblklist; i++) {
-		if ((int)i % mpisize == mpirank) {
-			ia = blklist[i];
-			xm_dim_set_mask(&ib, &cidxb, &ia, &cidxa);
-			blksize = xm_tensor_get_block_size(b, ib);
-			blocktype = xm_tensor_get_block_type(b, ib);
-			if (s == 0 || blocktype == XM_BLOCK_TYPE_ZERO) {
-				memset(buf2a, 0, maxblkbytesa);
-			} else {
-				xm_scalar_t scalar = xm_scalar_mul(s,
-				    xm_tensor_get_block_scalar(b, ib),
-				    scalartypeb);
-				xm_tensor_read_block(b, ib, buf2b);
-				xm_tensor_unfold_block(b, ib, cidxb, zero,
-				    buf2b, buf1b, blksize);
-				xm_scalar_scale(buf1b, scalar, blksize,
-				    scalartypeb);
-				xm_scalar_convert(buf1a, buf1b, blksize,
-				    scalartypea, scalartypeb);
-				xm_tensor_fold_block(a, ia, cidxa, zero, buf1a,
-				    buf2a, blksize);
-			}
-			xm_tensor_write_block(a, ia, buf2a);
+	while (xm_work_next(work, &i)) {
+		ia = blklist[i];
+		xm_dim_set_mask(&ib, &cidxb, &ia, &cidxa);
+		blksize = xm_tensor_get_block_size(b, ib);
+		blocktype = xm_tensor_get_block_type(b, ib);
+		if (s == 0 || blocktype == XM_BLOCK_TYPE_ZERO) {
+			memset(buf2a, 0, maxblkbytesa);
+		} else {
+			xm_scalar_t scalar = xm_scalar_mul(s,
+			    xm_tensor_get_block_scalar(b, ib),
+			    scalartypeb);
+			xm_tensor_read_block(b, ib, buf2b);
+			xm_tensor_unfold_block(b, ib, cidxb, zero,
+			    buf2b, buf1b, blksize);
+			xm_scalar_scale(buf1b, scalar, blksize,
+			    scalartypeb);
+			xm_scalar_convert(buf1a, buf1b, blksize,
+			    scalartypea, scalartypeb);
+			xm_tensor_fold_block(a, ia, cidxa, zero, buf1a,
+			    buf2a, blksize);
 		}
+		xm_tensor_write_block(a, ia, buf2a);
 	}
 	free(buf1a);
 	free(buf2a);
 	free(buf1b);
 	free(buf2b);
 }
+	xm_work_destroy(work);
 	free(blklist);
+	xm_tensor_sync_block_norms(a);
 #ifdef XM_USE_MPI
 	MPI_Barrier(MPI_COMM_WORLD);
 #endif
@@ -164,14 +162,14 @@ xm_add(xm_scalar_t alpha, xm_tensor_t *a, xm_scalar_t beta,
 	xm_dim_t cidxa, cidxb, zero, *blklist;
 	xm_scalar_type_t scalartype;
 	size_t i, maxblkbytes, nblklist;
-	int mpirank = 0, mpisize = 1;
+	xm_work_t *work;
+	int mpisize = 1, parallel;
 
 	if (xm_tensor_get_allocator(a) != xm_tensor_get_allocator(b))
 		fatal("tensors must use same allocator");
 	if (xm_tensor_get_scalar_type(a) != xm_tensor_get_scalar_type(b))
 		fatal("tensors must have same scalar type");
 #ifdef XM_USE_MPI
-	MPI_Comm_rank(MPI_COMM_WORLD, &mpirank);
 	MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
 #endif
 	bsa = xm_tensor_get_block_space(a);
@@ -192,8 +190,11 @@ xm_add(xm_scalar_t alpha, xm_tensor_t *a, xm_scalar_t beta,
 	zero = xm_dim_zero(0);
 	maxblkbytes = xm_tensor_get_largest_block_bytes(a);
 	xm_tensor_get_canonical_block_list(a, &blklist, &nblklist);
+	parallel = xm_parallel_blocks((nblklist + mpisize - 1) / mpisize,
+	    xm_tensor_get_largest_block_size(a));
+	work = xm_work_create(nblklist, NULL);
 #ifdef _OPENMP
-#pragma omp parallel private(i)
+#pragma omp parallel private(i) if (parallel)
 #endif
 {
 	xm_dim_t ia, ib;
@@ -206,48 +207,121 @@ xm_add(xm_scalar_t alpha, xm_tensor_t *a, xm_scalar_t beta,
 	if ((buf2 = malloc(maxblkbytes)) == NULL)
 		fatal("out of memory");
 	ib = xm_dim_zero(cidxb.n);
-#ifdef _OPENMP
-#pragma omp for schedule(dynamic)
-#endif
-	for (i = 0; i < nblklist; i++) {
-		if ((int)i % mpisize == mpirank) {
-			ia = blklist[i];
-			xm_dim_set_mask(&ib, &cidxb, &ia, &cidxa);
-			blksize = xm_tensor_get_block_size(b, ib);
-			blocktype = xm_tensor_get_block_type(b, ib);
-			if (beta == 0 || blocktype == XM_BLOCK_TYPE_ZERO) {
-				memset(buf2, 0, maxblkbytes);
-			} else {
-				xm_scalar_t scalar = xm_scalar_mul(beta,
-				    xm_tensor_get_block_scalar(b, ib),
-				    scalartype);
-				xm_tensor_read_block(b, ib, buf2);
-				xm_tensor_unfold_block(b, ib, cidxb, zero, buf2,
-				    buf1, blksize);
-				xm_scalar_scale(buf1, scalar, blksize,
-				    scalartype);
-				xm_tensor_fold_block(a, ia, cidxa, zero, buf1,
-				    buf2, blksize);
-			}
-			if (alpha == 0)
-				xm_tensor_write_block(a, ia, buf2);
-			else {
-				xm_tensor_read_block(a, ia, buf1);
-				xm_scalar_axpy(buf1, alpha, buf2, 1, blksize,
-				    scalartype);
-				xm_tensor_write_block(a, ia, buf1);
-			}
+	while (xm_work_next(work, &i)) {
+		ia = blklist[i];
+		xm_dim_set_mask(&ib, &cidxb, &ia, &cidxa);
+		blksize = xm_tensor_get_block_size(b, ib);
+		blocktype = xm_tensor_get_block_type(b, ib);
+		if (beta == 0 || blocktype == XM_BLOCK_TYPE_ZERO) {
+			memset(buf2, 0, maxblkbytes);
+		} else {
+			xm_scalar_t scalar = xm_scalar_mul(beta,
+			    xm_tensor_get_block_scalar(b, ib),
+			    scalartype);
+			xm_tensor_read_block(b, ib, buf2);
+			xm_tensor_unfold_block(b, ib, cidxb, zero, buf2,
+			    buf1, blksize);
+			xm_scalar_scale(buf1, scalar, blksize,
+			    scalartype);
+			xm_tensor_fold_block(a, ia, cidxa, zero, buf1,
+			    buf2, blksize);
+		}
+		if (alpha == 0)
+			xm_tensor_write_block(a, ia, buf2);
+		else {
+			xm_tensor_read_block(a, ia, buf1);
+			xm_scalar_axpy(buf1, alpha, buf2, 1, blksize,
+			    scalartype);
+			xm_tensor_write_block(a, ia, buf1);
 		}
 	}
 	free(buf1);
 	free(buf2);
 }
+	xm_work_destroy(work);
 	free(blklist);
+	xm_tensor_sync_block_norms(a);
 #ifdef XM_USE_MPI
 	MPI_Barrier(MPI_COMM_WORLD);
 #endif
 }
 
+/* Walk the blocks of an element-wise operation a = alpha * a + beta * b
+ * without touching any data.  The output block is read if alpha is
+ * non-zero. */
+static xm_cost_t
+estimate_elementwise(xm_scalar_t alpha, const xm_tensor_t *a,
+    xm_scalar_t beta, const xm_tensor_t *b, const char *idxa,
+    const char *idxb, size_t bufbytes)
+{
+	const xm_block_space_t *bsa, *bsb;
+	xm_cost_t cost;
+	xm_dim_t cidxa, cidxb, ib, *blklist;
+	xm_scalar_type_t type;
+	size_t i, blksize, nblklist, nthreads = 1;
+
+	if (xm_tensor_get_allocator(a) != xm_tensor_get_allocator(b))
+		fatal("tensors must use same allocator");
+	bsa = xm_tensor_get_block_space(a);
+	bsb = xm_tensor_get_block_space(b);
+	if (strlen(idxa) != xm_block_space_get_ndims(bsa))
+		fatal("idxa does not match tensor dimensions");
+	if (strlen(idxb) != xm_block_space_get_ndims(bsb))
+		fatal("idxb does not match tensor dimensions");
+	xm_make_masks(idxa, idxb, &cidxa, &cidxb);
+	if (cidxa.n != xm_block_space_get_ndims(bsa) ||
+	    cidxb.n != xm_block_space_get_ndims(bsb))
+		fatal("index spaces do not match");
+	for (i = 0; i < cidxa.n; i++)
+		if (!xm_block_space_eq1(bsa, cidxa.i[i], bsb, cidxb.i[i]))
+			fatal("inconsistent block-spaces");
+
+	memset(&cost, 0, sizeof cost);
+#ifdef _OPENMP
+	nthreads = (size_t)omp_get_max_threads();
+#endif
+	type = xm_tensor_get_scalar_type(a);
+	ib = xm_dim_zero(cidxb.n);
+	xm_tensor_get_canonical_block_list(a, &blklist, &nblklist);
+	for (i = 0; i < nblklist; i++) {
+		xm_dim_set_mask(&ib, &cidxb, &blklist[i], &cidxa);
+		blksize = xm_tensor_get_block_size(a, blklist[i]);
+		if (beta != 0 && xm_tensor_get_block_type(b, ib) !=
+		    XM_BLOCK_TYPE_ZERO) {
+			cost.bytes_read += xm_tensor_get_block_bytes(b, ib);
+			cost.flops += xm_flops((double)blksize, 0, type);
+		}
+		if (alpha != 0) {
+			cost.bytes_read += xm_tensor_get_block_bytes(a,
+			    blklist[i]);
+			cost.flops += xm_flops((double)blksize, 1, type);
+		}
+		cost.bytes_written += xm_tensor_get_block_bytes(a, blklist[i]);
+	}
+	free(blklist);
+	cost.peak_memory = nthreads * bufbytes;
+	return cost;
+}
+
+xm_cost_t
+xm_copy_estimate(const xm_tensor_t *a, xm_scalar_t s, const xm_tensor_t *b,
+    const char *idxa, const char *idxb)
+{
+	return estimate_elementwise(0, a, s, b, idxa, idxb,
+	    2 * (xm_tensor_get_largest_block_bytes(a) +
+	    xm_tensor_get_largest_block_bytes(b)));
+}
+
+xm_cost_t
+xm_add_estimate(xm_scalar_t alpha, const xm_tensor_t *a, xm_scalar_t beta,
+    const xm_tensor_t *b, const char *idxa, const char *idxb)
+{
+	if (xm_tensor_get_scalar_type(a) != xm_tensor_get_scalar_type(b))
+		fatal("tensors must have same scalar type");
+	return estimate_elementwise(alpha, a, beta, b, idxa, idxb,
+	    2 * xm_tensor_get_largest_block_bytes(a));
+}
+
 void
 xm_mul(xm_tensor_t *a, const xm_tensor_t *b, const char *idxa,
     const char *idxb)
@@ -256,14 +330,14 @@ xm_mul(xm_tensor_t *a, const xm_tensor_t *b, const char *idxa,
 	xm_dim_t cidxa, cidxb, zero, *blklist;
 	xm_scalar_type_t scalartype;
 	size_t i, maxblkbytes, nblklist;
-	int mpirank = 0, mpisize = 1;
+	xm_work_t *work;
+	int mpisize = 1, parallel;
 
 	if (xm_tensor_get_allocator(a) != xm_tensor_get_allocator(b))
 		fatal("tensors must use same allocator");
 	if (xm_tensor_get_scalar_type(a) != xm_tensor_get_scalar_type(b))
 		fatal("tensors must have same scalar type");
 #ifdef XM_USE_MPI
-	MPI_Comm_rank(MPI_COMM_WORLD, &mpirank);
 	MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
 #endif
 	bsa = xm_tensor_get_block_space(a);
@@ -284,8 +358,11 @@ xm_mul(xm_tensor_t *a, const xm_tensor_t *b, const char *idxa,
 	zero = xm_dim_zero(0);
 	maxblkbytes = xm_tensor_get_largest_block_bytes(a);
 	xm_tensor_get_canonical_block_list(a, &blklist, &nblklist);
+	parallel = xm_parallel_blocks((nblklist + mpisize - 1) / mpisize,
+	    xm_tensor_get_largest_block_size(a));
+	work = xm_work_create(nblklist, NULL);
 #ifdef _OPENMP
-#pragma omp parallel private(i)
+#pragma omp parallel private(i) if (parallel)
 #endif
 {
 	xm_dim_t ia, ib;
@@ -298,34 +375,31 @@ xm_mul(xm_tensor_t *a, const xm_tensor_t *b, const char *idxa,
 	if ((buf2 = malloc(maxblkbytes)) == NULL)
 		fatal("out of memory");
 	ib = xm_dim_zero(cidxb.n);
-#ifdef _OPENMP
-#pragma omp for schedule(dynamic)
-#endif
-	for (i = 0; i < nblklist; i++) {
-		if ((int)i % mpisize == mpirank) {
-			xm_scalar_t scalar;
-			ia = blklist[i];
-			xm_dim_set_mask(&ib, &cidxb, &ia, &cidxa);
-			blksize = xm_tensor_get_block_size(b, ib);
-			blocktype = xm_tensor_get_block_type(b, ib);
-			if (blocktype == XM_BLOCK_TYPE_ZERO) {
-				memset(buf1, 0, maxblkbytes);
-			} else {
-				scalar = xm_tensor_get_block_scalar(b, ib);
-				xm_tensor_read_block(b, ib, buf1);
-				xm_tensor_unfold_block(b, ib, cidxb, zero, buf1,
-				    buf2, blksize);
-				xm_tensor_read_block(a, ia, buf1);
-				xm_scalar_vec_mul(buf1, scalar, buf2, blksize,
-				    scalartype);
-			}
-			xm_tensor_write_block(a, ia, buf1);
+	while (xm_work_next(work, &i)) {
+		xm_scalar_t scalar;
+		ia = blklist[i];
+		xm_dim_set_mask(&ib, &cidxb, &ia, &cidxa);
+		blksize = xm_tensor_get_block_size(b, ib);
+		blocktype = xm_tensor_get_block_type(b, ib);
+		if (blocktype == XM_BLOCK_TYPE_ZERO) {
+			memset(buf1, 0, maxblkbytes);
+		} else {
+			scalar = xm_tensor_get_block_scalar(b, ib);
+			xm_tensor_read_block(b, ib, buf1);
+			xm_tensor_unfold_block(b, ib, cidxb, zero, buf1,
+			    buf2, blksize);
+			xm_tensor_read_block(a, ia, buf1);
+			xm_scalar_vec_mul(buf1, scalar, buf2, blksize,
+			    scalartype);
 		}
+		xm_tensor_write_block(a, ia, buf1);
 	}
 	free(buf1);
 	free(buf2);
 }
+	xm_work_destroy(work);
 	free(blklist);
+	xm_tensor_sync_block_norms(a);
 #ifdef XM_USE_MPI
 	MPI_Barrier(MPI_COMM_WORLD);
 #endif
@@ -339,14 +413,14 @@ xm_div(xm_tensor_t *a, const xm_tensor_t *b, const char *idxa,
 	xm_dim_t cidxa, cidxb, zero, *blklist;
 	xm_scalar_type_t scalartype;
 	size_t i, maxblkbytes, nblklist;
-	int mpirank = 0, mpisize = 1;
+	xm_work_t *work;
+	int mpisize = 1, parallel;
 
 	if (xm_tensor_get_allocator(a) != xm_tensor_get_allocator(b))
 		fatal("tensors must use same allocator");
 	if (xm_tensor_get_scalar_type(a) != xm_tensor_get_scalar_type(b))
 		fatal("tensors must have same scalar type");
 #ifdef XM_USE_MPI
-	MPI_Comm_rank(MPI_COMM_WORLD, &mpirank);
 	MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
 #endif
 	bsa = xm_tensor_get_block_space(a);
@@ -367,8 +441,11 @@ xm_div(xm_tensor_t *a, const xm_tensor_t *b, const char *idxa,
 	zero = xm_dim_zero(0);
 	maxblkbytes = xm_tensor_get_largest_block_bytes(a);
 	xm_tensor_get_canonical_block_list(a, &blklist, &nblklist);
+	parallel = xm_parallel_blocks((nblklist + mpisize - 1) / mpisize,
+	    xm_tensor_get_largest_block_size(a));
+	work = xm_work_create(nblklist, NULL);
 #ifdef _OPENMP
-#pragma omp parallel private(i)
+#pragma omp parallel private(i) if (parallel)
 #endif
 {
 	xm_dim_t ia, ib;
@@ -381,32 +458,29 @@ xm_div(xm_tensor_t *a, const xm_tensor_t *b, const char *idxa,
 	if ((buf2 = malloc(maxblkbytes)) == NULL)
 		fatal("out of memory");
 	ib = xm_dim_zero(cidxb.n);
-#ifdef _OPENMP
-#pragma omp for schedule(dynamic)
-#endif
-	for (i = 0; i < nblklist; i++) {
-		if ((int)i % mpisize == mpirank) {
-			xm_scalar_t scalar;
-			ia = blklist[i];
-			xm_dim_set_mask(&ib, &cidxb, &ia, &cidxa);
-			blksize = xm_tensor_get_block_size(b, ib);
-			blocktype = xm_tensor_get_block_type(b, ib);
-			if (blocktype == XM_BLOCK_TYPE_ZERO)
-				fatal("division by zero");
-			scalar = xm_tensor_get_block_scalar(b, ib);
-			xm_tensor_read_block(b, ib, buf1);
-			xm_tensor_unfold_block(b, ib, cidxb, zero, buf1,
-			    buf2, blksize);
-			xm_tensor_read_block(a, ia, buf1);
-			xm_scalar_vec_div(buf1, scalar, buf2, blksize,
-			    scalartype);
-			xm_tensor_write_block(a, ia, buf1);
-		}
+	while (xm_work_next(work, &i)) {
+		xm_scalar_t scalar;
+		ia = blklist[i];
+		xm_dim_set_mask(&ib, &cidxb, &ia, &cidxa);
+		blksize = xm_tensor_get_block_size(b, ib);
+		blocktype = xm_tensor_get_block_type(b, ib);
+		if (blocktype == XM_BLOCK_TYPE_ZERO)
+			fatal("division by zero");
+		scalar = xm_tensor_get_block_scalar(b, ib);
+		xm_tensor_read_block(b, ib, buf1);
+		xm_tensor_unfold_block(b, ib, cidxb, zero, buf1,
+		    buf2, blksize);
+		xm_tensor_read_block(a, ia, buf1);
+		xm_scalar_vec_div(buf1, scalar, buf2, blksize,
+		    scalartype);
+		xm_tensor_write_block(a, ia, buf1);
 	}
 	free(buf1);
 	free(buf2);
 }
+	xm_work_destroy(work);
 	free(blklist);
+	xm_tensor_sync_block_norms(a);
 #ifdef XM_USE_MPI
 	MPI_Barrier(MPI_COMM_WORLD);
 #endif
@@ -421,14 +495,14 @@ xm_dot(const xm_tensor_t *a, const xm_tensor_t *b, const char *idxa,
 	xm_scalar_type_t scalartype;
 	xm_scalar_t dot = 0;
 	size_t i, maxblkbytes, nblklist;
-	int mpirank = 0, mpisize = 1;
+	xm_work_t *work;
+	int mpisize = 1, parallel;
 
 	if (xm_tensor_get_allocator(a) != xm_tensor_get_allocator(b))
 		fatal("tensors must use same allocator");
 	if (xm_tensor_get_scalar_type(a) != xm_tensor_get_scalar_type(b))
 		fatal("tensors must have same scalar type");
 #ifdef XM_USE_MPI
-	MPI_Comm_rank(MPI_COMM_WORLD, &mpirank);
 	MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
 #endif
 	bsa = xm_tensor_get_block_space(a);
@@ -450,8 +524,11 @@ xm_dot(const xm_tensor_t *a, const xm_tensor_t *b, const char *idxa,
 	maxblkbytes = xm_tensor_get_largest_block_bytes(a);
 	nblocks = xm_tensor_get_nblocks(a);
 	nblklist = xm_dim_dot(&nblocks);
+	parallel = xm_parallel_blocks((nblklist + mpisize - 1) / mpisize,
+	    xm_tensor_get_largest_block_size(a));
+	work = xm_work_create(nblklist, NULL);
 #ifdef _OPENMP
-#pragma omp parallel private(i) reduction(+:dot)
+#pragma omp parallel private(i) reduction(+:dot) if (parallel)
 #endif
 {
 	xm_dim_t ia, ib;
@@ -466,40 +543,36 @@ xm_dot(const xm_tensor_t *a, const xm_tensor_t *b, const char *idxa,
 	if ((buf3 = malloc(maxblkbytes)) == NULL)
 		fatal("out of memory");
 	ib = xm_dim_zero(cidxb.n);
-#ifdef _OPENMP
-#pragma omp for schedule(dynamic)
-#endif
-	for (i = 0; i < nblklist; i++) {
-		if ((int)i % mpisize == mpirank) {
-			xm_scalar_t scalara, scalarb;
-			ia = xm_dim_from_offset(i, &nblocks);
-			xm_dim_set_mask(&ib, &cidxb, &ia, &cidxa);
-			blocktype = xm_tensor_get_block_type(a, ia);
-			if (blocktype == XM_BLOCK_TYPE_ZERO)
-				continue;
-			blocktype = xm_tensor_get_block_type(b, ib);
-			if (blocktype == XM_BLOCK_TYPE_ZERO)
-				continue;
-			blksize = xm_tensor_get_block_size(b, ib);
-			xm_tensor_read_block(b, ib, buf1);
-			xm_tensor_unfold_block(b, ib, cidxb, zero, buf1,
-			    buf2, blksize);
-			xm_tensor_read_block(a, ia, buf1);
-			xm_tensor_unfold_block(a, ia, cidxa, zero, buf1,
-			    buf3, blksize);
-			scalara = xm_tensor_get_block_scalar(a, ia);
-			scalarb = xm_tensor_get_block_scalar(b, ib);
-			scalara = xm_scalar_mul(scalara, scalarb, scalartype);
-			scalarb = xm_scalar_dot(buf2, buf3, blksize,
-			    scalartype);
-			scalara = xm_scalar_mul(scalara, scalarb, scalartype);
-			dot = xm_scalar_add(dot, scalara, scalartype);
-		}
+	while (xm_work_next(work, &i)) {
+		xm_scalar_t scalara, scalarb;
+		ia = xm_dim_from_offset(i, &nblocks);
+		xm_dim_set_mask(&ib, &cidxb, &ia, &cidxa);
+		blocktype = xm_tensor_get_block_type(a, ia);
+		if (blocktype == XM_BLOCK_TYPE_ZERO)
+			continue;
+		blocktype = xm_tensor_get_block_type(b, ib);
+		if (blocktype == XM_BLOCK_TYPE_ZERO)
+			continue;
+		blksize = xm_tensor_get_block_size(b, ib);
+		xm_tensor_read_block(b, ib, buf1);
+		xm_tensor_unfold_block(b, ib, cidxb, zero, buf1,
+		    buf2, blksize);
+		xm_tensor_read_block(a, ia, buf1);
+		xm_tensor_unfold_block(a, ia, cidxa, zero, buf1,
+		    buf3, blksize);
+		scalara = xm_tensor_get_block_scalar(a, ia);
+		scalarb = xm_tensor_get_block_scalar(b, ib);
+		scalara = xm_scalar_mul(scalara, scalarb, scalartype);
+		scalarb = xm_scalar_dot(buf2, buf3, blksize,
+		    scalartype);
+		scalara = xm_scalar_mul(scalara, scalarb, scalartype);
+		dot = xm_scalar_add(dot, scalara, scalartype);
 	}
 	free(buf1);
 	free(buf2);
 	free(buf3);
 }
+	xm_work_destroy(work);
 #ifdef XM_USE_MPI
 	MPI_Allreduce(MPI_IN_PLACE, &dot, 1, MPI_DOUBLE_COMPLEX, MPI_SUM,
 	    MPI_COMM_WORLD);
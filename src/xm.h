@@ -118,7 +118,9 @@ xm_scalar_t xm_dot(const xm_tensor_t *a, const xm_tensor_t *b,
  *  symmetry and sparsity information obtained from tensors' block-structures.
  *  Tensors must be setup beforehand so that they have correct symmetries.
  *  This function does not change the original block-structure of the output
- *  tensor.
+ *  tensor. Indices that appear in all three tensors are batch indices: a
+ *  separate contraction is done for each of their values, for example
+ *  c_ijk = a_ijab * b_jkab for each j.
  *  \param alpha Scalar factor.
  *  \param a First tensor.
  *  \param b Second tensor.
@@ -136,6 +138,370 @@ void xm_contract(xm_scalar_t alpha, const xm_tensor_t *a, const xm_tensor_t *b,
     xm_scalar_t beta, xm_tensor_t *c, const char *idxa, const char *idxb,
     const char *idxc);
 
+/** Function applied to the output blocks of ::xm_contract_epilogue. It can
+ *  be called concurrently from several threads.
+ *  \param c Output tensor.
+ *  \param blkidx Index of the canonical block.
+ *  \param buf Block data in the layout returned by ::xm_tensor_read_block.
+ *         The function can modify the data in place.
+ *  \param scratch Buffer of the calling thread with room for two blocks
+ *         of \p c. Its contents are not kept between calls.
+ *  \param data User data passed to ::xm_contract_epilogue. */
+typedef void (*xm_epilogue_t)(const xm_tensor_t *c, xm_dim_t blkidx,
+    void *buf, void *scratch, void *data);
+
+/** Contract tensors like ::xm_contract and apply a function to each
+ *  computed block of \p c before it is written. Element-wise operations on
+ *  the result thus need no separate pass over \p c. The function receives
+ *  the final block data (alpha * a * b + beta * c) of canonical blocks
+ *  only. Derivative blocks follow their source blocks, so the function must
+ *  preserve the symmetry of \p c. Built-in functions are
+ *  ::xm_epilogue_scale, ::xm_epilogue_divide, ::xm_epilogue_clip and
+ *  ::xm_epilogue_norm2.
+ *  \param alpha Scalar factor.
+ *  \param a First tensor.
+ *  \param b Second tensor.
+ *  \param beta Scalar factor.
+ *  \param c Output tensor.
+ *  \param idxa Indices of \p a.
+ *  \param idxb Indices of \p b.
+ *  \param idxc Indices of \p c.
+ *  \param fn Function applied to output blocks.
+ *  \param data User data passed to the function.
+ *
+ *  \code
+ *  Example: xm_contract_epilogue(1.0, a, b, 0.0, c, "abcd", "ijcd", "ijab",
+ *               xm_epilogue_divide, denom);
+ *           c_ijab = a_abcd * b_ijcd / denom_ijab
+ *  \endcode */
+void xm_contract_epilogue(xm_scalar_t alpha, const xm_tensor_t *a,
+    const xm_tensor_t *b, xm_scalar_t beta, xm_tensor_t *c, const char *idxa,
+    const char *idxb, const char *idxc, xm_epilogue_t fn, void *data);
+
+/** Epilogue that multiplies output blocks by a scalar.
+ *  \p data points to an ::xm_scalar_t. See ::xm_epilogue_t. */
+void xm_epilogue_scale(const xm_tensor_t *c, xm_dim_t blkidx, void *buf,
+    void *scratch, void *data);
+
+/** Epilogue that divides output blocks element-wise by the same blocks of
+ *  another tensor. \p data points to an ::xm_tensor_t with the same block
+ *  space and scalar type as the output tensor, for example a generated
+ *  tensor (see ::xm_tensor_create_generated). See ::xm_epilogue_t. */
+void xm_epilogue_divide(const xm_tensor_t *c, xm_dim_t blkidx, void *buf,
+    void *scratch, void *data);
+
+/** Epilogue that limits the absolute value of output elements.
+ *  \p data points to a double with the limit. See ::xm_scalar_clip and
+ *  ::xm_epilogue_t. */
+void xm_epilogue_clip(const xm_tensor_t *c, xm_dim_t blkidx, void *buf,
+    void *scratch, void *data);
+
+/** Epilogue that adds the squared Frobenius norms of output blocks to a
+ *  double pointed to by \p data. Only canonical blocks are counted. When
+ *  using MPI each process counts the blocks it computed, so the sums must
+ *  be added up by the caller. See ::xm_epilogue_t. */
+void xm_epilogue_norm2(const xm_tensor_t *c, xm_dim_t blkidx, void *buf,
+    void *scratch, void *data);
+
+/** Term of a multi-term contraction. See ::xm_contract_multi. */
+typedef struct {
+	xm_scalar_t alpha; /**< Scalar factor of the term. */
+	const xm_tensor_t *a; /**< First tensor. */
+	const xm_tensor_t *b; /**< Second tensor. */
+	const char *idxa; /**< Indices of \p a. */
+	const char *idxb; /**< Indices of \p b. */
+	const char *idxc; /**< Indices of the output tensor. */
+} xm_contract_term_t;
+
+/** Accumulate several contractions into the same tensor
+ *  (c = sum_t alpha_t * a_t * b_t + beta * c). Each term has the same meaning
+ *  as the arguments of ::xm_contract. Each block of \p c is read once, all
+ *  terms are accumulated in memory and the block is written once, so the
+ *  output tensor is traversed a single time regardless of the number of
+ *  terms. The output tensor must not be an operand of any term.
+ *  \param terms Array of contraction terms.
+ *  \param nterms Number of terms. Must be at least one.
+ *  \param beta Scalar factor.
+ *  \param c Output tensor.
+ *
+ *  \code
+ *  Example: xm_contract_term_t terms[] = {
+ *               { 1.0, a, b, "abcd", "ijcd", "ijab" },
+ *               { 0.5, d, e, "ia", "jb", "ijab" } };
+ *           xm_contract_multi(terms, 2, 1.0, c);
+ *           c_ijab = a_abcd * b_ijcd + 0.5 * d_ia * e_jb + c_ijab
+ *  \endcode */
+void xm_contract_multi(const xm_contract_term_t *terms, size_t nterms,
+    xm_scalar_t beta, xm_tensor_t *c);
+
+/** Compute the dot product of tensor \p d with the contraction of \p a and
+ *  \p b without storing the contraction result (sum d * (a * b)). The
+ *  arguments have the same meaning as the arguments of ::xm_contract with
+ *  \p d in place of the output tensor. Each block of the contraction result
+ *  that corresponds to a non-zero block of \p d is computed in memory and
+ *  immediately multiplied by that block. When using MPI all processes
+ *  receive the same result.
+ *  \param a First tensor.
+ *  \param b Second tensor.
+ *  \param d Tensor the contraction result is multiplied by.
+ *  \param idxa Indices of \p a.
+ *  \param idxb Indices of \p b.
+ *  \param idxd Indices of \p d.
+ *  \return Dot product.
+ *
+ *  \code
+ *  Example: e = xm_contract_dot(a, b, d, "ijcd", "abcd", "ijab");
+ *           e = d_ijab * a_ijcd * b_abcd
+ *  \endcode */
+xm_scalar_t xm_contract_dot(const xm_tensor_t *a, const xm_tensor_t *b,
+    const xm_tensor_t *d, const char *idxa, const char *idxb,
+    const char *idxd);
+
+/** Create an output tensor for the contraction of \p a and \p b with only
+ *  the blocks that can receive a contribution from non-zero blocks of the
+ *  operands allocated. All other blocks are zero-blocks. Blocks of the
+ *  output related by an exchange of pairs of indices are made derivative
+ *  blocks if the derivative blocks of the operands imply the symmetry, or if
+ *  \p a and \p b are the same tensor and exchanging them gives the same
+ *  result. Blocks of the operands that map onto themselves under a symmetry
+ *  must hold data with the same symmetry. The new tensor uses the scalar
+ *  type and the allocator of \p a. Block data is not initialized, so the
+ *  tensor is normally used as \p c in ::xm_contract with zero \p beta.
+ *  \param a First tensor.
+ *  \param b Second tensor.
+ *  \param idxa Indices of \p a.
+ *  \param idxb Indices of \p b.
+ *  \param idxc Indices of the output tensor.
+ *  \return New tensor.
+ *
+ *  \code
+ *  Example: c = xm_contract_structure(t, t, "ik", "jk", "ij");
+ *           xm_contract(1.0, t, t, 0.0, c, "ik", "jk", "ij");
+ *           c_ij = t_ik * t_jk, only blocks with i <= j are computed
+ *  \endcode */
+xm_tensor_t *xm_contract_structure(const xm_tensor_t *a, const xm_tensor_t *b,
+    const char *idxa, const char *idxb, const char *idxc);
+
+/** Contract several tensors given by an einsum-style specification
+ *  (c = alpha * a_1 * a_2 * ... * a_n + beta * c). Operand indices are
+ *  separated by commas and followed by "->" and the indices of \p c. Each
+ *  index must appear in exactly two of the tensors, counting \p c. The
+ *  order of pairwise contractions is chosen to minimize the estimated
+ *  number of operations and bytes read and written, taking block sparsity
+ *  into account. Intermediates are allocated using the allocator of the
+ *  operands and are freed as soon as they are used. Each pairwise
+ *  contraction is performed using ::xm_contract.
+ *  \param spec Einsum specification.
+ *  \param alpha Scalar factor.
+ *  \param tensors Array of operands, one for each operand in \p spec.
+ *  \param beta Scalar factor.
+ *  \param c Output tensor.
+ *
+ *  \code
+ *  Example: const xm_tensor_t *t[] = { a, b, d };
+ *           xm_einsum("abij,cdab,ijkl->cdkl", 1.0, t, 0.0, c);
+ *           c_cdkl = a_abij * b_cdab * d_ijkl
+ *  \endcode */
+void xm_einsum(const char *spec, xm_scalar_t alpha,
+    const xm_tensor_t **tensors, xm_scalar_t beta, xm_tensor_t *c);
+
+/** Set screening threshold for ::xm_contract. A pair of blocks of \p a and
+ *  \p b is skipped if the product of the absolute value of \p alpha and the
+ *  norms of the two blocks (see ::xm_tensor_get_block_norm) is below the
+ *  threshold. The default threshold is zero which disables screening.
+ *  When using MPI all processes must set the same threshold.
+ *  \param threshold Screening threshold. */
+void xm_contract_set_threshold(double threshold);
+
+/** Return screening threshold for ::xm_contract.
+ *  \return Current screening threshold. */
+double xm_contract_get_threshold(void);
+
+/** Set the amount of memory ::xm_contract may use in each process to keep
+ *  unfolded blocks of \p a or \p b in memory. Unfolded blocks are kept in a
+ *  cache shared by all threads, so a block needed by several output blocks
+ *  is read and unfolded only once while it stays in the cache. Output blocks
+ *  are grouped into tiles that share a row of blocks of one of the operands,
+ *  and that row is held in the cache for the whole tile. The operand kept in
+ *  memory is chosen to minimize the amount of data read. Each thread works
+ *  on its own tile, so a row must fit into the limit divided by the number
+ *  of threads. Otherwise every output block reads its own operand blocks.
+ *  The default limit is 256 MiB. When using MPI all processes must set the
+ *  same limit.
+ *  \param bytes Memory limit in bytes. */
+void xm_contract_set_memory_limit(size_t bytes);
+
+/** Return the memory limit of ::xm_contract.
+ *  \return Memory limit in bytes. */
+size_t xm_contract_get_memory_limit(void);
+
+/** Enable or disable stacking of blocks along the contraction dimension in
+ *  ::xm_contract. When enabled, all contributing blocks of \p a and \p b for
+ *  an output block are unfolded into two panels and multiplied with a single
+ *  GEMM call instead of one call per pair of blocks. Panels that exceed
+ *  8 MiB or the limit set by ::xm_contract_set_memory_limit, whichever is
+ *  smaller, are split into several GEMM calls. This is enabled by default.
+ *  \param enable Non-zero to enable stacking. */
+void xm_contract_set_concat_k(int enable);
+
+/** Return non-zero if stacking of blocks in ::xm_contract is enabled.
+ *  \return Non-zero if stacking is enabled. */
+int xm_contract_get_concat_k(void);
+
+/** Enable or disable adaptive threading in ::xm_contract. When enabled and
+ *  there are fewer output tiles than OpenMP threads, the spare threads are
+ *  passed to BLAS for each GEMM call instead of staying idle. This only has
+ *  effect if libxm is built with a threaded BLAS and \c -DXM_BLAS_MKL or
+ *  \c -DXM_BLAS_OPENBLAS. This is enabled by default.
+ *  \param enable Non-zero to enable adaptive threading. */
+void xm_contract_set_adaptive_threads(int enable);
+
+/** Return non-zero if adaptive threading in ::xm_contract is enabled.
+ *  \return Non-zero if adaptive threading is enabled. */
+int xm_contract_get_adaptive_threads(void);
+
+/** Precision of GEMM calls in ::xm_contract on double and double complex
+ *  tensors. Tensors of single precision types are not affected. */
+typedef enum {
+	/** GEMMs are done in the precision of the tensors. */
+	XM_PRECISION_FULL = 0,
+	/** GEMMs are done in single precision. Operands are rounded to
+	 *  single precision and each product is added to the output block
+	 *  in double precision. */
+	XM_PRECISION_MIXED,
+	/** Same as ::XM_PRECISION_MIXED except that the largest contributions
+	 *  to each output block are computed in double precision. A pair of
+	 *  blocks is multiplied in double precision if its norm bound (see
+	 *  ::xm_contract_set_threshold) is within a factor of 4096 of the
+	 *  largest bound for the output block. */
+	XM_PRECISION_MIXED_ADAPTIVE,
+} xm_precision_t;
+
+/** Set precision of GEMM calls in ::xm_contract. The default is
+ *  ::XM_PRECISION_FULL.
+ *  \param precision Precision mode. */
+void xm_contract_set_precision(xm_precision_t precision);
+
+/** Return precision of GEMM calls in ::xm_contract.
+ *  \return Precision mode. */
+xm_precision_t xm_contract_get_precision(void);
+
+/** Estimated cost of an operation. The byte counts include all blocks read
+ *  and written through the allocator and account for zero-blocks,
+ *  derivative blocks and blocks shared through the operand cache. */
+typedef struct {
+	/** Floating-point operations. A complex multiply-add counts as 8. */
+	double flops;
+	/** Bytes read from tensors. */
+	size_t bytes_read;
+	/** Bytes written to tensors. */
+	size_t bytes_written;
+	/** Peak size of buffers of a single process in bytes. */
+	size_t peak_memory;
+	/** Number of GEMM calls. */
+	size_t ngemm;
+} xm_cost_t;
+
+/** Estimate the cost of ::xm_contract with the same arguments without
+ *  reading or writing any data. The estimate follows the same tiling of
+ *  output blocks and the same handling of blocks as ::xm_contract with the
+ *  current threshold, memory limit and stacking settings. The totals are
+ *  for all processes.
+ *  Tiles of output blocks are assumed to be distributed between processes
+ *  statically by their estimated cost. When processes take tiles from a
+ *  shared counter instead (see README), each process may get different
+ *  tiles. Bytes read through the operand cache and the peak memory of a
+ *  process depend on the distribution and are only approximate then.
+ *  When using MPI this function must be called by all processes.
+ *  \return Estimated cost. */
+xm_cost_t xm_contract_estimate(xm_scalar_t alpha, const xm_tensor_t *a,
+    const xm_tensor_t *b, xm_scalar_t beta, const xm_tensor_t *c,
+    const char *idxa, const char *idxb, const char *idxc);
+
+/** Estimate the cost of ::xm_copy with the same arguments without reading
+ *  or writing any data.
+ *  \return Estimated cost. */
+xm_cost_t xm_copy_estimate(const xm_tensor_t *a, xm_scalar_t s,
+    const xm_tensor_t *b, const char *idxa, const char *idxb);
+
+/** Estimate the cost of ::xm_add with the same arguments without reading
+ *  or writing any data.
+ *  \return Estimated cost. */
+xm_cost_t xm_add_estimate(xm_scalar_t alpha, const xm_tensor_t *a,
+    xm_scalar_t beta, const xm_tensor_t *b, const char *idxa,
+    const char *idxb);
+
+/** Opaque structure of deferred element-wise tensor operations. */
+typedef struct xm_expr xm_expr_t;
+
+/** Create an empty element-wise expression with output tensor \p a.
+ *  Operations recorded in the expression are not performed until
+ *  ::xm_expr_eval is called. Evaluation makes a single pass over the blocks
+ *  of \p a reading each input block at most once and writing each output
+ *  block once. The result is the same as applying the corresponding tensor
+ *  operations to \p a one after another. This does not change the
+ *  block-structure of the output tensor.
+ *  \param a Output tensor.
+ *  \param idxa Indices of \p a.
+ *  \return New expression instance.
+ *
+ *  \code
+ *  Example: expr = xm_expr_create(a, "ij");
+ *           xm_expr_copy(expr, 2.0, b, "ji");
+ *           xm_expr_mul(expr, c, "ij");
+ *           xm_expr_eval(expr);
+ *           a_ij = 2 * b_ji * c_ij
+ *  \endcode */
+xm_expr_t *xm_expr_create(xm_tensor_t *a, const char *idxa);
+
+/** Record setting all elements of the output tensor to the same value
+ *  (see ::xm_set).
+ *  \param expr Expression.
+ *  \param x Scalar value. */
+void xm_expr_set(xm_expr_t *expr, xm_scalar_t x);
+
+/** Record copying of a scaled tensor into the output tensor (see ::xm_copy).
+ *  \param expr Expression.
+ *  \param s Scaling factor.
+ *  \param b Input tensor.
+ *  \param idxb Indices of \p b. */
+void xm_expr_copy(xm_expr_t *expr, xm_scalar_t s, const xm_tensor_t *b,
+    const char *idxb);
+
+/** Record tensor addition (a = alpha * a + beta * b) (see ::xm_add).
+ *  \param expr Expression.
+ *  \param alpha Scalar factor.
+ *  \param beta Scalar factor.
+ *  \param b Input tensor.
+ *  \param idxb Indices of \p b. */
+void xm_expr_add(xm_expr_t *expr, xm_scalar_t alpha, xm_scalar_t beta,
+    const xm_tensor_t *b, const char *idxb);
+
+/** Record element-wise multiplication of the output tensor by a tensor
+ *  (see ::xm_mul).
+ *  \param expr Expression.
+ *  \param b Input tensor.
+ *  \param idxb Indices of \p b. */
+void xm_expr_mul(xm_expr_t *expr, const xm_tensor_t *b, const char *idxb);
+
+/** Record element-wise division of the output tensor by a tensor
+ *  (see ::xm_div).
+ *  \param expr Expression.
+ *  \param b Input tensor.
+ *  \param idxb Indices of \p b. */
+void xm_expr_div(xm_expr_t *expr, const xm_tensor_t *b, const char *idxb);
+
+/** Evaluate all recorded operations in a single pass and clear the list of
+ *  operations. Input tensors must have the same scalar type and allocator as
+ *  the output tensor and must be different from it.
+ *  \param expr Expression. */
+void xm_expr_eval(xm_expr_t *expr);
+
+/** Release resources associated with an expression. Recorded operations that
+ *  were not evaluated are discarded.
+ *  \param expr Expression. */
+void xm_expr_free(xm_expr_t *expr);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
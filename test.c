@@ -132,7 +132,7 @@ fill_random(xm_tensor_t *t)
 }
 
 static void
-compare_tensors(xm_tensor_t *t, xm_tensor_t *u)
+compare_tensors_as(xm_tensor_t *t, xm_tensor_t *u, xm_scalar_type_t type)
 {
 	xm_dim_t idx, dimst, dimsu;
 
@@ -143,12 +143,88 @@ compare_tensors(xm_tensor_t *t, xm_tensor_t *u)
 	while (xm_dim_ne(&idx, &dimst)) {
 		xm_scalar_t et = xm_tensor_get_element(t, idx);
 		xm_scalar_t eu = xm_tensor_get_element(u, idx);
-		if (!scalar_eq(et, eu, xm_tensor_get_scalar_type(t)))
+		if (!scalar_eq(et, eu, type))
 			fatal("tensors do not match");
 		xm_dim_inc(&idx, &dimst);
 	}
 }
 
+static void
+compare_tensors(xm_tensor_t *t, xm_tensor_t *u)
+{
+	compare_tensors_as(t, u, xm_tensor_get_scalar_type(t));
+}
+
+/* Compare tensors of the same structure block by block.  This is much
+ * faster than compare_tensors for large tensors. */
+static void
+compare_blocks(xm_tensor_t *t, xm_tensor_t *u)
+{
+	xm_dim_t *blklist;
+	xm_scalar_type_t type;
+	size_t i, j, nblklist, blksize;
+	void *buft, *bufu;
+
+	type = xm_tensor_get_scalar_type(t);
+	buft = malloc(xm_tensor_get_largest_block_bytes(t));
+	assert(buft);
+	bufu = malloc(xm_tensor_get_largest_block_bytes(t));
+	assert(bufu);
+	xm_tensor_get_canonical_block_list(t, &blklist, &nblklist);
+	for (i = 0; i < nblklist; i++) {
+		blksize = xm_tensor_get_block_size(t, blklist[i]);
+		xm_tensor_read_block(t, blklist[i], buft);
+		xm_tensor_read_block(u, blklist[i], bufu);
+		for (j = 0; j < blksize; j++)
+			if (!scalar_eq(xm_scalar_get_element(buft, j, type),
+			    xm_scalar_get_element(bufu, j, type), type))
+				fatal("tensors do not match");
+	}
+	free(blklist);
+	free(buft);
+	free(bufu);
+}
+
+struct generator_data {
+	const xm_block_space_t *bs;
+	xm_scalar_type_t type;
+	size_t ncalls;
+};
+
+static void
+generate_block(xm_dim_t blkidx, void *buf, void *data)
+{
+	struct generator_data *gd = data;
+	xm_dim_t nblocks;
+	size_t i, off, blksize;
+
+	nblocks = xm_block_space_get_nblocks(gd->bs);
+	off = xm_dim_offset(&blkidx, &nblocks);
+	blksize = xm_block_space_get_block_size(gd->bs, blkidx);
+	/* values are kept away from zero for use as denominators */
+	for (i = 0; i < blksize; i++) {
+		double x = 2 + sin((double)(off * 31 + i));
+		switch (gd->type) {
+		case XM_SCALAR_FLOAT:
+			((float *)buf)[i] = x;
+			break;
+		case XM_SCALAR_FLOAT_COMPLEX:
+			((float complex *)buf)[i] = x + x * x * I;
+			break;
+		case XM_SCALAR_DOUBLE:
+			((double *)buf)[i] = x;
+			break;
+		case XM_SCALAR_DOUBLE_COMPLEX:
+			((double complex *)buf)[i] = x + x * x * I;
+			break;
+		}
+	}
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+	gd->ncalls++;
+}
+
 static void
 check_add(xm_tensor_t *aa, xm_scalar_t alpha, xm_tensor_t *a, xm_scalar_t beta,
     xm_tensor_t *b, const char *idxa, const char *idxb)
@@ -248,11 +324,20 @@ check_contract(xm_tensor_t *cc, xm_scalar_t alpha, xm_tensor_t *a,
 	xm_dim_t absdimsa, absdimsb, absdimsc, ia, ib, ic;
 	xm_dim_t cidxa, aidxa, cidxb, aidxb, cidxc, aidxc;
 	xm_scalar_t ref, ecc;
-	size_t k, nk;
+	size_t i, j, k, nk;
 
 	xm_make_masks(idxa, idxb, &cidxa, &cidxb);
 	xm_make_masks(idxc, idxa, &cidxc, &aidxa);
 	xm_make_masks(idxc, idxb, &aidxc, &aidxb);
+	/* batch indices also appear in c and are not summed over */
+	for (i = j = 0; i < cidxa.n; i++) {
+		if (strchr(idxc, idxa[cidxa.i[i]]) == NULL) {
+			cidxa.i[j] = cidxa.i[i];
+			cidxb.i[j] = cidxb.i[i];
+			j++;
+		}
+	}
+	cidxa.n = cidxb.n = j;
 	absdimsa = xm_tensor_get_abs_dims(a);
 	absdimsb = xm_tensor_get_abs_dims(b);
 	absdimsc = xm_tensor_get_abs_dims(c);
@@ -332,6 +417,54 @@ test_mul(const struct two_tensor_test *test, const char *path,
 	xm_allocator_destroy(allocator);
 }
 
+static void
+test_expr(const struct two_tensor_test *test, const char *path,
+    xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_tensor_t *a, *b, *u, *v;
+	xm_expr_t *expr;
+
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	test->make_ab(allocator, &a, &b, type);
+	assert(a);
+	assert(b);
+	fill_random(a);
+	fill_random(b);
+	u = xm_tensor_create_structure(a, type, allocator);
+	v = xm_tensor_create_structure(a, type, allocator);
+	xm_copy(u, 2, a, test->idxa, test->idxa);
+	xm_add(0.5, u, -1, b, test->idxa, test->idxb);
+	xm_mul(u, a, test->idxa, test->idxa);
+	xm_add(1, u, 3, b, test->idxa, test->idxb);
+	expr = xm_expr_create(v, test->idxa);
+	assert(expr);
+	xm_expr_copy(expr, 2, a, test->idxa);
+	xm_expr_add(expr, 0.5, -1, b, test->idxb);
+	xm_expr_mul(expr, a, test->idxa);
+	xm_expr_add(expr, 1, 3, b, test->idxb);
+	xm_expr_eval(expr);
+	compare_tensors(u, v);
+#ifdef XM_USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+	xm_div(u, a, test->idxa, test->idxa);
+	xm_expr_div(expr, a, test->idxa);
+	xm_expr_eval(expr);
+	compare_tensors(u, v);
+	xm_expr_free(expr);
+	xm_tensor_free_block_data(a);
+	xm_tensor_free_block_data(b);
+	xm_tensor_free_block_data(u);
+	xm_tensor_free_block_data(v);
+	xm_tensor_free(a);
+	xm_tensor_free(b);
+	xm_tensor_free(u);
+	xm_tensor_free(v);
+	xm_allocator_destroy(allocator);
+}
+
 static void
 test_div(const struct two_tensor_test *test, const char *path,
     xm_scalar_type_t type)
@@ -407,11 +540,591 @@ test_contract(const struct contract_test *test, const char *path,
 	xm_tensor_free_block_data(a);
 	xm_tensor_free_block_data(b);
 	xm_tensor_free_block_data(c);
-	xm_tensor_free_block_data(cc);
+	xm_tensor_free_block_data(cc);
+	xm_tensor_free(a);
+	xm_tensor_free(b);
+	xm_tensor_free(c);
+	xm_tensor_free(cc);
+	xm_allocator_destroy(allocator);
+}
+
+static void
+test_contract_dot(const struct contract_test *test, const char *path,
+    xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_tensor_t *a, *b, *c, *cc, *d;
+	xm_scalar_t res;
+
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	test->make_abc(allocator, &a, &b, &c, type);
+	assert(a);
+	assert(b);
+	assert(c);
+	fill_random(a);
+	fill_random(b);
+	d = xm_tensor_create_structure(c, type, allocator);
+	fill_random(d);
+	/* the reference contraction result has no symmetry imposed */
+	cc = xm_tensor_create_canonical(xm_tensor_get_block_space(c), type,
+	    allocator);
+	xm_contract(1, a, b, 0, cc, test->idxa, test->idxb, test->idxc);
+	res = xm_contract_dot(a, b, d, test->idxa, test->idxb, test->idxc);
+	check_dot(res, d, cc, test->idxc, test->idxc);
+	xm_tensor_free_block_data(a);
+	xm_tensor_free_block_data(b);
+	xm_tensor_free_block_data(c);
+	xm_tensor_free_block_data(cc);
+	xm_tensor_free_block_data(d);
+	xm_tensor_free(a);
+	xm_tensor_free(b);
+	xm_tensor_free(c);
+	xm_tensor_free(cc);
+	xm_tensor_free(d);
+	xm_allocator_destroy(allocator);
+}
+
+static void
+test_contract_mixed(const struct contract_test *test, const char *path,
+    xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_tensor_t *a, *b, *c, *cc, *ref;
+	xm_scalar_type_t stype = type;
+	xm_scalar_t alpha = random_scalar(type);
+	xm_scalar_t beta = random_scalar(type);
+	int i;
+
+	if (type == XM_SCALAR_DOUBLE)
+		stype = XM_SCALAR_FLOAT;
+	if (type == XM_SCALAR_DOUBLE_COMPLEX)
+		stype = XM_SCALAR_FLOAT_COMPLEX;
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	test->make_abc(allocator, &a, &b, &c, type);
+	assert(a);
+	assert(b);
+	assert(c);
+	fill_random(a);
+	fill_random(b);
+	fill_random(c);
+	cc = xm_tensor_create_structure(c, type, allocator);
+	ref = xm_tensor_create_structure(c, type, allocator);
+	xm_copy(ref, 1, c, test->idxc, test->idxc);
+	xm_contract(alpha, a, b, beta, ref, test->idxa, test->idxb,
+	    test->idxc);
+	for (i = XM_PRECISION_MIXED; i <= XM_PRECISION_MIXED_ADAPTIVE; i++) {
+		xm_copy(cc, 1, c, test->idxc, test->idxc);
+		xm_contract_set_precision((xm_precision_t)i);
+		xm_contract(alpha, a, b, beta, cc, test->idxa, test->idxb,
+		    test->idxc);
+		xm_contract_set_precision(XM_PRECISION_FULL);
+		/* results of double tensors match to single precision */
+		compare_tensors_as(ref, cc, stype);
+#ifdef XM_USE_MPI
+		MPI_Barrier(MPI_COMM_WORLD);
+#endif
+	}
+	xm_tensor_free_block_data(a);
+	xm_tensor_free_block_data(b);
+	xm_tensor_free_block_data(c);
+	xm_tensor_free_block_data(cc);
+	xm_tensor_free_block_data(ref);
+	xm_tensor_free(a);
+	xm_tensor_free(b);
+	xm_tensor_free(c);
+	xm_tensor_free(cc);
+	xm_tensor_free(ref);
+	xm_allocator_destroy(allocator);
+}
+
+static void
+test_contract_multi(const struct contract_test *test, const char *path,
+    xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_tensor_t *a, *b, *c, *cc;
+	xm_contract_term_t terms[3];
+	xm_scalar_t beta = random_scalar(type);
+	size_t i;
+
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	test->make_abc(allocator, &a, &b, &c, type);
+	assert(a);
+	assert(b);
+	assert(c);
+	fill_random(a);
+	fill_random(b);
+	fill_random(c);
+	cc = xm_tensor_create_structure(c, type, allocator);
+	xm_copy(cc, 1, c, test->idxc, test->idxc);
+	/* the second term has a different layout of the output block */
+	for (i = 0; i < 3; i++) {
+		terms[i].alpha = random_scalar(type);
+		terms[i].a = i == 1 ? b : a;
+		terms[i].b = i == 1 ? a : b;
+		terms[i].idxa = i == 1 ? test->idxb : test->idxa;
+		terms[i].idxb = i == 1 ? test->idxa : test->idxb;
+		terms[i].idxc = test->idxc;
+	}
+	xm_contract_multi(terms, 3, beta, cc);
+	for (i = 0; i < 3; i++)
+		xm_contract(terms[i].alpha, terms[i].a, terms[i].b,
+		    i == 0 ? beta : 1, c, terms[i].idxa, terms[i].idxb,
+		    terms[i].idxc);
+	compare_tensors(c, cc);
+	xm_tensor_free_block_data(a);
+	xm_tensor_free_block_data(b);
+	xm_tensor_free_block_data(c);
+	xm_tensor_free_block_data(cc);
+	xm_tensor_free(a);
+	xm_tensor_free(b);
+	xm_tensor_free(c);
+	xm_tensor_free(cc);
+	xm_allocator_destroy(allocator);
+}
+
+static xm_tensor_t *
+make_einsum_tensor(xm_allocator_t *allocator, xm_dim_t dims, xm_dim_t split,
+    xm_scalar_type_t type, size_t zero)
+{
+	xm_block_space_t *bs;
+	xm_tensor_t *t;
+	xm_dim_t idx, nblocks;
+	size_t i;
+
+	bs = xm_block_space_create(dims);
+	for (i = 0; i < dims.n; i++)
+		xm_block_space_split(bs, i, split.i[i]);
+	t = xm_tensor_create(bs, type, allocator);
+	xm_block_space_free(bs);
+	nblocks = xm_tensor_get_nblocks(t);
+	idx = xm_dim_zero(nblocks.n);
+	for (i = 0; xm_dim_ne(&idx, &nblocks); i++) {
+		if (i != zero)
+			xm_tensor_set_canonical_block(t, idx);
+		xm_dim_inc(&idx, &nblocks);
+	}
+	return t;
+}
+
+static void
+test_einsum(const char *path, xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_tensor_t *a, *b, *c, *d, *t, *u, *v;
+	const xm_tensor_t *tensors[3];
+	xm_scalar_t alpha, beta;
+
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	a = make_einsum_tensor(allocator, xm_dim_2(8, 4), xm_dim_2(4, 2),
+	    type, 1);
+	b = make_einsum_tensor(allocator, xm_dim_2(4, 8), xm_dim_2(2, 4),
+	    type, 2);
+	d = make_einsum_tensor(allocator, xm_dim_2(8, 4), xm_dim_2(4, 2),
+	    type, 9);
+	c = make_einsum_tensor(allocator, xm_dim_2(8, 4), xm_dim_2(4, 2),
+	    type, 9);
+	t = make_einsum_tensor(allocator, xm_dim_2(8, 8), xm_dim_2(4, 4),
+	    type, 9);
+	fill_random(a);
+	fill_random(b);
+	fill_random(c);
+	fill_random(d);
+	alpha = random_scalar(type);
+	beta = random_scalar(type);
+	u = xm_tensor_create_structure(c, type, allocator);
+	v = xm_tensor_create_structure(c, type, allocator);
+	xm_copy(u, 1, c, "il", "il");
+	xm_copy(v, 1, c, "il", "il");
+	xm_contract(1, a, b, 0, t, "ij", "jk", "ik");
+	xm_contract(alpha, t, d, beta, u, "ik", "kl", "il");
+	tensors[0] = b;
+	tensors[1] = a;
+	tensors[2] = d;
+	xm_einsum("jk,ij,kl->il", alpha, tensors, beta, v);
+	compare_tensors(u, v);
+#ifdef XM_USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+	xm_copy(u, 1, c, "il", "il");
+	xm_copy(v, 1, c, "il", "il");
+	xm_add(beta, u, alpha, b, "il", "li");
+	xm_einsum("li->il", alpha, tensors, beta, v);
+	compare_tensors(u, v);
+	xm_tensor_free_block_data(a);
+	xm_tensor_free_block_data(b);
+	xm_tensor_free_block_data(c);
+	xm_tensor_free_block_data(d);
+	xm_tensor_free_block_data(t);
+	xm_tensor_free_block_data(u);
+	xm_tensor_free_block_data(v);
+	xm_tensor_free(a);
+	xm_tensor_free(b);
+	xm_tensor_free(c);
+	xm_tensor_free(d);
+	xm_tensor_free(t);
+	xm_tensor_free(u);
+	xm_tensor_free(v);
+	xm_allocator_destroy(allocator);
+}
+
+/* Contract into a tensor created by xm_contract_structure and into a
+ * tensor with all blocks canonical and compare the results. */
+static xm_tensor_t *
+check_structure(const xm_tensor_t *a, const xm_tensor_t *b, const char *idxa,
+    const char *idxb, const char *idxc)
+{
+	xm_tensor_t *c, *d;
+	xm_scalar_type_t type;
+	xm_scalar_t alpha;
+
+	type = xm_tensor_get_scalar_type(a);
+	alpha = random_scalar(type);
+	c = xm_contract_structure(a, b, idxa, idxb, idxc);
+	assert(c);
+	d = xm_tensor_create_canonical(xm_tensor_get_block_space(c), type,
+	    xm_tensor_get_allocator(a));
+	xm_contract(alpha, a, b, 0, c, idxa, idxb, idxc);
+	xm_contract(alpha, a, b, 0, d, idxa, idxb, idxc);
+	compare_tensors(c, d);
+	xm_tensor_free_block_data(d);
+	xm_tensor_free(d);
+	return c;
+}
+
+static void
+test_contract_structure(const char *path, xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_block_space_t *bs;
+	xm_tensor_t *a, *b, *c;
+	size_t k;
+
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+
+	/* c_ij = t_ik t_jk is symmetric */
+	bs = xm_block_space_create(xm_dim_2(7, 5));
+	assert(bs);
+	xm_block_space_split(bs, 0, 3);
+	xm_block_space_split(bs, 1, 2);
+	a = xm_tensor_create(bs, type, allocator);
+	assert(a);
+	xm_block_space_free(bs);
+	xm_tensor_set_canonical_block(a, xm_dim_2(0, 0));
+	xm_tensor_set_canonical_block(a, xm_dim_2(0, 1));
+	xm_tensor_set_canonical_block(a, xm_dim_2(1, 1));
+	fill_random(a);
+	c = check_structure(a, a, "ik", "jk", "ij");
+	if (xm_tensor_get_block_type(c, xm_dim_2(1, 0)) !=
+	    XM_BLOCK_TYPE_CANONICAL ||
+	    xm_tensor_get_block_type(c, xm_dim_2(0, 1)) !=
+	    XM_BLOCK_TYPE_DERIVATIVE)
+		fatal("unexpected block type");
+	xm_tensor_free_block_data(c);
+	xm_tensor_free(c);
+
+	/* c_iajb = t_ia t_jb is symmetric under exchange of ia and jb */
+	c = check_structure(a, a, "ia", "jb", "iajb");
+	if (xm_tensor_get_block_type(c, xm_dim_4(1, 0, 0, 0)) !=
+	    XM_BLOCK_TYPE_ZERO ||
+	    xm_tensor_get_block_type(c, xm_dim_4(0, 0, 1, 1)) !=
+	    XM_BLOCK_TYPE_DERIVATIVE)
+		fatal("unexpected block type");
+	xm_tensor_free_block_data(c);
+	xm_tensor_free(c);
+	xm_tensor_free_block_data(a);
+	xm_tensor_free(a);
+
+	/* c_abj = a_abk b_kj is antisymmetric in ab */
+	bs = xm_block_space_create(xm_dim_3(6, 6, 4));
+	assert(bs);
+	xm_block_space_split(bs, 0, 3);
+	xm_block_space_split(bs, 1, 3);
+	xm_block_space_split(bs, 2, 2);
+	a = xm_tensor_create(bs, type, allocator);
+	assert(a);
+	xm_block_space_free(bs);
+	for (k = 0; k < 2; k++)
+		xm_tensor_set_canonical_block(a, xm_dim_3(0, 1, k));
+	for (k = 0; k < 2; k++)
+		xm_tensor_set_derivative_block(a, xm_dim_3(1, 0, k),
+		    xm_dim_3(0, 1, k), xm_dim_3(1, 0, 2), -1);
+	fill_random(a);
+	bs = xm_block_space_create(xm_dim_2(4, 5));
+	assert(bs);
+	xm_block_space_split(bs, 0, 2);
+	b = xm_tensor_create(bs, type, allocator);
+	assert(b);
+	xm_block_space_free(bs);
+	xm_tensor_set_canonical_block(b, xm_dim_2(0, 0));
+	fill_random(b);
+	c = check_structure(a, b, "abk", "kj", "abj");
+	if (xm_tensor_get_block_type(c, xm_dim_3(0, 0, 0)) !=
+	    XM_BLOCK_TYPE_ZERO ||
+	    xm_tensor_get_block_type(c, xm_dim_3(1, 0, 0)) !=
+	    XM_BLOCK_TYPE_CANONICAL ||
+	    xm_tensor_get_block_type(c, xm_dim_3(0, 1, 0)) !=
+	    XM_BLOCK_TYPE_DERIVATIVE ||
+	    xm_tensor_get_block_scalar(c, xm_dim_3(0, 1, 0)) != -1)
+		fatal("unexpected block type");
+	xm_tensor_free_block_data(c);
+	xm_tensor_free(c);
+	xm_tensor_free_block_data(a);
+	xm_tensor_free(a);
+	xm_tensor_free_block_data(b);
+	xm_tensor_free(b);
+	xm_allocator_destroy(allocator);
+}
+
+/* User epilogue that forwards to a built-in one. */
+static void
+divide_epilogue(const xm_tensor_t *c, xm_dim_t blkidx, void *buf,
+    void *scratch, void *data)
+{
+	xm_epilogue_divide(c, blkidx, buf, scratch, data);
+}
+
+static void
+test_contract_epilogue(const char *path, xm_scalar_type_t type)
+{
+	struct generator_data gd;
+	xm_allocator_t *allocator;
+	xm_block_space_t *bs;
+	xm_tensor_t *a, *b, *c, *cc, *g;
+	xm_dim_t idx, dims;
+	xm_scalar_t alpha, scale, x;
+	double limit = 0.5, norm2 = 0, ref = 0;
+
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	bs = xm_block_space_create(xm_dim_2(6, 5));
+	assert(bs);
+	xm_block_space_split(bs, 0, 4);
+	xm_block_space_split(bs, 1, 2);
+	a = xm_tensor_create_canonical(bs, type, allocator);
+	assert(a);
+	xm_block_space_free(bs);
+	bs = xm_block_space_create(xm_dim_2(5, 7));
+	assert(bs);
+	xm_block_space_split(bs, 0, 2);
+	xm_block_space_split(bs, 1, 3);
+	b = xm_tensor_create_canonical(bs, type, allocator);
+	assert(b);
+	xm_block_space_free(bs);
+	fill_random(a);
+	fill_random(b);
+	c = xm_contract_structure(a, b, "ik", "kj", "ij");
+	cc = xm_contract_structure(a, b, "ik", "kj", "ij");
+	alpha = random_scalar(type);
+	xm_contract(alpha, a, b, 0, cc, "ik", "kj", "ij");
+
+	scale = random_scalar(type);
+	xm_contract_epilogue(alpha, a, b, 0, c, "ik", "kj", "ij",
+	    xm_epilogue_scale, &scale);
+	dims = xm_tensor_get_abs_dims(c);
+	idx = xm_dim_zero(dims.n);
+	while (xm_dim_ne(&idx, &dims)) {
+		x = xm_tensor_get_element(cc, idx);
+		if (!scalar_eq(xm_tensor_get_element(c, idx), scale * x, type))
+			fatal("result != reference");
+		ref += creal(x * conj(x));
+		xm_dim_inc(&idx, &dims);
+	}
+
+	gd.bs = xm_tensor_get_block_space(c);
+	gd.type = type;
+	gd.ncalls = 0;
+	g = xm_tensor_create_generated(gd.bs, type, allocator,
+	    generate_block, &gd, 0);
+	xm_tensor_set_canonical_block(g, xm_dim_2(0, 0));
+	xm_tensor_set_canonical_block(g, xm_dim_2(0, 1));
+	xm_tensor_set_canonical_block(g, xm_dim_2(1, 0));
+	xm_tensor_set_canonical_block(g, xm_dim_2(1, 1));
+	xm_contract_epilogue(alpha, a, b, 0, c, "ik", "kj", "ij",
+	    xm_epilogue_divide, g);
+	xm_div(cc, g, "ij", "ij");
+	compare_tensors(c, cc);
+	xm_contract_epilogue(alpha, a, b, 0, c, "ik", "kj", "ij",
+	    divide_epilogue, g);
+	compare_tensors(c, cc);
+
+	xm_contract_epilogue(alpha, a, b, 0, c, "ik", "kj", "ij",
+	    xm_epilogue_clip, &limit);
+	xm_contract(alpha, a, b, 0, cc, "ik", "kj", "ij");
+	idx = xm_dim_zero(dims.n);
+	while (xm_dim_ne(&idx, &dims)) {
+		x = xm_tensor_get_element(cc, idx);
+		if (cabs(x) > limit)
+			x *= limit / cabs(x);
+		if (!scalar_eq(xm_tensor_get_element(c, idx), x, type))
+			fatal("result != reference");
+		xm_dim_inc(&idx, &dims);
+	}
+
+	xm_contract_epilogue(alpha, a, b, 0, c, "ik", "kj", "ij",
+	    xm_epilogue_norm2, &norm2);
+#ifdef XM_USE_MPI
+	MPI_Allreduce(MPI_IN_PLACE, &norm2, 1, MPI_DOUBLE, MPI_SUM,
+	    MPI_COMM_WORLD);
+#endif
+	if (fabs(norm2 - ref) > 1.0e-4 * ref)
+		fatal("result != reference");
+	xm_tensor_free_block_data(a);
+	xm_tensor_free(a);
+	xm_tensor_free_block_data(b);
+	xm_tensor_free(b);
+	xm_tensor_free_block_data(c);
+	xm_tensor_free(c);
+	xm_tensor_free_block_data(cc);
+	xm_tensor_free(cc);
+	xm_tensor_free_block_data(g);
+	xm_tensor_free(g);
+	xm_allocator_destroy(allocator);
+}
+
+static void
+test_adaptive_threads(const char *path, xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_block_space_t *bs;
+	xm_tensor_t *a, *b, *c, *ref;
+	xm_scalar_t alpha, beta;
+	size_t i, n;
+
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	bs = xm_block_space_create(xm_dim_2(256, 256));
+	assert(bs);
+	b = xm_tensor_create_canonical(bs, type, allocator);
+	assert(b);
+	xm_block_space_free(bs);
+	fill_random(b);
+	/* output blocks are large enough for threaded BLAS and there are
+	 * fewer of them than threads */
+	for (n = 1; n <= 3; n++) {
+		bs = xm_block_space_create(xm_dim_2(256 * n, 256));
+		assert(bs);
+		for (i = 1; i < n; i++)
+			xm_block_space_split(bs, 0, 256 * i);
+		a = xm_tensor_create_canonical(bs, type, allocator);
+		assert(a);
+		c = xm_tensor_create_canonical(bs, type, allocator);
+		assert(c);
+		ref = xm_tensor_create_canonical(bs, type, allocator);
+		assert(ref);
+		xm_block_space_free(bs);
+		fill_random(a);
+		fill_random(c);
+		alpha = random_scalar(type);
+		beta = random_scalar(type);
+		xm_copy(ref, 1, c, "ij", "ij");
+		xm_contract_set_adaptive_threads(0);
+		xm_contract(alpha, a, b, beta, ref, "ik", "kj", "ij");
+		xm_contract_set_adaptive_threads(1);
+		xm_contract(alpha, a, b, beta, c, "ik", "kj", "ij");
+		compare_blocks(c, ref);
+#ifdef XM_USE_MPI
+		MPI_Barrier(MPI_COMM_WORLD);
+#endif
+		xm_tensor_free_block_data(a);
+		xm_tensor_free(a);
+		xm_tensor_free_block_data(c);
+		xm_tensor_free(c);
+		xm_tensor_free_block_data(ref);
+		xm_tensor_free(ref);
+	}
+	xm_tensor_free_block_data(b);
+	xm_tensor_free(b);
+	xm_allocator_destroy(allocator);
+}
+
+static void
+test_estimate(const char *path, xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_tensor_t *a, *b, *c;
+	xm_cost_t cost, ref;
+	xm_dim_t ia, ib, ic, dims, nblocks;
+	xm_scalar_t alpha, beta;
+	size_t j, m, n, k, fma, mul, el;
+
+	fma = type == XM_SCALAR_FLOAT || type == XM_SCALAR_DOUBLE ? 2 : 8;
+	mul = type == XM_SCALAR_FLOAT || type == XM_SCALAR_DOUBLE ? 1 : 6;
+	el = xm_scalar_sizeof(type);
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	a = make_einsum_tensor(allocator, xm_dim_2(8, 4), xm_dim_2(4, 2),
+	    type, 1);
+	b = make_einsum_tensor(allocator, xm_dim_2(4, 8), xm_dim_2(2, 4),
+	    type, 2);
+	c = make_einsum_tensor(allocator, xm_dim_2(8, 8), xm_dim_2(4, 4),
+	    type, 3);
+	alpha = random_scalar(type);
+	beta = random_scalar(type);
+	memset(&ref, 0, sizeof ref);
+	nblocks = xm_tensor_get_nblocks(c);
+	for (ic = xm_dim_zero(2); xm_dim_ne(&ic, &nblocks);
+	     xm_dim_inc(&ic, &nblocks)) {
+		if (xm_tensor_get_block_type(c, ic) == XM_BLOCK_TYPE_ZERO)
+			continue;
+		dims = xm_tensor_get_block_dims(c, ic);
+		m = dims.i[0];
+		n = dims.i[1];
+		ref.bytes_read += m * n * el;
+		ref.bytes_written += m * n * el;
+		ref.flops += (double)(m * n * mul);
+		for (j = 0; j < xm_tensor_get_nblocks(a).i[1]; j++) {
+			ia = xm_dim_2(ic.i[0], j);
+			ib = xm_dim_2(j, ic.i[1]);
+			if (xm_tensor_get_block_type(a, ia) ==
+			    XM_BLOCK_TYPE_ZERO ||
+			    xm_tensor_get_block_type(b, ib) ==
+			    XM_BLOCK_TYPE_ZERO)
+				continue;
+			k = xm_tensor_get_block_dims(a, ia).i[1];
+			ref.flops += (double)(m * n * k * fma);
+			ref.bytes_read += (m + n) * k * el;
+			ref.ngemm++;
+		}
+	}
+	/* without the operand cache and stacking every pair is read and
+	 * multiplied separately */
+	xm_contract_set_memory_limit(0);
+	xm_contract_set_concat_k(0);
+	cost = xm_contract_estimate(alpha, a, b, beta, c, "ij", "jk", "ik");
+	if (cost.flops != ref.flops || cost.bytes_read != ref.bytes_read ||
+	    cost.bytes_written != ref.bytes_written ||
+	    cost.ngemm != ref.ngemm)
+		fatal("unexpected contraction estimate");
+	xm_contract_set_memory_limit(256 * 1024 * 1024);
+	xm_contract_set_concat_k(1);
+	/* with several processes each rank may find nothing to reuse */
+	cost = xm_contract_estimate(alpha, a, b, beta, c, "ij", "jk", "ik");
+	if (cost.bytes_read > ref.bytes_read || cost.ngemm >= ref.ngemm ||
+	    cost.bytes_written != ref.bytes_written || cost.peak_memory == 0)
+		fatal("unexpected contraction estimate");
+	cost = xm_contract_estimate(0, a, b, 0, c, "ij", "jk", "ik");
+	if (cost.flops != 0 || cost.bytes_read != 0 || cost.ngemm != 0)
+		fatal("unexpected contraction estimate");
+	cost = xm_add_estimate(alpha, a, beta, a, "ij", "ij");
+	if (cost.bytes_read != 2 * cost.bytes_written ||
+	    cost.bytes_written != 3 * 8 * el)
+		fatal("unexpected add estimate");
+	cost = xm_copy_estimate(c, 1, c, "ij", "ji");
+	if (cost.bytes_read != 3 * 16 * el ||
+	    cost.bytes_written != 3 * 16 * el)
+		fatal("unexpected copy estimate");
+	xm_tensor_free_block_data(a);
+	xm_tensor_free_block_data(b);
+	xm_tensor_free_block_data(c);
 	xm_tensor_free(a);
 	xm_tensor_free(b);
 	xm_tensor_free(c);
-	xm_tensor_free(cc);
 	xm_allocator_destroy(allocator);
 }
 
@@ -1189,6 +1902,57 @@ make_abc_12(xm_allocator_t *allocator, xm_tensor_t **aa, xm_tensor_t **bb,
 	*cc = c;
 }
 
+static void
+make_abc_13(xm_allocator_t *allocator, xm_tensor_t **aa, xm_tensor_t **bb,
+    xm_tensor_t **cc, xm_scalar_type_t type)
+{
+	xm_dim_t idx, nblocks;
+	xm_block_space_t *bsa, *bsc;
+	xm_tensor_t *a, *b, *c;
+	const size_t o = 6, v = 5;
+
+	bsa = xm_block_space_create(xm_dim_4(o, o, v, v));
+	xm_block_space_split(bsa, 0, 2);
+	xm_block_space_split(bsa, 0, 4);
+	xm_block_space_split(bsa, 1, 2);
+	xm_block_space_split(bsa, 1, 4);
+	xm_block_space_split(bsa, 2, 3);
+	xm_block_space_split(bsa, 3, 3);
+	a = xm_tensor_create(bsa, type, allocator);
+	b = xm_tensor_create(bsa, type, allocator);
+	xm_block_space_free(bsa);
+	nblocks = xm_tensor_get_nblocks(a);
+	for (idx = xm_dim_zero(nblocks.n);
+	     xm_dim_ne(&idx, &nblocks);
+	     xm_dim_inc(&idx, &nblocks)) {
+		if (idx.i[2] <= idx.i[3])
+			xm_tensor_set_canonical_block(a, idx);
+		if (idx.i[0] != 1 || idx.i[3] != 0)
+			xm_tensor_set_canonical_block(b, idx);
+	}
+	for (idx = xm_dim_zero(nblocks.n);
+	     xm_dim_ne(&idx, &nblocks);
+	     xm_dim_inc(&idx, &nblocks))
+		if (idx.i[2] > idx.i[3])
+			xm_tensor_set_derivative_block(a, idx,
+			    xm_dim_4(idx.i[0], idx.i[1], idx.i[3], idx.i[2]),
+			    xm_dim_4(0, 1, 3, 2), -1);
+
+	bsc = xm_block_space_create(xm_dim_3(o, o, o));
+	xm_block_space_split(bsc, 0, 2);
+	xm_block_space_split(bsc, 0, 4);
+	xm_block_space_split(bsc, 1, 2);
+	xm_block_space_split(bsc, 1, 4);
+	xm_block_space_split(bsc, 2, 2);
+	xm_block_space_split(bsc, 2, 4);
+	c = xm_tensor_create_canonical(bsc, type, allocator);
+	xm_block_space_free(bsc);
+
+	*aa = a;
+	*bb = b;
+	*cc = c;
+}
+
 static void
 test_unfold_1(const char *path, xm_scalar_type_t type)
 {
@@ -1450,6 +2214,74 @@ test_unfold_3(const char *path, xm_scalar_type_t type)
 	xm_allocator_destroy(allocator);
 }
 
+static void
+test_unfold_4(const char *path, xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_block_space_t *bs;
+	xm_tensor_t *t, *u;
+	xm_scalar_t x, y;
+	size_t i, j, k, ni = 64, nj = 256, nk = 256;
+	void *buf1, *buf2, *buf3;
+
+	/* large block to exercise multithreaded fold/unfold */
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	bs = xm_block_space_create(xm_dim_3(ni, nj, nk));
+	assert(bs);
+	t = xm_tensor_create_canonical(bs, type, allocator);
+	assert(t);
+	xm_block_space_free(bs);
+	bs = xm_block_space_create(xm_dim_3(nk, nj, ni));
+	assert(bs);
+	u = xm_tensor_create_canonical(bs, type, allocator);
+	assert(u);
+	xm_block_space_free(bs);
+	bs = NULL;
+	fill_random(t);
+	buf1 = malloc(xm_tensor_get_largest_block_bytes(t));
+	assert(buf1);
+	buf2 = malloc(xm_tensor_get_largest_block_bytes(t));
+	assert(buf2);
+	buf3 = malloc(xm_tensor_get_largest_block_bytes(t));
+	assert(buf3);
+
+	xm_tensor_read_block(t, xm_dim_zero(3), buf1);
+	xm_tensor_unfold_block(t, xm_dim_zero(3), xm_dim_2(2, 0),
+	    xm_dim_1(1), buf1, buf2, nk*ni);
+	for (i = 0; i < ni; i++)
+	for (j = 0; j < nj; j++)
+	for (k = 0; k < nk; k++) {
+		x = xm_scalar_get_element(buf1, i + ni*j + ni*nj*k, type);
+		y = xm_scalar_get_element(buf2, k + nk*i + nk*ni*j, type);
+		if (x != y)
+			fatal("elements are not equal");
+	}
+	xm_tensor_fold_block(t, xm_dim_zero(3), xm_dim_2(2, 0),
+	    xm_dim_1(1), buf2, buf3, nk*ni);
+	if (memcmp(buf1, buf3, xm_tensor_get_largest_block_bytes(t)))
+		fatal("blocks are not equal");
+
+	xm_copy(u, 1, t, "kji", "ijk");
+	xm_tensor_read_block(u, xm_dim_zero(3), buf2);
+	for (i = 0; i < ni; i++)
+	for (j = 0; j < nj; j++)
+	for (k = 0; k < nk; k++) {
+		x = xm_scalar_get_element(buf1, i + ni*j + ni*nj*k, type);
+		y = xm_scalar_get_element(buf2, k + nk*j + nk*nj*i, type);
+		if (x != y)
+			fatal("elements are not equal");
+	}
+	free(buf1);
+	free(buf2);
+	free(buf3);
+	xm_tensor_free_block_data(t);
+	xm_tensor_free_block_data(u);
+	xm_tensor_free(t);
+	xm_tensor_free(u);
+	xm_allocator_destroy(allocator);
+}
+
 static void
 test_copy_1(const char *path, xm_scalar_type_t type)
 {
@@ -1860,10 +2692,286 @@ test_set(const char *path, xm_scalar_type_t type)
 	xm_allocator_destroy(allocator);
 }
 
+static void
+test_screening(const char *path, xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_block_space_t *bsa, *bsb, *bsc;
+	xm_tensor_t *a, *a2, *b, *c, *cc;
+	xm_scalar_t alpha = random_scalar(type), beta = random_scalar(type);
+	void *buf;
+	int rank = 0;
+
+#ifdef XM_USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	bsa = xm_block_space_create(xm_dim_2(6, 8));
+	assert(bsa);
+	xm_block_space_split(bsa, 1, 4);
+	bsb = xm_block_space_create(xm_dim_2(8, 5));
+	assert(bsb);
+	xm_block_space_split(bsb, 0, 4);
+	bsc = xm_block_space_create(xm_dim_2(6, 5));
+	assert(bsc);
+	a = xm_tensor_create_canonical(bsa, type, allocator);
+	a2 = xm_tensor_create(bsa, type, allocator);
+	xm_tensor_set_canonical_block(a2, xm_dim_2(0, 0));
+	b = xm_tensor_create_canonical(bsb, type, allocator);
+	c = xm_tensor_create_canonical(bsc, type, allocator);
+	xm_block_space_free(bsa);
+	xm_block_space_free(bsb);
+	xm_block_space_free(bsc);
+	fill_random(a);
+	fill_random(b);
+	fill_random(c);
+	buf = malloc(xm_tensor_get_largest_block_bytes(a));
+	assert(buf);
+	xm_tensor_read_block(a, xm_dim_2(0, 0), buf);
+	xm_tensor_write_block(a2, xm_dim_2(0, 0), buf);
+	xm_tensor_read_block(a, xm_dim_2(0, 1), buf);
+	xm_scalar_scale(buf, 1.0e-6, xm_tensor_get_block_size(a,
+	    xm_dim_2(0, 1)), type);
+	xm_tensor_write_block(a, xm_dim_2(0, 1), buf);
+	if (xm_tensor_get_block_norm(a, xm_dim_2(0, 1)) > 1.0e-5 ||
+	    xm_tensor_get_block_norm(a2, xm_dim_2(0, 1)) != 0)
+		fatal("unexpected block norm");
+
+	cc = xm_tensor_create_structure(c, type, allocator);
+	xm_copy(cc, 1, c, "ij", "ij");
+	xm_contract_set_threshold(1.0e-3);
+	xm_contract(alpha, a, b, beta, cc, "ik", "kj", "ij");
+	xm_contract_set_threshold(0);
+	xm_contract(alpha, a2, b, beta, c, "ik", "kj", "ij");
+	compare_tensors(c, cc);
+
+	/* a block written by one process is screened by its new norm
+	 * everywhere */
+	if (rank == 0) {
+		xm_tensor_read_block(a, xm_dim_2(0, 0), buf);
+		xm_tensor_write_block(a, xm_dim_2(0, 1), buf);
+	}
+#ifdef XM_USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+	xm_contract_set_threshold(1.0e-3);
+	xm_contract(alpha, a, b, 0, cc, "ik", "kj", "ij");
+	xm_contract_set_threshold(0);
+	if (xm_tensor_get_block_norm(a, xm_dim_2(0, 1)) < 1.0e-3)
+		fatal("unexpected block norm");
+	xm_contract(alpha, a, b, 0, c, "ik", "kj", "ij");
+	compare_tensors(c, cc);
+	free(buf);
+
+	xm_tensor_free_block_data(a);
+	xm_tensor_free_block_data(a2);
+	xm_tensor_free_block_data(b);
+	xm_tensor_free_block_data(c);
+	xm_tensor_free_block_data(cc);
+	xm_tensor_free(a);
+	xm_tensor_free(a2);
+	xm_tensor_free(b);
+	xm_tensor_free(c);
+	xm_tensor_free(cc);
+	xm_allocator_destroy(allocator);
+}
+
+static void
+test_prune(const char *path, xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_block_space_t *bs;
+	xm_tensor_t *t, *u;
+	void *buf;
+
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	bs = xm_block_space_create(xm_dim_1(15));
+	assert(bs);
+	xm_block_space_split(bs, 0, 5);
+	xm_block_space_split(bs, 0, 10);
+	t = xm_tensor_create(bs, type, allocator);
+	assert(t);
+	xm_block_space_free(bs);
+	xm_tensor_set_canonical_block(t, xm_dim_1(0));
+	xm_tensor_set_derivative_block(t, xm_dim_1(1), xm_dim_1(0),
+	    xm_dim_identity_permutation(1), -1);
+	xm_tensor_set_canonical_block(t, xm_dim_1(2));
+	fill_random(t);
+	buf = calloc(1, xm_tensor_get_largest_block_bytes(t));
+	assert(buf);
+	xm_tensor_write_block(t, xm_dim_1(0), buf);
+	free(buf);
+	u = xm_tensor_create_structure(t, type, allocator);
+	xm_copy(u, 1, t, "i", "i");
+	if (xm_tensor_prune_blocks(t, 0) != 1)
+		fatal("unexpected number of pruned blocks");
+	if (xm_tensor_get_block_type(t, xm_dim_1(0)) != XM_BLOCK_TYPE_ZERO ||
+	    xm_tensor_get_block_type(t, xm_dim_1(1)) != XM_BLOCK_TYPE_ZERO ||
+	    xm_tensor_get_block_type(t, xm_dim_1(2)) !=
+	    XM_BLOCK_TYPE_CANONICAL)
+		fatal("unexpected block type");
+	compare_tensors(t, u);
+	if (xm_tensor_prune_blocks(t, HUGE_VAL) != 1)
+		fatal("unexpected number of pruned blocks");
+	if (xm_tensor_get_block_type(t, xm_dim_1(2)) != XM_BLOCK_TYPE_ZERO)
+		fatal("unexpected block type");
+	xm_tensor_free_block_data(t);
+	xm_tensor_free_block_data(u);
+	xm_tensor_free(t);
+	xm_tensor_free(u);
+	xm_allocator_destroy(allocator);
+}
+
+static void
+test_generated(const char *path, xm_scalar_type_t type, size_t cachebytes)
+{
+	struct generator_data gd;
+	xm_allocator_t *allocator;
+	xm_block_space_t *bs;
+	xm_tensor_t *g, *s, *b, *c, *d, *gv, *sv;
+	xm_scalar_t dg, ds;
+
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	bs = xm_block_space_create(xm_dim_2(9, 9));
+	assert(bs);
+	xm_block_space_split(bs, 0, 2);
+	xm_block_space_split(bs, 0, 5);
+	xm_block_space_split(bs, 1, 2);
+	xm_block_space_split(bs, 1, 5);
+	gd.bs = bs;
+	gd.type = type;
+	gd.ncalls = 0;
+	g = xm_tensor_create_generated(bs, type, allocator, generate_block,
+	    &gd, cachebytes);
+	assert(g);
+	xm_tensor_set_canonical_block(g, xm_dim_2(0, 0));
+	xm_tensor_set_canonical_block(g, xm_dim_2(0, 1));
+	xm_tensor_set_canonical_block(g, xm_dim_2(1, 1));
+	xm_tensor_set_canonical_block(g, xm_dim_2(1, 2));
+	xm_tensor_set_canonical_block(g, xm_dim_2(2, 2));
+	xm_tensor_set_derivative_block(g, xm_dim_2(1, 0), xm_dim_2(0, 1),
+	    xm_dim_2(1, 0), 1);
+	xm_tensor_set_derivative_block(g, xm_dim_2(2, 1), xm_dim_2(1, 2),
+	    xm_dim_2(1, 0), -1);
+	s = xm_tensor_create_structure(g, type, NULL);
+	xm_copy(s, 1, g, "ij", "ij");
+	compare_tensors(g, s);
+	b = xm_tensor_create_canonical(bs, type, allocator);
+	fill_random(b);
+	c = xm_tensor_create_canonical(bs, type, allocator);
+	d = xm_tensor_create_canonical(bs, type, allocator);
+	xm_contract(1, g, b, 0, c, "ik", "kj", "ij");
+	xm_contract(1, s, b, 0, d, "ik", "kj", "ij");
+	compare_tensors(c, d);
+	xm_add(1, c, 2, g, "ij", "ji");
+	xm_add(1, d, 2, s, "ij", "ji");
+	compare_tensors(c, d);
+	dg = xm_dot(g, b, "ij", "ij");
+	ds = xm_dot(s, b, "ij", "ij");
+	if (!scalar_eq(dg, ds, type))
+		fatal("dot products do not match");
+	gv = xm_tensor_view(g, xm_dim_2(1, 0), xm_dim_2(3, 3));
+	sv = xm_tensor_view(s, xm_dim_2(1, 0), xm_dim_2(3, 3));
+	compare_tensors(gv, sv);
+	if (cachebytes >= 81 * xm_scalar_sizeof(type) && gd.ncalls > 5)
+		fatal("cached blocks are generated more than once");
+	xm_tensor_free(gv);
+	xm_tensor_free(sv);
+	xm_tensor_free_block_data(g);
+	xm_tensor_free(g);
+	xm_tensor_free_block_data(s);
+	xm_tensor_free(s);
+	xm_tensor_free_block_data(b);
+	xm_tensor_free(b);
+	xm_tensor_free_block_data(c);
+	xm_tensor_free(c);
+	xm_tensor_free_block_data(d);
+	xm_tensor_free(d);
+	xm_block_space_free(bs);
+	xm_allocator_destroy(allocator);
+}
+
+static void
+test_view(const char *path, xm_scalar_type_t type)
+{
+	xm_allocator_t *allocator;
+	xm_block_space_t *bs;
+	xm_tensor_t *t, *u, *v, *w;
+	xm_dim_t idx, dims;
+
+	allocator = xm_allocator_create(path);
+	assert(allocator);
+	bs = xm_block_space_create(xm_dim_2(9, 9));
+	assert(bs);
+	xm_block_space_split(bs, 0, 2);
+	xm_block_space_split(bs, 0, 5);
+	xm_block_space_split(bs, 1, 2);
+	xm_block_space_split(bs, 1, 5);
+	t = xm_tensor_create(bs, type, allocator);
+	assert(t);
+	xm_block_space_free(bs);
+	xm_tensor_set_canonical_block(t, xm_dim_2(0, 0));
+	xm_tensor_set_canonical_block(t, xm_dim_2(0, 1));
+	xm_tensor_set_canonical_block(t, xm_dim_2(1, 1));
+	xm_tensor_set_canonical_block(t, xm_dim_2(1, 2));
+	xm_tensor_set_canonical_block(t, xm_dim_2(2, 2));
+	xm_tensor_set_derivative_block(t, xm_dim_2(1, 0), xm_dim_2(0, 1),
+	    xm_dim_2(1, 0), 1);
+	xm_tensor_set_derivative_block(t, xm_dim_2(2, 1), xm_dim_2(1, 2),
+	    xm_dim_2(1, 0), -1);
+	fill_random(t);
+	v = xm_tensor_view(t, xm_dim_2(1, 0), xm_dim_2(3, 3));
+	assert(v);
+	w = xm_tensor_view(v, xm_dim_2(0, 1), xm_dim_2(1, 2));
+	assert(w);
+	if (xm_tensor_get_block_type(v, xm_dim_2(0, 0)) !=
+	    XM_BLOCK_TYPE_DERIVATIVE ||
+	    xm_tensor_get_block_type(w, xm_dim_2(0, 0)) !=
+	    XM_BLOCK_TYPE_CANONICAL)
+		fatal("unexpected block type");
+	dims = xm_tensor_get_abs_dims(v);
+	if (dims.i[0] != 7 || dims.i[1] != 9)
+		fatal("unexpected view dimensions");
+	u = xm_tensor_create_structure(v, type, NULL);
+	assert(u);
+	if (xm_tensor_get_block_type(u, xm_dim_2(0, 0)) !=
+	    XM_BLOCK_TYPE_CANONICAL ||
+	    xm_tensor_get_block_type(u, xm_dim_2(1, 1)) !=
+	    XM_BLOCK_TYPE_DERIVATIVE)
+		fatal("unexpected block type");
+	xm_copy(u, 1, v, "ij", "ij");
+	idx = xm_dim_zero(dims.n);
+	while (xm_dim_ne(&idx, &dims)) {
+		xm_dim_t tidx = xm_dim_2(idx.i[0] + 2, idx.i[1]);
+		if (xm_tensor_get_element(u, idx) !=
+		    xm_tensor_get_element(t, tidx))
+			fatal("scalars do not match");
+		xm_dim_inc(&idx, &dims);
+	}
+#ifdef XM_USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+	xm_set(w, 0);
+	if (xm_tensor_get_element(t, xm_dim_2(2, 2)) != 0 ||
+	    xm_tensor_get_element(t, xm_dim_2(4, 4)) != 0)
+		fatal("view data is not shared");
+	xm_tensor_free(w);
+	xm_tensor_free(v);
+	xm_tensor_free_block_data(u);
+	xm_tensor_free(u);
+	xm_tensor_free_block_data(t);
+	xm_tensor_free(t);
+	xm_allocator_destroy(allocator);
+}
+
 static const test_fn unfold_tests[] = {
 	test_unfold_1,
 	test_unfold_2,
 	test_unfold_3,
+	test_unfold_4,
 };
 
 static const test_fn copy_tests[] = {
@@ -1956,6 +3064,12 @@ static const struct contract_test contract_tests[] = {
 	{ make_abc_12, "abcf", "acbe", "fe" },
 	{ make_abc_12, "afbc", "eabc", "fe" },
 	{ make_abc_12, "afcb", "bace", "fe" },
+	{ make_abc_12, "exyf", "efxy", "ef" },
+	{ make_abc_13, "ijab", "jkab", "ijk" },
+	{ make_abc_13, "ijab", "jkab", "kji" },
+	{ make_abc_13, "ijab", "jkab", "jik" },
+	{ make_abc_13, "ijab", "ikba", "ijk" },
+	{ make_abc_13, "ijab", "kiab", "kij" },
 };
 
 static void
@@ -1978,6 +3092,17 @@ run_tests(const char *path, xm_scalar_type_t type)
 	test_set(path, type);
 	printf("success\n");
 
+	printf("view test 1... ");
+	fflush(stdout);
+	test_view(path, type);
+	printf("success\n");
+
+	printf("generated tensor test 1... ");
+	fflush(stdout);
+	test_generated(path, type, 0);
+	test_generated(path, type, 1024 * 1024);
+	printf("success\n");
+
 	for (i = 0; i < sizeof unfold_tests / sizeof *unfold_tests; i++) {
 		printf("unfold test %zu... ", i+1);
 		fflush(stdout);
@@ -2018,6 +3143,12 @@ run_tests(const char *path, xm_scalar_type_t type)
 		test_dot(&dot_tests[i], path, type);
 		printf("success\n");
 	}
+	for (i = 0; i < sizeof add_tests / sizeof *add_tests; i++) {
+		printf("expr test %zu... ", i+1);
+		fflush(stdout);
+		test_expr(&add_tests[i], path, type);
+		printf("success\n");
+	}
 	for (i = 0; i < sizeof contract_tests / sizeof *contract_tests; i++) {
 		printf("contract test %2zu... ", i+1);
 		fflush(stdout);
@@ -2030,15 +3161,84 @@ run_tests(const char *path, xm_scalar_type_t type)
 		    random_scalar(type), random_scalar(type));
 		printf("success\n");
 	}
+	/* a tiny limit splits the stacked panels of every output block */
+	xm_contract_set_memory_limit(1);
+	for (i = 0; i < sizeof contract_tests / sizeof *contract_tests; i++) {
+		printf("stacked contract test %2zu... ", i+1);
+		fflush(stdout);
+		test_contract(&contract_tests[i], path, type,
+		    random_scalar(type), random_scalar(type));
+		printf("success\n");
+	}
+	xm_contract_set_memory_limit(256 * 1024 * 1024);
+	for (i = 0; i < sizeof contract_tests / sizeof *contract_tests; i++) {
+		printf("multi contract test %2zu... ", i+1);
+		fflush(stdout);
+		test_contract_multi(&contract_tests[i], path, type);
+		printf("success\n");
+	}
+	for (i = 0; i < sizeof contract_tests / sizeof *contract_tests; i++) {
+		printf("mixed contract test %2zu... ", i+1);
+		fflush(stdout);
+		test_contract_mixed(&contract_tests[i], path, type);
+		printf("success\n");
+	}
+	for (i = 0; i < sizeof contract_tests / sizeof *contract_tests; i++) {
+		printf("contract dot test %2zu... ", i+1);
+		fflush(stdout);
+		test_contract_dot(&contract_tests[i], path, type);
+		printf("success\n");
+	}
+	printf("einsum test 1... ");
+	fflush(stdout);
+	test_einsum(path, type);
+	printf("success\n");
+	printf("adaptive threads test 1... ");
+	fflush(stdout);
+	test_adaptive_threads(path, type);
+	printf("success\n");
+	printf("estimate test 1... ");
+	fflush(stdout);
+	test_estimate(path, type);
+	printf("success\n");
+	printf("contract structure test 1... ");
+	fflush(stdout);
+	test_contract_structure(path, type);
+	printf("success\n");
+	printf("contract epilogue test 1... ");
+	fflush(stdout);
+	test_contract_epilogue(path, type);
+	printf("success\n");
+	xm_contract_set_memory_limit(0);
+	xm_contract_set_concat_k(0);
+	for (i = 0; i < sizeof contract_tests / sizeof *contract_tests; i += 4) {
+		printf("simple contract test %2zu... ", i+1);
+		fflush(stdout);
+		test_contract(&contract_tests[i], path, type,
+		    random_scalar(type), random_scalar(type));
+		printf("success\n");
+	}
+	xm_contract_set_memory_limit(256 * 1024 * 1024);
+	xm_contract_set_concat_k(1);
+	printf("prune test 1... ");
+	fflush(stdout);
+	test_prune(path, type);
+	printf("success\n");
+	printf("screening test 1... ");
+	fflush(stdout);
+	test_screening(path, type);
+	printf("success\n");
 }
 
 int
 main(int argc, char **argv)
 {
 	const char *path = "xmpagefile";
-
 #ifdef XM_USE_MPI
-	MPI_Init(&argc, &argv);
+	int provided;
+
+	/* serialized calls let processes share work dynamically */
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
 	srand48(0);
 	puts("Testing float...");
 	run_tests(path, XM_SCALAR_FLOAT);